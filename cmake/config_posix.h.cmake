@@ -8,6 +8,8 @@
 #cmakedefine HAVE_ENDIAN_H @_HAVE_ENDIAN_H@
 #cmakedefine HAVE_BYTESWAP_H @_HAVE_BYTESWAP_H@
 #cmakedefine HAVE_COREFOUNDATION_COREFOUNDATION_H @_HAVE_COREFOUNDATION_COREFOUNDATION_H@
+#cmakedefine HAVE_PTHREAD_H @_HAVE_PTHREAD_H@
+#cmakedefine HAVE_SYS_MMAN_H @_HAVE_SYS_MMAN_H@
 
 #cmakedefine PACKAGE_NAME "@PACKAGE_NAME@"
 #cmakedefine PACKAGE_VERSION "@PACKAGE_VERSION@"
@@ -31,7 +31,7 @@ inline static
 ssize_t felica_transceive(FreefareTag tag, uint8_t *data_in, uint8_t *data_out, size_t data_out_length)
 {
     DEBUG_XFER(data_in, data_in[0], "===> ");
-    ssize_t res = nfc_initiator_transceive_bytes(tag->device, data_in, data_in[0], data_out, data_out_length, 0);
+    ssize_t res = freefare_transceive_bytes(tag, data_in, data_in[0], data_out, data_out_length, 0);
     DEBUG_XFER(data_out, res, "<=== ");
     return res;
 }
@@ -52,6 +52,12 @@ felica_tag_new(nfc_device *device, nfc_target target)
 	tag->type = FELICA;
 	tag->free_tag = felica_tag_free;
 	tag->device = device;
+	tag->transport = &freefare_nfc_transport;
+	tag->transport_data = device;
+	tag->stats = NULL;
+	tag->timeout_model = NULL;
+	tag->trace = NULL;
+	freefare_reset_tag_error(tag);
 	tag->info = target;
 	tag->active = 0;
     }
@@ -99,9 +105,10 @@ felica_read_ex(FreefareTag tag, uint16_t service, uint8_t block_count, uint8_t b
     }
 
     int cnt = felica_transceive(tag, cmd, res, sizeof(res));
-    if (cnt != 1 + 1 + 8 + 1 + 1 + 1 + 16 * block_count) {
-	return -1;
-    }
+    if (cnt < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
+    if (cnt != 1 + 1 + 8 + 1 + 1 + 1 + 16 * block_count)
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EIO);
     size_t len = MIN(res[12] * 16, length);
     memcpy(data, res + 13, len);
 
@@ -154,10 +161,18 @@ felica_write_ex(FreefareTag tag, uint16_t service, uint8_t block_count, uint8_t
 
     ssize_t cnt = felica_transceive(tag, cmd, res, sizeof(res));
 
+    if (cnt < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     if (cnt != sizeof(res))
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EIO);
+
+    if (res[10] != 0) {
+	freefare_tag_error(tag, FREEFARE_ERROR_PICC, EIO);
+	tag->error.picc_status = res[10];
 	return -1;
+    }
 
-    return res[10] == 0 ? 0 : -1;
+    return 0;
 }
 
 ssize_t
@@ -2,8 +2,16 @@
     #include "config.h"
 #endif
 
+#if defined(HAVE_PTHREAD_H)
+    #include <pthread.h>
+#endif
+
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <openssl/rand.h>
 
 #include <freefare.h>
 
@@ -13,11 +21,81 @@
 
 #define NXP_MANUFACTURER_CODE 0x04
 
+#if defined(__GNUC__)
+#  define STATS_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#  define STATS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#  define STATS_STORE(counter, n) __atomic_store_n(&(counter), (n), __ATOMIC_RELAXED)
+#else
+#  define STATS_ADD(counter, n) ((counter) += (n))
+#  define STATS_LOAD(counter) (counter)
+#  define STATS_STORE(counter, n) ((counter) = (n))
+#endif
+
+/*
+ * Allocate a FreefareTag for a SAK 0x00 target: NTAG21x, MIFARE Ultralight
+ * EV1, MIFARE Ultralight C or MIFARE Ultralight.
+ *
+ * A single GET_VERSION command tells NTAG21x and Ultralight EV1 tags apart
+ * (the latter being handled as plain Ultralight tags), and its response is
+ * kept for ntag21x_get_info().  Older tags do not support it and are told
+ * apart with the first step of the Ultralight C authentication.  The target
+ * is probed through transport.
+ */
+static FreefareTag
+ultralight_family_tag_new(nfc_device *device, nfc_target target, const struct freefare_transport *transport, void *data)
+{
+    FreefareTag tag;
+    uint8_t get_version[1] = { 0x60 };
+    uint8_t version[8];
+    uint8_t authenticate[2] = { 0x1A, 0x00 };
+    uint8_t challenge[9];
+    int version_res, auth_res = -1;
+
+    nfc_modulation modulation = {
+	.nmt = NMT_ISO14443A,
+	.nbr = NBR_106
+    };
+    transport->select(data, modulation, target.nti.nai.abtUid, target.nti.nai.szUidLen);
+    transport->set_property_bool(data, NP_EASY_FRAMING, false);
+    version_res = transport->transceive(data, get_version, sizeof(get_version), version, sizeof(version), 0);
+    if (version_res < 0) {
+	// The target does not answer anymore after an unsupported command
+	transport->deselect(data);
+	transport->select(data, modulation, target.nti.nai.abtUid, target.nti.nai.szUidLen);
+	auth_res = transport->transceive(data, authenticate, sizeof(authenticate), challenge, sizeof(challenge), 0);
+    }
+    transport->set_property_bool(data, NP_EASY_FRAMING, true);
+    transport->deselect(data);
+
+    if (version_res == sizeof(version) && version[2] == 0x03) {
+	tag = mifare_ultralight_tag_new(device, target);
+    } else if (version_res >= 0) {
+	if ((tag = ntag21x_tag_new(device, target)) && version_res == sizeof(version))
+	    ntag21x_set_version(tag, version);
+    } else if (auth_res >= 0) {
+	tag = mifare_ultralightc_tag_new(device, target);
+    } else {
+	tag = mifare_ultralight_tag_new(device, target);
+    }
+
+    return tag;
+}
+
 /*
  * Automagically allocate a FreefareTag given a device and target info.
  */
 FreefareTag
 freefare_tag_new(nfc_device *device, nfc_target target)
+{
+    return freefare_tag_new_with_transport(device, target, &freefare_nfc_transport, device);
+}
+
+/*
+ * Allocate a FreefareTag given target info, exchanging frames with the target
+ * through transport, both to identify it and once allocated.
+ */
+FreefareTag
+freefare_tag_new_with_transport(nfc_device *device, nfc_target target, const struct freefare_transport *transport, void *data)
 {
     FreefareTag tag = NULL;
 
@@ -31,15 +109,54 @@ freefare_tag_new(nfc_device *device, nfc_target target)
 	tag = mifare_classic4k_tag_new(device, target);
     } else if (mifare_desfire_taste(device, target)) {
 	tag = mifare_desfire_tag_new(device, target);
-    } else if (ntag21x_taste(device, target)) {
-	tag = ntag21x_tag_new(device, target);
-    } else if (mifare_ultralightc_taste(device, target)) {
-	tag = mifare_ultralightc_tag_new(device, target);
-    } else if (mifare_ultralight_taste(device, target)) {
+    } else if (target.nm.nmt == NMT_ISO14443A && target.nti.nai.btSak == 0x00) {
+	tag = ultralight_family_tag_new(device, target, transport, data);
+    }
+
+    if (tag) {
+	freefare_set_tag_transport(tag, transport, data);
+	// Set default timeout
+	tag->timeout = MIFARE_DEFAULT_TIMEOUT;
+    }
+
+    return tag;
+}
+
+/*
+ * Allocate a FreefareTag of the given type, without tasting the target.
+ */
+FreefareTag
+freefare_tag_new_with_type(enum freefare_tag_type type, nfc_device *device, nfc_target target)
+{
+    FreefareTag tag = NULL;
+
+    switch (type) {
+    case FELICA:
+	tag = felica_tag_new(device, target);
+	break;
+    case MIFARE_MINI:
+	tag = mifare_mini_tag_new(device, target);
+	break;
+    case MIFARE_CLASSIC_1K:
+	tag = mifare_classic1k_tag_new(device, target);
+	break;
+    case MIFARE_CLASSIC_4K:
+	tag = mifare_classic4k_tag_new(device, target);
+	break;
+    case MIFARE_DESFIRE:
+	tag = mifare_desfire_tag_new(device, target);
+	break;
+    case MIFARE_ULTRALIGHT:
 	tag = mifare_ultralight_tag_new(device, target);
+	break;
+    case MIFARE_ULTRALIGHT_C:
+	tag = mifare_ultralightc_tag_new(device, target);
+	break;
+    case NTAG_21x:
+	tag = ntag21x_tag_new(device, target);
+	break;
     }
 
-    // Set default timeout
     if (tag)
 	tag->timeout = MIFARE_DEFAULT_TIMEOUT;
 
@@ -56,17 +173,15 @@ freefare_tag_new(nfc_device *device, nfc_target target)
  */
 
 /*
- * Get a list of the MIFARE targets near to the provided NFC initiator.
- *
- * The list has to be freed using the freefare_free_tags() function.
+ * Configure the NFC initiator for polling MIFARE targets.
  */
-FreefareTag *
-freefare_get_tags(nfc_device *device)
+static int
+freefare_init_initiator(nfc_device *device)
 {
-    FreefareTag *tags = NULL;
-    int tag_count = 0;
+    int res;
 
-    nfc_initiator_init(device);
+    if ((res = nfc_initiator_init(device)) < 0)
+	return res;
 
     // Drop the field for a while
     nfc_device_set_property_bool(device, NP_ACTIVATE_FIELD, false);
@@ -76,58 +191,284 @@ freefare_get_tags(nfc_device *device)
     nfc_device_set_property_bool(device, NP_HANDLE_PARITY, true);
     nfc_device_set_property_bool(device, NP_AUTO_ISO14443_4, true);
 
+    // Only report the targets which are present when polling
+    nfc_device_set_property_bool(device, NP_INFINITE_SELECT, false);
+
     // Enable field so more power consuming cards can power themselves up
     nfc_device_set_property_bool(device, NP_ACTIVATE_FIELD, true);
 
-    // Poll for a ISO14443A (MIFARE) tag
+    return 0;
+}
+
+/*
+ * libnfc polling
+ */
+
+static int
+nfc_poll_init(void *data)
+{
+    return freefare_init_initiator(data);
+}
+
+static int
+nfc_poll_select(void *data, nfc_modulation modulation, nfc_target *target, void **tag_data)
+{
+    *tag_data = data;
+    return nfc_initiator_select_passive_target(data, modulation, NULL, 0, target);
+}
+
+static const struct freefare_initiator freefare_nfc_initiator = {
+    .init = nfc_poll_init,
+    .select_passive_target = nfc_poll_select,
+    .transport = &freefare_nfc_transport,
+};
+
+/*
+ * Warm polling
+ *
+ * A poller configures the NFC initiator on first use only, and then polls
+ * for targets without dropping the field.  The initiator is configured again
+ * when a poll fails.
+ */
+
+struct freefare_poller {
+    nfc_device *device;
+    const struct freefare_initiator *initiator;
+    void *initiator_data;
+    bool initialized;
+};
+
+/*
+ * Poll targets of the given modulation one at a time and pass each supported
+ * tag to callback, counting them in tag_count.  Returns 1 if the callback
+ * asked to stop, 0 when all targets have been polled, -1 on error.
+ */
+static int
+freefare_poll_targets(const struct freefare_poller *poller, nfc_modulation modulation, int (*callback)(FreefareTag tag, void *data), void *data, int *tag_count)
+{
+    const struct freefare_initiator *initiator = poller->initiator;
     nfc_target candidates[MAX_CANDIDATES];
-    int candidates_count;
-    nfc_modulation modulation = {
-	.nmt = NMT_ISO14443A,
-	.nbr = NBR_106
-    };
-    if ((candidates_count = nfc_initiator_list_passive_targets(device, modulation, candidates, MAX_CANDIDATES)) < 0)
-	return NULL;
+    int candidates_count = 0;
+    int res;
+
+    while (candidates_count < MAX_CANDIDATES) {
+	nfc_target *candidate = &candidates[candidates_count];
+	void *tag_data;
 
-    tags = malloc(sizeof(void *));
-    if (!tags) return NULL;
-    tags[0] = NULL;
+	if ((res = initiator->select_passive_target(poller->initiator_data, modulation, candidate, &tag_data)) < 0)
+	    return -1;
+	if (res == 0)
+	    break;
+
+	// A target we have already seen means all targets have been polled
+	bool seen = false;
+	for (int c = 0; c < candidates_count; c++) {
+	    if (memcmp(&candidates[c], candidate, sizeof(*candidate)) == 0)
+		seen = true;
+	}
+	if (seen)
+	    break;
+	candidates_count++;
+
+	// Halt the target so that it does not answer the next poll
+	initiator->transport->deselect(tag_data);
 
-    for (int c = 0; c < candidates_count; c++) {
 	FreefareTag t;
-	if ((t = freefare_tag_new(device, candidates[c]))) {
-	    /* (Re)Allocate memory for the found MIFARE targets array */
-	    FreefareTag *p = realloc(tags, (tag_count + 2) * sizeof(FreefareTag));
-	    if (p)
-		tags = p;
-	    else
-		return tags; // FAIL! Return what has been found so far.
-	    tags[tag_count++] = t;
-	    tags[tag_count] = NULL;
+	if ((t = freefare_tag_new_with_transport(poller->device, *candidate, initiator->transport, tag_data))) {
+	    (*tag_count)++;
+	    if (callback(t, data))
+		return 1;
 	}
+
+	// Deselecting FeliCa targets has no effect
+	if (modulation.nmt == NMT_FELICA)
+	    break;
     }
 
+    return 0;
+}
+
+static int
+freefare_poll_tags(const struct freefare_poller *poller, int (*callback)(FreefareTag tag, void *data), void *data, int *tag_count)
+{
+    int res;
+
+    // Poll for a ISO14443A (MIFARE) tag
+    nfc_modulation modulation = {
+	.nmt = NMT_ISO14443A,
+	.nbr = NBR_106
+    };
+    if ((res = freefare_poll_targets(poller, modulation, callback, data, tag_count)))
+	return res < 0 ? -1 : 0;
+
     // Poll for a FELICA tag
     modulation.nmt = NMT_FELICA;
     modulation.nbr = NBR_424; // FIXME NBR_212 should also be supported
-    if ((candidates_count = nfc_initiator_list_passive_targets(device, modulation, candidates, MAX_CANDIDATES)) < 0)
+    if ((res = freefare_poll_targets(poller, modulation, callback, data, tag_count)))
+	return res < 0 ? -1 : 0;
+
+    return 0;
+}
+
+/*
+ * Enumerate the MIFARE targets near to the provided NFC initiator, calling
+ * callback for each of them as soon as it is identified.
+ *
+ * The callback takes ownership of the tag and returns non-zero to stop the
+ * enumeration.
+ */
+int
+freefare_enumerate_tags(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data)
+{
+    struct freefare_poller poller = {
+	.device = device,
+	.initiator = &freefare_nfc_initiator,
+	.initiator_data = device,
+    };
+    int tag_count = 0;
+
+    if (freefare_init_initiator(device) < 0)
+	return -1;
+
+    if (freefare_poll_tags(&poller, callback, data, &tag_count) < 0)
+	return -1;
+
+    return tag_count;
+}
+
+struct tag_list {
+    FreefareTag *tags;
+    int tag_count;
+};
+
+static bool
+tag_list_init(struct tag_list *list)
+{
+    list->tags = malloc(sizeof(void *));
+    if (!list->tags) return false;
+    list->tags[0] = NULL;
+    list->tag_count = 0;
+
+    return true;
+}
+
+static int
+tag_list_append(FreefareTag tag, void *data)
+{
+    struct tag_list *list = data;
+
+    /* (Re)Allocate memory for the found targets array */
+    FreefareTag *p = realloc(list->tags, (list->tag_count + 2) * sizeof(FreefareTag));
+    if (!p) {
+	freefare_free_tag(tag);
+	return 1; // FAIL! Return what has been found so far.
+    }
+    list->tags = p;
+    list->tags[list->tag_count++] = tag;
+    list->tags[list->tag_count] = NULL;
+
+    return 0;
+}
+
+/*
+ * Get a list of the MIFARE targets near to the provided NFC initiator.
+ *
+ * The list has to be freed using the freefare_free_tags() function.
+ */
+FreefareTag *
+freefare_get_tags(nfc_device *device)
+{
+    struct tag_list list;
+
+    if (!tag_list_init(&list))
 	return NULL;
 
-    for (int c = 0; c < candidates_count; c++) {
-	FreefareTag t;
-	if ((t = freefare_tag_new(device, candidates[c]))) {
-	    /* (Re)Allocate memory for the found FELICA targets array */
-	    FreefareTag *p = realloc(tags, (tag_count + 2) * sizeof(FreefareTag));
-	    if (p)
-		tags = p;
-	    else
-		return tags; // FAIL! Return what has been found so far.
-	    tags[tag_count++] = t;
-	    tags[tag_count] = NULL;
+    if (freefare_enumerate_tags(device, tag_list_append, &list) < 0) {
+	freefare_free_tags(list.tags);
+	return NULL;
+    }
+
+    return list.tags;
+}
+
+FreefarePoller
+freefare_poller_new(nfc_device *device)
+{
+    FreefarePoller poller;
+
+    if ((poller = malloc(sizeof(*poller)))) {
+	poller->device = device;
+	poller->initiator = &freefare_nfc_initiator;
+	poller->initiator_data = device;
+	poller->initialized = false;
+    }
+
+    return poller;
+}
+
+/*
+ * Poll for targets with initiator instead of the NFC device of poller, e.g.
+ * to find emulated tags.
+ */
+void
+freefare_poller_set_initiator(FreefarePoller poller, const struct freefare_initiator *initiator, void *data)
+{
+    poller->initiator = initiator;
+    poller->initiator_data = data;
+    poller->initialized = false;
+}
+
+int
+freefare_poller_enumerate_tags(FreefarePoller poller, int (*callback)(FreefareTag tag, void *data), void *data)
+{
+    int tag_count = 0;
+
+    if (!poller->initialized) {
+	if (poller->initiator->init(poller->initiator_data) < 0)
+	    return -1;
+	poller->initialized = true;
+    }
+
+    if (freefare_poll_tags(poller, callback, data, &tag_count) < 0) {
+	poller->initialized = false;
+
+	// Tags already handed over to the callback cannot be polled again
+	if (tag_count)
+	    return -1;
+
+	if (poller->initiator->init(poller->initiator_data) < 0)
+	    return -1;
+	poller->initialized = true;
+
+	if (freefare_poll_tags(poller, callback, data, &tag_count) < 0) {
+	    poller->initialized = false;
+	    return -1;
 	}
     }
 
-    return tags;
+    return tag_count;
+}
+
+FreefareTag *
+freefare_poller_get_tags(FreefarePoller poller)
+{
+    struct tag_list list;
+
+    if (!tag_list_init(&list))
+	return NULL;
+
+    if (freefare_poller_enumerate_tags(poller, tag_list_append, &list) < 0) {
+	freefare_free_tags(list.tags);
+	return NULL;
+    }
+
+    return list.tags;
+}
+
+void
+freefare_poller_free(FreefarePoller poller)
+{
+    free(poller);
 }
 
 /*
@@ -215,6 +556,214 @@ freefare_set_tag_timeout(FreefareTag tag, int timeout)
     tag->timeout = timeout;
 }
 
+/*
+ * Attach a transport backend to the provided tag.
+ */
+void
+freefare_set_tag_transport(FreefareTag tag, const struct freefare_transport *transport, void *data)
+{
+    tag->transport = transport;
+    tag->transport_data = data;
+}
+
+/*
+ * Start or stop recording I/O statistics for the provided tag.
+ */
+int
+freefare_enable_tag_stats(FreefareTag tag, bool enable)
+{
+    if (enable && !tag->stats) {
+	if (!(tag->stats = calloc(1, sizeof(*tag->stats))))
+	    return errno = ENOMEM, -1;
+    } else if (!enable) {
+	free(tag->stats);
+	tag->stats = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the I/O statistics recorded for the provided tag.
+ */
+int
+freefare_get_tag_stats(FreefareTag tag, struct freefare_tag_stats *stats)
+{
+    if (!tag->stats)
+	return errno = EINVAL, -1;
+
+    const uint64_t *src = (const uint64_t *) tag->stats;
+    uint64_t *dst = (uint64_t *) stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+	dst[i] = STATS_LOAD(src[i]);
+
+    return 0;
+}
+
+/*
+ * Clear the I/O statistics recorded for the provided tag.
+ */
+void
+freefare_reset_tag_stats(FreefareTag tag)
+{
+    if (!tag->stats)
+	return;
+
+    uint64_t *p = (uint64_t *) tag->stats;
+    for (size_t i = 0; i < sizeof(*tag->stats) / sizeof(uint64_t); i++)
+	STATS_STORE(p[i], 0);
+}
+
+/*
+ * Adaptive timeouts
+ *
+ * The round-trip time of each command code is smoothed with an exponentially
+ * weighted moving average of gain 1/8 (as TCP does), and the timeout of the
+ * next exchange is that average times the multiplier of the model.  An
+ * exchange exceeding its timeout doubles the average, so that commands that
+ * became slower (e.g. writes to larger files) are learnt again instead of
+ * failing forever.  Commands which were never seen use the ceiling.
+ */
+struct freefare_timeout_model {
+    unsigned int multiplier;
+    int floor;
+    int ceiling;
+    struct {
+	uint64_t srtt_us;
+	bool learnt;
+    } commands[256];
+};
+
+FreefareTimeoutModel
+freefare_timeout_model_new(unsigned int multiplier, int floor, int ceiling)
+{
+    FreefareTimeoutModel model;
+
+    if (!multiplier)
+	multiplier = TIMEOUT_MODEL_DEFAULT_MULTIPLIER;
+    if (!floor)
+	floor = TIMEOUT_MODEL_DEFAULT_FLOOR;
+    if (!ceiling)
+	ceiling = MIFARE_DEFAULT_TIMEOUT;
+
+    if ((floor < 0) || (ceiling < floor)) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    if (!(model = calloc(1, sizeof(*model))))
+	return NULL;
+
+    model->multiplier = multiplier;
+    model->floor = floor;
+    model->ceiling = ceiling;
+
+    return model;
+}
+
+/*
+ * Return the timeout (ms) of the next exchange of the given command.
+ */
+int
+freefare_timeout_model_get_timeout(FreefareTimeoutModel model, uint8_t command)
+{
+    if (!model->commands[command].learnt)
+	return model->ceiling;
+
+    uint64_t timeout = (model->commands[command].srtt_us * model->multiplier + 999) / 1000;
+
+    if (timeout < (uint64_t) model->floor)
+	return model->floor;
+    if (timeout > (uint64_t) model->ceiling)
+	return model->ceiling;
+    return timeout;
+}
+
+static void
+timeout_model_record(FreefareTimeoutModel model, uint8_t command, int res, uint64_t rtt_ns, int timeout)
+{
+    uint64_t rtt_us = rtt_ns / 1000;
+    uint64_t *srtt_us = &model->commands[command].srtt_us;
+
+    if (res >= 0) {
+	if (model->commands[command].learnt) {
+	    *srtt_us = *srtt_us - (*srtt_us >> 3) + (rtt_us >> 3);
+	} else {
+	    *srtt_us = rtt_us;
+	    model->commands[command].learnt = true;
+	}
+    } else if (model->commands[command].learnt && ((NFC_ETIMEOUT == res) || (rtt_us >= (uint64_t) timeout * 1000))) {
+	*srtt_us = MIN(2 * *srtt_us + 1, (uint64_t) model->ceiling * 1000 / model->multiplier + 1);
+    }
+}
+
+void
+freefare_timeout_model_free(FreefareTimeoutModel model)
+{
+    free(model);
+}
+
+/*
+ * Bound the exchanges with the provided tag by the timeouts of model, or by
+ * the timeouts given by the family code when model is NULL.  The model shall
+ * outlive the tag.
+ */
+void
+freefare_set_tag_timeout_model(FreefareTag tag, FreefareTimeoutModel model)
+{
+    tag->timeout_model = model;
+}
+
+/*
+ * Record the failure of the current operation on the provided tag, and return
+ * -1 with errno set to error.
+ */
+int
+freefare_tag_error(FreefareTag tag, enum freefare_error_source source, int error)
+{
+    struct freefare_error_info *info = &tag->error;
+
+    memset(info, 0, sizeof(*info));
+    info->source = source;
+    info->error = error;
+
+    if (FREEFARE_ERROR_LOCAL != source) {
+	info->command = tag->command;
+	info->frame = tag->frame;
+	switch (tag->type) {
+	case MIFARE_DESFIRE:
+	    info->picc_status = MIFARE_DESFIRE(tag)->last_picc_error;
+	    info->pcd_status = MIFARE_DESFIRE(tag)->last_pcd_error;
+	    break;
+	case NTAG_21x:
+	    info->pcd_status = NTAG_21x(tag)->last_error;
+	    break;
+	}
+    }
+
+    return errno = error, -1;
+}
+
+/*
+ * Copy the record of the last failure of the provided tag.
+ */
+void
+freefare_get_tag_error(FreefareTag tag, struct freefare_error_info *info)
+{
+    *info = tag->error;
+}
+
+/*
+ * Clear the record of the last failure of the provided tag.
+ */
+void
+freefare_reset_tag_error(FreefareTag tag)
+{
+    memset(&tag->error, 0, sizeof(tag->error));
+    tag->command = 0;
+    tag->frame = 0;
+}
+
 /*
  * Free the provided tag.
  */
@@ -222,6 +771,9 @@ void
 freefare_free_tag(FreefareTag tag)
 {
     if (tag) {
+	if (tag->trace)
+	    freefare_trace_flush(tag->trace);
+	free(tag->stats);
 	tag->free_tag(tag);
     }
 }
@@ -240,7 +792,7 @@ const char *
 freefare_strerror(FreefareTag tag)
 {
     const char *p = "Unknown error";
-    if (nfc_device_get_last_error(tag->device) < 0) {
+    if (tag->device && nfc_device_get_last_error(tag->device) < 0) {
 	p = nfc_strerror(tag->device);
     } else {
 	if (tag->type == MIFARE_DESFIRE) {
@@ -287,6 +839,253 @@ freefare_free_tags(FreefareTag *tags)
  * Low-level API
  */
 
+/*
+ * libnfc transport
+ */
+
+static int
+nfc_transport_transceive(void *data, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout)
+{
+    return nfc_initiator_transceive_bytes(data, tx, tx_len, rx, rx_len, timeout);
+}
+
+static int
+nfc_transport_select(void *data, nfc_modulation modulation, const uint8_t *uid, size_t uid_len)
+{
+    nfc_target pnti;
+
+    return nfc_initiator_select_passive_target(data, modulation, uid, uid_len, &pnti);
+}
+
+static int
+nfc_transport_deselect(void *data)
+{
+    return nfc_initiator_deselect_target(data);
+}
+
+static int
+nfc_transport_set_property_bool(void *data, nfc_property property, bool enable)
+{
+    return nfc_device_set_property_bool(data, property, enable);
+}
+
+/*
+ * Payload of a normal PN53x frame, which all libnfc drivers support.
+ */
+#define NFC_TRANSPORT_MAX_FRAME_SIZE 252
+
+const struct freefare_transport freefare_nfc_transport = {
+    .transceive = nfc_transport_transceive,
+    .select = nfc_transport_select,
+    .deselect = nfc_transport_deselect,
+    .set_property_bool = nfc_transport_set_property_bool,
+    .max_frame_size = NFC_TRANSPORT_MAX_FRAME_SIZE,
+};
+
+/*
+ * Random bytes
+ *
+ * Authentication nonces are drawn from a per-thread pool of random bytes
+ * which is refilled in bulk.  A forked child only has the thread that called
+ * fork(), whose pool is discarded so that the child never reuses nonces of
+ * its parent.
+ */
+
+#if defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+
+#define RANDOM_POOL_SIZE 256
+
+static __thread uint8_t random_pool[RANDOM_POOL_SIZE];
+static __thread size_t random_pool_n;
+static pthread_once_t random_pool_once = PTHREAD_ONCE_INIT;
+
+static void
+random_pool_discard(void)
+{
+    memset(random_pool, 0, sizeof(random_pool));
+    random_pool_n = 0;
+}
+
+static void
+random_pool_init(void)
+{
+    pthread_atfork(NULL, NULL, random_pool_discard);
+}
+
+static int
+random_pool_bytes(uint8_t *buf, size_t n)
+{
+    pthread_once(&random_pool_once, random_pool_init);
+
+    if (n > sizeof(random_pool))
+	return RAND_bytes(buf, n);
+
+    if (random_pool_n < n) {
+	if (1 != RAND_bytes(random_pool, sizeof(random_pool)))
+	    return 0;
+	random_pool_n = sizeof(random_pool);
+    }
+
+    random_pool_n -= n;
+    memcpy(buf, random_pool + random_pool_n, n);
+    memset(random_pool + random_pool_n, 0, n);
+
+    return 1;
+}
+
+#else
+
+static int
+random_pool_bytes(uint8_t *buf, size_t n)
+{
+    return RAND_bytes(buf, n);
+}
+
+#endif
+
+/*
+ * Draw n random bytes for an exchange with the provided tag.  They are
+ * recorded in the trace of the tag, if any, and tags replaying a trace get
+ * the bytes recorded in it.  Returns 1 on success, like RAND_bytes().
+ */
+int
+freefare_random_bytes(FreefareTag tag, uint8_t *buf, size_t n)
+{
+    int res;
+
+    if ((res = freefare_trace_replay_random(tag, buf, n)) < 0)
+	return 0;
+    if (!res && (1 != random_pool_bytes(buf, n)))
+	return 0;
+
+    if (tag->trace)
+	freefare_trace_random(tag, buf, n);
+
+    return 1;
+}
+
+/*
+ * I/O statistics
+ *
+ * Counters are only ever updated by the thread exchanging frames with the tag
+ * but may be read concurrently, hence relaxed atomic accesses (see STATS_ADD).
+ */
+
+uint64_t
+freefare_stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+freefare_stats_crypto(struct freefare_crypto_stats *stats, uint64_t start)
+{
+    STATS_ADD(stats->calls, 1);
+    STATS_ADD(stats->time_ns, freefare_stats_clock() - start);
+}
+
+/*
+ * Command code of a frame: the native command byte for DESFire (wrapped in
+ * ISO 7816-4 APDUs) and FeliCa (following the length byte) tags, the first
+ * byte otherwise.
+ */
+static uint8_t
+frame_command(FreefareTag tag, const uint8_t *tx, size_t tx_len)
+{
+    if (tx_len > 1 && (tag->type == MIFARE_DESFIRE || tag->type == FELICA))
+	return tx[1];
+    else if (tx_len > 0)
+	return tx[0];
+
+    return 0x00;
+}
+
+static void
+stats_record_frame(FreefareTag tag, const uint8_t *tx, size_t tx_len, int res, uint64_t rtt)
+{
+    struct freefare_command_stats *stats = &tag->stats->commands[frame_command(tag, tx, tx_len)];
+
+    STATS_ADD(stats->frames, 1);
+    STATS_ADD(stats->bytes_sent, tx_len);
+    if (res < 0)
+	STATS_ADD(stats->errors, 1);
+    else
+	STATS_ADD(stats->bytes_received, res);
+    STATS_ADD(stats->rtt_ns, rtt);
+
+    int bucket = 0;
+    for (uint64_t us = rtt / 1000; us > 1 && bucket < FREEFARE_STATS_RTT_BUCKETS - 1; us >>= 1)
+	bucket++;
+    STATS_ADD(stats->rtt_histogram[bucket], 1);
+}
+
+/*
+ * Frame exchange with the tag through its transport.
+ */
+
+int
+freefare_transceive_bytes(FreefareTag tag, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout)
+{
+    // Additional frames continue the current command
+    uint8_t code = frame_command(tag, tx, tx_len);
+    if (ADDITIONAL_FRAME == code) {
+	tag->frame++;
+    } else {
+	tag->command = code;
+	tag->frame = 0;
+    }
+
+    if (tag->timeout_model)
+	timeout = freefare_timeout_model_get_timeout(tag->timeout_model, tag->command);
+
+    if (!tag->stats && !tag->timeout_model && !tag->trace)
+	return tag->transport->transceive(tag->transport_data, tx, tx_len, rx, rx_len, timeout);
+
+    uint64_t start = freefare_stats_clock();
+    int res = tag->transport->transceive(tag->transport_data, tx, tx_len, rx, rx_len, timeout);
+    uint64_t end = freefare_stats_clock();
+    if (tag->stats)
+	stats_record_frame(tag, tx, tx_len, res, end - start);
+    if (tag->timeout_model)
+	timeout_model_record(tag->timeout_model, tag->command, res, end - start, timeout);
+    if (tag->trace)
+	freefare_trace_frame(tag, tx, tx_len, rx, res, start, end);
+
+    return res;
+}
+
+int
+freefare_select_target(FreefareTag tag, nfc_modulation modulation)
+{
+    const uint8_t *uid;
+    size_t uid_len;
+
+    if (modulation.nmt == NMT_FELICA) {
+	uid = tag->info.nti.nfi.abtId;
+	uid_len = 8;
+    } else {
+	uid = tag->info.nti.nai.abtUid;
+	uid_len = tag->info.nti.nai.szUidLen;
+    }
+
+    return tag->transport->select(tag->transport_data, modulation, uid, uid_len);
+}
+
+int
+freefare_deselect_target(FreefareTag tag)
+{
+    return tag->transport->deselect(tag->transport_data);
+}
+
+int
+freefare_set_property_bool(FreefareTag tag, nfc_property property, bool enable)
+{
+    return tag->transport->set_property_bool(tag->transport_data, property, enable);
+}
+
 void *
 memdup(const void *p, const size_t n)
 {
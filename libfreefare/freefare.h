@@ -42,6 +42,7 @@ typedef uint8_t MifareUltralightPageNumber;
 typedef unsigned char MifareUltralightPage[4];
 
 FreefareTag	*freefare_get_tags(nfc_device *device);
+int		 freefare_enumerate_tags(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data);
 FreefareTag	 freefare_tag_new(nfc_device *device, nfc_target target);
 enum freefare_tag_type freefare_get_tag_type(FreefareTag tag);
 const char	*freefare_get_tag_friendly_name(FreefareTag tag);
@@ -51,12 +52,198 @@ void		 freefare_free_tags(FreefareTag *tags);
 bool		 freefare_selected_tag_is_present(nfc_device *device);
 void		 freefare_set_tag_timeout(FreefareTag tag, int timeout);
 
+struct freefare_poller;
+typedef struct freefare_poller *FreefarePoller;
+
+FreefarePoller	 freefare_poller_new(nfc_device *device);
+FreefareTag	*freefare_poller_get_tags(FreefarePoller poller);
+int		 freefare_poller_enumerate_tags(FreefarePoller poller, int (*callback)(FreefareTag tag, void *data), void *data);
+void		 freefare_poller_free(FreefarePoller poller);
+
+struct freefare_reader_pool;
+typedef struct freefare_reader_pool *FreefareReaderPool;
+
+FreefareReaderPool freefare_reader_pool_new(nfc_device *devices[], size_t device_count, unsigned int max_jobs, int (*job)(FreefareTag tag, void *data), void *data);
+int		 freefare_reader_pool_start(FreefareReaderPool pool);
+int		 freefare_reader_pool_stop(FreefareReaderPool pool);
+bool		 freefare_reader_pool_is_running(FreefareReaderPool pool);
+void		 freefare_reader_pool_free(FreefareReaderPool pool);
+
+struct freefare_async;
+typedef struct freefare_async *FreefareAsync;
+
+FreefareAsync	 freefare_async_new(void);
+int		 freefare_async_submit(FreefareAsync async, FreefareTag tag, ssize_t (*command)(FreefareTag tag, void *arg), void *arg, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data);
+int		 freefare_async_get_fd(FreefareAsync async);
+size_t		 freefare_async_pending(FreefareAsync async);
+int		 freefare_async_dispatch(FreefareAsync async);
+void		 freefare_async_free(FreefareAsync async);
+
 const char	*freefare_version(void);
 
 const char	*freefare_strerror(FreefareTag tag);
 int		 freefare_strerror_r(FreefareTag tag, char *buffer, size_t len);
 void		 freefare_perror(FreefareTag tag, const char *string);
 
+/*
+ * Per-tag record of the last failure.  Functions failing with errno set also
+ * describe the failure in the tag they operate on, so that it can be examined
+ * later or from another thread.
+ *
+ * command is the command code of the exchange that failed (the native command
+ * byte for DESFire and FeliCa tags), and frame the index of the failing frame
+ * for commands spanning several ones (0 for the first frame).  picc_status and
+ * pcd_status are the status codes reported by mifare_desfire_last_picc_error()
+ * and mifare_desfire_last_pcd_error() (ntag21x_last_error() for NTAG21x tags)
+ * at the time of the failure.
+ */
+enum freefare_error_source {
+    FREEFARE_ERROR_NONE,
+    FREEFARE_ERROR_LOCAL,	/* Rejected before anything was sent to the tag */
+    FREEFARE_ERROR_TRANSPORT,	/* The frame exchange with the tag failed */
+    FREEFARE_ERROR_PICC,	/* The tag returned an error status */
+    FREEFARE_ERROR_RESPONSE,	/* The response of the tag was rejected */
+};
+
+struct freefare_error_info {
+    enum freefare_error_source source;
+    int error;
+    uint8_t command;
+    size_t frame;
+    uint8_t picc_status;
+    uint8_t pcd_status;
+};
+
+void		 freefare_get_tag_error(FreefareTag tag, struct freefare_error_info *info);
+void		 freefare_reset_tag_error(FreefareTag tag);
+
+/*
+ * Every frame exchanged with a tag goes through the transport attached to it.
+ * Tags are bound to freefare_nfc_transport (libnfc) when created; an
+ * alternative backend can be plugged with freefare_set_tag_transport().
+ *
+ * max_frame_size is the largest payload the backend can send or receive in a
+ * single exchange with an ISO14443-4 target, 0 if unknown.
+ */
+struct freefare_transport {
+    int (*transceive)(void *data, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout);
+    int (*select)(void *data, nfc_modulation modulation, const uint8_t *uid, size_t uid_len);
+    int (*deselect)(void *data);
+    int (*set_property_bool)(void *data, nfc_property property, bool enable);
+    size_t max_frame_size;
+};
+
+extern const struct freefare_transport freefare_nfc_transport;
+
+void		 freefare_set_tag_transport(FreefareTag tag, const struct freefare_transport *transport, void *data);
+
+/*
+ * Per-tag I/O statistics.  Frames are accounted for by command code: the
+ * native command byte for DESFire (0xAF for continuation frames) and FeliCa
+ * tags, the first byte of the frame otherwise.  Bucket i of the RTT
+ * histogram counts exchanges that took between 2^i and 2^(i+1) µs, the first
+ * and last buckets being open-ended.
+ */
+#define FREEFARE_STATS_RTT_BUCKETS 20
+
+struct freefare_command_stats {
+    uint64_t frames;
+    uint64_t errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t rtt_ns;
+    uint64_t rtt_histogram[FREEFARE_STATS_RTT_BUCKETS];
+};
+
+struct freefare_crypto_stats {
+    uint64_t calls;
+    uint64_t time_ns;
+};
+
+struct freefare_tag_stats {
+    struct freefare_command_stats commands[256];
+    struct freefare_crypto_stats preprocess;
+    struct freefare_crypto_stats postprocess;
+};
+
+int		 freefare_enable_tag_stats(FreefareTag tag, bool enable);
+int		 freefare_get_tag_stats(FreefareTag tag, struct freefare_tag_stats *stats);
+void		 freefare_reset_tag_stats(FreefareTag tag);
+
+/*
+ * Adaptive timeouts.  A timeout model learns the round-trip time of each
+ * command code on a reader, and bounds the exchanges of the tags it is
+ * attached to by a multiple of it, within [floor, ceiling] ms.  Models are
+ * not locked: tags sharing a model shall not be used concurrently.
+ */
+struct freefare_timeout_model;
+typedef struct freefare_timeout_model *FreefareTimeoutModel;
+
+FreefareTimeoutModel freefare_timeout_model_new(unsigned int multiplier, int floor, int ceiling);
+int		 freefare_timeout_model_get_timeout(FreefareTimeoutModel model, uint8_t command);
+void		 freefare_timeout_model_free(FreefareTimeoutModel model);
+void		 freefare_set_tag_timeout_model(FreefareTag tag, FreefareTimeoutModel model);
+
+struct freefare_emulator;
+typedef struct freefare_emulator *FreefareEmulator;
+
+FreefareEmulator freefare_emulator_new(enum freefare_tag_type type, const uint8_t *uid, size_t uid_len);
+FreefareTag	 freefare_emulator_tag_new(FreefareEmulator emulator);
+void		 freefare_emulator_free(FreefareEmulator emulator);
+
+/*
+ * Binary traces.  A trace file starts with a struct freefare_trace_header and
+ * is followed by records, each made of a struct freefare_trace_record, the
+ * bytes sent and the bytes received, padded to a multiple of 8 bytes so that
+ * a mapped trace can be walked in place.  Values are in host byte order and
+ * timestamps come from the monotonic clock.
+ *
+ * A session record is written when a tag is attached to a trace: result is the
+ * type of the tag, the sent bytes are its nfc_target, and the received bytes
+ * the max_frame_size of its transport as an uint32_t.  Frame records hold the
+ * value returned by the transport as result, and refer to their session.
+ * Random bytes records hold the bytes drawn by the library for the tag of
+ * their session as received bytes, and their count as result.
+ */
+#define FREEFARE_TRACE_MAGIC "FFTRACE"
+#define FREEFARE_TRACE_VERSION 1
+
+enum freefare_trace_record_type {
+    FREEFARE_TRACE_SESSION,
+    FREEFARE_TRACE_FRAME,
+    FREEFARE_TRACE_RANDOM,
+};
+
+struct freefare_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct freefare_trace_record {
+    uint32_t size;
+    uint32_t session;
+    uint64_t timestamp_ns;
+    uint32_t rtt_ns;
+    int32_t result;
+    uint16_t tx_len;
+    uint16_t rx_len;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+struct freefare_trace;
+typedef struct freefare_trace *FreefareTrace;
+
+FreefareTrace	 freefare_trace_create(const char *path);
+FreefareTrace	 freefare_trace_open(const char *path);
+int		 freefare_set_tag_trace(FreefareTag tag, FreefareTrace trace);
+int		 freefare_trace_flush(FreefareTrace trace);
+const struct freefare_trace_record *freefare_trace_next_record(FreefareTrace trace, const struct freefare_trace_record *record);
+size_t		 freefare_trace_get_session_count(FreefareTrace trace);
+FreefareTag	 freefare_trace_tag_new(FreefareTrace trace, size_t session);
+void		 freefare_trace_free(FreefareTrace trace);
+
 
 
 bool		 felica_taste(nfc_device *device, nfc_target target);
@@ -174,6 +361,8 @@ int		 mifare_classic_read(FreefareTag tag, const MifareClassicBlockNumber block,
 int		 mifare_classic_init_value(FreefareTag tag, const MifareClassicBlockNumber block, const int32_t value, const MifareClassicBlockNumber adr);
 int		 mifare_classic_read_value(FreefareTag tag, const MifareClassicBlockNumber block, int32_t *value, MifareClassicBlockNumber *adr);
 int		 mifare_classic_write(FreefareTag tag, const MifareClassicBlockNumber block, const MifareClassicBlock data);
+int		 mifare_classic_read_async(FreefareAsync async, FreefareTag tag, const MifareClassicBlockNumber block, MifareClassicBlock *data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data);
+int		 mifare_classic_write_async(FreefareAsync async, FreefareTag tag, const MifareClassicBlockNumber block, const MifareClassicBlock data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data);
 
 int		 mifare_classic_increment(FreefareTag tag, const MifareClassicBlockNumber block, const uint32_t amount);
 int		 mifare_classic_decrement(FreefareTag tag, const MifareClassicBlockNumber block, const uint32_t amount);
@@ -494,8 +683,14 @@ int		 mifare_desfire_delete_file(FreefareTag tag, uint8_t file_no);
 
 ssize_t		 mifare_desfire_read_data(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data);
 ssize_t		 mifare_desfire_read_data_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, int cs);
+ssize_t		 mifare_desfire_read_data_in_place(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, size_t data_size);
+size_t		 mifare_desfire_read_buffer_size(FreefareTag tag, size_t nbytes);
+ssize_t		 mifare_desfire_read_data_stream(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data);
+ssize_t		 mifare_desfire_read_data_stream_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data, int cs);
 ssize_t		 mifare_desfire_write_data(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, const void *data);
 ssize_t		 mifare_desfire_write_data_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, const void *data, int cs);
+int		 mifare_desfire_read_data_async(FreefareAsync async, FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data);
+int		 mifare_desfire_write_data_async(FreefareAsync async, FreefareTag tag, uint8_t file_no, off_t offset, size_t length, const void *data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data);
 int		 mifare_desfire_get_value(FreefareTag tag, uint8_t file_no, int32_t *value);
 int		 mifare_desfire_get_value_ex(FreefareTag tag, uint8_t file_no, int32_t *value, int cs);
 int		 mifare_desfire_credit(FreefareTag tag, uint8_t file_no, int32_t amount);
@@ -508,10 +703,53 @@ ssize_t		 mifare_desfire_write_record(FreefareTag tag, uint8_t file_no, off_t of
 ssize_t		 mifare_desfire_write_record_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, int cs);
 ssize_t		 mifare_desfire_read_records(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data);
 ssize_t		 mifare_desfire_read_records_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, int cs);
+ssize_t		 mifare_desfire_read_records_in_place(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, size_t data_size);
+ssize_t		 mifare_desfire_read_records_stream(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data);
+ssize_t		 mifare_desfire_read_records_stream_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data, int cs);
 int		 mifare_desfire_clear_record_file(FreefareTag tag, uint8_t file_no);
 int		 mifare_desfire_commit_transaction(FreefareTag tag);
 int		 mifare_desfire_abort_transaction(FreefareTag tag);
 
+struct mifare_desfire_batch;
+typedef struct mifare_desfire_batch *MifareDESFireBatch;
+
+MifareDESFireBatch mifare_desfire_batch_new(void);
+int		 mifare_desfire_batch_select_application(MifareDESFireBatch batch, MifareDESFireAID aid);
+int		 mifare_desfire_batch_authenticate(MifareDESFireBatch batch, uint8_t key_no, MifareDESFireKey key);
+int		 mifare_desfire_batch_get_value(MifareDESFireBatch batch, uint8_t file_no, int32_t *value);
+int		 mifare_desfire_batch_credit(MifareDESFireBatch batch, uint8_t file_no, int32_t amount);
+int		 mifare_desfire_batch_debit(MifareDESFireBatch batch, uint8_t file_no, int32_t amount);
+int		 mifare_desfire_batch_limited_credit(MifareDESFireBatch batch, uint8_t file_no, int32_t amount);
+int		 mifare_desfire_batch_read_data(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, void *data);
+int		 mifare_desfire_batch_write_data(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, const void *data);
+int		 mifare_desfire_batch_read_records(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, void *data);
+int		 mifare_desfire_batch_write_record(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, const void *data);
+int		 mifare_desfire_batch_commit_transaction(MifareDESFireBatch batch);
+int		 mifare_desfire_batch_abort_transaction(MifareDESFireBatch batch);
+size_t		 mifare_desfire_batch_count(MifareDESFireBatch batch);
+int		 mifare_desfire_batch_run(FreefareTag tag, MifareDESFireBatch batch);
+int		 mifare_desfire_batch_run_async(FreefareAsync async, FreefareTag tag, MifareDESFireBatch batch, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data);
+ssize_t		 mifare_desfire_batch_result(MifareDESFireBatch batch, size_t n);
+uint8_t		 mifare_desfire_batch_picc_error(MifareDESFireBatch batch, size_t n);
+void		 mifare_desfire_batch_free(MifareDESFireBatch batch);
+
+struct mifare_desfire_plan;
+typedef struct mifare_desfire_plan *MifareDESFirePlan;
+
+MifareDESFirePlan mifare_desfire_plan_new(void);
+int		 mifare_desfire_plan_get_value(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t *value);
+int		 mifare_desfire_plan_credit(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount);
+int		 mifare_desfire_plan_debit(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount);
+int		 mifare_desfire_plan_limited_credit(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount);
+int		 mifare_desfire_plan_read_data(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, void *data);
+int		 mifare_desfire_plan_write_data(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, const void *data);
+int		 mifare_desfire_plan_read_records(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, void *data);
+int		 mifare_desfire_plan_write_record(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, const void *data);
+int		 mifare_desfire_plan_order(MifareDESFirePlan plan, int before, int after);
+MifareDESFireBatch mifare_desfire_plan_batch(MifareDESFirePlan plan);
+int		 mifare_desfire_plan_step(MifareDESFirePlan plan, int n);
+void		 mifare_desfire_plan_free(MifareDESFirePlan plan);
+
 MifareDESFireKey mifare_desfire_des_key_new(const uint8_t value[8]);
 MifareDESFireKey mifare_desfire_3des_key_new(const uint8_t value[16]);
 MifareDESFireKey mifare_desfire_des_key_new_with_version(const uint8_t value[8]);
@@ -541,6 +779,9 @@ typedef enum mifare_key_type {
 struct mifare_key_deriver;
 typedef struct mifare_key_deriver *MifareKeyDeriver;
 
+struct mifare_key_cache;
+typedef struct mifare_key_cache *MifareKeyCache;
+
 #define AN10922_FLAG_DEFAULT            0
 #define AN10922_FLAG_EMULATE_ISSUE_91   (1<<1)
 
@@ -552,7 +793,13 @@ int		 mifare_key_deriver_update_aid(MifareKeyDeriver deriver, MifareDESFireAID a
 int		 mifare_key_deriver_update_cstr(MifareKeyDeriver deriver, const char *cstr);
 MifareDESFireKey mifare_key_deriver_end(MifareKeyDeriver deriver);
 int		 mifare_key_deriver_end_raw(MifareKeyDeriver deriver, uint8_t* diversified_bytes, size_t data_max_len);
+int		 mifare_key_deriver_end_raw_batch(MifareKeyDeriver deriver, const uint8_t *const data[], const size_t data_len[], size_t count, uint8_t *diversified_bytes, unsigned int threads);
 void		 mifare_key_deriver_free(MifareKeyDeriver state);
+void		 mifare_key_deriver_set_cache(MifareKeyDeriver deriver, MifareKeyCache cache);
+
+MifareKeyCache	 mifare_key_cache_new(size_t capacity);
+void		 mifare_key_cache_get_stats(MifareKeyCache cache, unsigned long *hits, unsigned long *misses);
+void		 mifare_key_cache_free(MifareKeyCache cache);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,508 @@
+/*
+ * Asynchronous commands
+ *
+ * A FreefareAsync context runs commands submitted by the application in the
+ * background and reports their completion later, so that a single thread can
+ * drive tags on several readers without blocking on each round-trip.
+ *
+ * Commands are run by one worker thread per NFC device (per emulator for
+ * emulated tags): commands sent to tags sharing a device are run one after
+ * the other in submission order, commands sent to different devices run
+ * concurrently.  Completed commands are queued, and a byte is written to a
+ * pipe the application can poll when the queue stops being empty;
+ * freefare_async_dispatch() then calls the completion callbacks from the
+ * thread of the application.
+ */
+
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#if defined(HAVE_PTHREAD_H)
+    #include <pthread.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freefare.h>
+
+#include "freefare_internal.h"
+
+struct freefare_async_request {
+    struct freefare_async_request *next;
+    FreefareTag tag;
+    ssize_t (*run)(struct freefare_async_request *request);
+    union {
+	struct {
+	    ssize_t (*command)(FreefareTag tag, void *arg);
+	    void *arg;
+	} generic;
+	struct {
+	    MifareClassicBlockNumber block;
+	    MifareClassicBlock *data;
+	    MifareClassicBlock buffer;
+	} classic;
+	struct {
+	    uint8_t file_no;
+	    off_t offset;
+	    size_t length;
+	    void *data;
+	} desfire;
+	MifareDESFireBatch batch;
+    } args;
+    void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data);
+    void *user_data;
+    ssize_t result;
+    int error;
+};
+
+static int	 async_enqueue(FreefareAsync async, struct freefare_async_request *request);
+
+#if defined(HAVE_PTHREAD_H)
+
+struct freefare_async_worker {
+    struct freefare_async_worker *next;
+    struct freefare_async *async;
+    const void *channel;
+    pthread_t thread;
+    struct freefare_async_request *head, *tail;
+};
+
+struct freefare_async {
+    struct freefare_async_worker *workers;
+    struct freefare_async_request *completed, *completed_tail;
+    size_t pending;
+    bool stopping;
+    int fds[2];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+FreefareAsync
+freefare_async_new(void)
+{
+    FreefareAsync async;
+
+    if (!(async = calloc(1, sizeof(*async))))
+	return NULL;
+
+    if (pipe(async->fds) < 0) {
+	free(async);
+	return NULL;
+    }
+    for (int n = 0; n < 2; n++) {
+	fcntl(async->fds[n], F_SETFL, fcntl(async->fds[n], F_GETFL) | O_NONBLOCK);
+	fcntl(async->fds[n], F_SETFD, FD_CLOEXEC);
+    }
+
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    return async;
+}
+
+/*
+ * Frames sent to tags sharing the same channel cannot be interleaved.
+ */
+static const void *
+async_channel(FreefareTag tag)
+{
+    return tag->device ? (const void *) tag->device : tag->transport_data;
+}
+
+static void *
+async_worker(void *data)
+{
+    struct freefare_async_worker *worker = data;
+    struct freefare_async *async = worker->async;
+    struct freefare_async_request *request;
+
+    pthread_mutex_lock(&async->mutex);
+    for (;;) {
+	while (!worker->head && !async->stopping)
+	    pthread_cond_wait(&async->cond, &async->mutex);
+	if (!(request = worker->head))
+	    break;
+	if (!(worker->head = request->next))
+	    worker->tail = NULL;
+	pthread_mutex_unlock(&async->mutex);
+
+	errno = 0;
+	request->result = request->run(request);
+	request->error = (request->result < 0) ? errno : 0;
+	request->next = NULL;
+
+	pthread_mutex_lock(&async->mutex);
+	bool notify = !async->completed;
+	if (async->completed_tail)
+	    async->completed_tail->next = request;
+	else
+	    async->completed = request;
+	async->completed_tail = request;
+	pthread_mutex_unlock(&async->mutex);
+
+	// The pipe only needs to become readable, and is drained by
+	// freefare_async_dispatch(): a full pipe is readable already.
+	if (notify) {
+	    while (write(async->fds[1], "", 1) < 0 && errno == EINTR)
+		;
+	}
+
+	pthread_mutex_lock(&async->mutex);
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+static int
+async_enqueue(FreefareAsync async, struct freefare_async_request *request)
+{
+    struct freefare_async_worker *worker;
+    const void *channel = async_channel(request->tag);
+    int res;
+
+    pthread_mutex_lock(&async->mutex);
+    for (worker = async->workers; worker; worker = worker->next)
+	if (worker->channel == channel)
+	    break;
+
+    if (!worker) {
+	if (!(worker = calloc(1, sizeof(*worker)))) {
+	    pthread_mutex_unlock(&async->mutex);
+	    return errno = ENOMEM, -1;
+	}
+	worker->async = async;
+	worker->channel = channel;
+	if ((res = pthread_create(&worker->thread, NULL, async_worker, worker))) {
+	    pthread_mutex_unlock(&async->mutex);
+	    free(worker);
+	    return errno = res, -1;
+	}
+	worker->next = async->workers;
+	async->workers = worker;
+    }
+
+    request->next = NULL;
+    if (worker->tail)
+	worker->tail->next = request;
+    else
+	worker->head = request;
+    worker->tail = request;
+    async->pending++;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    return 0;
+}
+
+int
+freefare_async_get_fd(FreefareAsync async)
+{
+    return async->fds[0];
+}
+
+size_t
+freefare_async_pending(FreefareAsync async)
+{
+    size_t pending;
+
+    pthread_mutex_lock(&async->mutex);
+    pending = async->pending;
+    pthread_mutex_unlock(&async->mutex);
+
+    return pending;
+}
+
+/*
+ * Call the completion callback of each command completed since the last
+ * call.
+ */
+int
+freefare_async_dispatch(FreefareAsync async)
+{
+    struct freefare_async_request *request;
+    char buffer[64];
+    int count = 0;
+
+    pthread_mutex_lock(&async->mutex);
+    request = async->completed;
+    async->completed = async->completed_tail = NULL;
+    while (read(async->fds[0], buffer, sizeof(buffer)) > 0)
+	;
+    pthread_mutex_unlock(&async->mutex);
+
+    while (request) {
+	struct freefare_async_request *next = request->next;
+
+	if (request->callback)
+	    request->callback(request->tag, request->result, request->error, request->user_data);
+	free(request);
+	count++;
+
+	pthread_mutex_lock(&async->mutex);
+	async->pending--;
+	pthread_mutex_unlock(&async->mutex);
+
+	request = next;
+    }
+
+    return count;
+}
+
+/*
+ * Wait for the commands already submitted to complete, and free the context.
+ * Callbacks of commands which were not dispatched are not called.
+ */
+void
+freefare_async_free(FreefareAsync async)
+{
+    if (!async)
+	return;
+
+    pthread_mutex_lock(&async->mutex);
+    async->stopping = true;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    while (async->workers) {
+	struct freefare_async_worker *worker = async->workers;
+	pthread_join(worker->thread, NULL);
+	async->workers = worker->next;
+	free(worker);
+    }
+
+    while (async->completed) {
+	struct freefare_async_request *request = async->completed;
+	async->completed = request->next;
+	free(request);
+    }
+
+    close(async->fds[0]);
+    close(async->fds[1]);
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    free(async);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+FreefareAsync
+freefare_async_new(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+static int
+async_enqueue(FreefareAsync async, struct freefare_async_request *request)
+{
+    (void) async;
+    (void) request;
+
+    return errno = ENOSYS, -1;
+}
+
+int
+freefare_async_get_fd(FreefareAsync async)
+{
+    (void) async;
+
+    return errno = ENOSYS, -1;
+}
+
+size_t
+freefare_async_pending(FreefareAsync async)
+{
+    (void) async;
+
+    return 0;
+}
+
+int
+freefare_async_dispatch(FreefareAsync async)
+{
+    (void) async;
+
+    return errno = ENOSYS, -1;
+}
+
+void
+freefare_async_free(FreefareAsync async)
+{
+    (void) async;
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+static struct freefare_async_request *
+async_request_new(FreefareTag tag, ssize_t (*run)(struct freefare_async_request *request), void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!(request = calloc(1, sizeof(*request))))
+	return NULL;
+
+    request->tag = tag;
+    request->run = run;
+    request->callback = callback;
+    request->user_data = user_data;
+
+    return request;
+}
+
+static int
+async_submit(FreefareAsync async, struct freefare_async_request *request)
+{
+    if (async_enqueue(async, request) < 0) {
+	free(request);
+	return -1;
+    }
+
+    return 0;
+}
+
+static ssize_t
+run_generic(struct freefare_async_request *request)
+{
+    return request->args.generic.command(request->tag, request->args.generic.arg);
+}
+
+/*
+ * Run an arbitrary function on the provided tag in the background.
+ */
+int
+freefare_async_submit(FreefareAsync async, FreefareTag tag, ssize_t (*command)(FreefareTag tag, void *arg), void *arg, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!async || !tag || !command)
+	return errno = EINVAL, -1;
+
+    if (!(request = async_request_new(tag, run_generic, callback, user_data)))
+	return -1;
+    request->args.generic.command = command;
+    request->args.generic.arg = arg;
+
+    return async_submit(async, request);
+}
+
+static ssize_t
+run_classic_read(struct freefare_async_request *request)
+{
+    return mifare_classic_read(request->tag, request->args.classic.block, request->args.classic.data);
+}
+
+int
+mifare_classic_read_async(FreefareAsync async, FreefareTag tag, const MifareClassicBlockNumber block, MifareClassicBlock *data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!async || !tag || !data)
+	return errno = EINVAL, -1;
+
+    if (!(request = async_request_new(tag, run_classic_read, callback, user_data)))
+	return -1;
+    request->args.classic.block = block;
+    request->args.classic.data = data;
+
+    return async_submit(async, request);
+}
+
+static ssize_t
+run_classic_write(struct freefare_async_request *request)
+{
+    return mifare_classic_write(request->tag, request->args.classic.block, request->args.classic.buffer);
+}
+
+/*
+ * The block data is copied and need not outlive the call.
+ */
+int
+mifare_classic_write_async(FreefareAsync async, FreefareTag tag, const MifareClassicBlockNumber block, const MifareClassicBlock data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!async || !tag || !data)
+	return errno = EINVAL, -1;
+
+    if (!(request = async_request_new(tag, run_classic_write, callback, user_data)))
+	return -1;
+    request->args.classic.block = block;
+    memcpy(request->args.classic.buffer, data, sizeof(MifareClassicBlock));
+
+    return async_submit(async, request);
+}
+
+static ssize_t
+run_desfire_read_data(struct freefare_async_request *request)
+{
+    return mifare_desfire_read_data(request->tag, request->args.desfire.file_no, request->args.desfire.offset, request->args.desfire.length, request->args.desfire.data);
+}
+
+int
+mifare_desfire_read_data_async(FreefareAsync async, FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!async || !tag || !data)
+	return errno = EINVAL, -1;
+
+    if (!(request = async_request_new(tag, run_desfire_read_data, callback, user_data)))
+	return -1;
+    request->args.desfire.file_no = file_no;
+    request->args.desfire.offset = offset;
+    request->args.desfire.length = length;
+    request->args.desfire.data = data;
+
+    return async_submit(async, request);
+}
+
+static ssize_t
+run_desfire_write_data(struct freefare_async_request *request)
+{
+    return mifare_desfire_write_data(request->tag, request->args.desfire.file_no, request->args.desfire.offset, request->args.desfire.length, request->args.desfire.data);
+}
+
+int
+mifare_desfire_write_data_async(FreefareAsync async, FreefareTag tag, uint8_t file_no, off_t offset, size_t length, const void *data, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!async || !tag || !data)
+	return errno = EINVAL, -1;
+
+    if (!(request = async_request_new(tag, run_desfire_write_data, callback, user_data)))
+	return -1;
+    request->args.desfire.file_no = file_no;
+    request->args.desfire.offset = offset;
+    request->args.desfire.length = length;
+    request->args.desfire.data = (void *) data;
+
+    return async_submit(async, request);
+}
+
+static ssize_t
+run_desfire_batch(struct freefare_async_request *request)
+{
+    return mifare_desfire_batch_run(request->tag, request->args.batch);
+}
+
+int
+mifare_desfire_batch_run_async(FreefareAsync async, FreefareTag tag, MifareDESFireBatch batch, void (*callback)(FreefareTag tag, ssize_t result, int error, void *user_data), void *user_data)
+{
+    struct freefare_async_request *request;
+
+    if (!async || !tag || !batch)
+	return errno = EINVAL, -1;
+
+    if (!(request = async_request_new(tag, run_desfire_batch, callback, user_data)))
+	return -1;
+    request->args.batch = batch;
+
+    return async_submit(async, request);
+}
@@ -0,0 +1,736 @@
+/*
+ * Software tag emulation.
+ *
+ * A FreefareEmulator is an in-memory model of a tag that answers the frames
+ * libfreefare sends to physical cards.  Tags bound to an emulator are created
+ * by the regular family constructors and only differ by their transport, so
+ * that applications and tests can exercise the library without any NFC
+ * hardware.
+ *
+ * The emulated tags implement the commands used by libfreefare.  Access
+ * conditions of MIFARE Classic blocks and NTAG password protection are not
+ * enforced.
+ */
+
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+#include <freefare.h>
+#include "freefare_internal.h"
+
+#define CLASSIC_BLOCK_SIZE 16
+#define ULTRALIGHT_PAGE_SIZE 4
+#define FELICA_BLOCK_SIZE 16
+#define FELICA_BLOCK_COUNT 256
+
+#define NTAG213_PAGE_COUNT 0x2D
+#define NTAG213_CFG0 0x29
+#define NTAG213_PWD 0x2B
+#define NTAG213_PACK 0x2C
+
+#define NO_SECTOR -1
+
+struct freefare_emulator {
+    enum freefare_tag_type type;
+    nfc_target target;
+
+    uint8_t *memory;
+    size_t memory_size;
+
+    /* MIFARE Classic */
+    int authenticated_sector;
+    int32_t value_register;
+
+    /* MIFARE Ultralight C */
+    bool authenticating;
+    uint8_t rndb[8];
+    uint8_t ivect[8];
+
+    /* GET_VERSION response of NTAG21x and Ultralight EV1 tags */
+    bool has_version;
+    uint8_t version[8];
+
+    /* NTAG21x */
+    uint32_t counter;
+
+    struct mifare_desfire_emulator *desfire;
+};
+
+static const uint8_t NTAG213_VERSION[8] = { 0x00, 0x04, 0x04, 0x02, 0x01, 0x00, 0x0F, 0x03 };
+
+/* Factory key, as stored in pages 0x2C to 0x2F */
+static const uint8_t ULTRALIGHTC_DEFAULT_KEY[16] = {
+    'B', 'R', 'E', 'A', 'K', 'M', 'E', 'I', 'F', 'Y', 'O', 'U', 'C', 'A', 'N', '!'
+};
+
+static const uint8_t CLASSIC_DEFAULT_TRAILER[CLASSIC_BLOCK_SIZE] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x07, 0x80, 0x69,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+/*
+ * MIFARE Classic
+ */
+
+static int
+classic_sector(int block)
+{
+    return (block < 128) ? block / 4 : 32 + (block - 128) / 16;
+}
+
+static int
+classic_trailer(int block)
+{
+    return (block < 128) ? (block | 0x03) : (block | 0x0f);
+}
+
+static bool
+classic_value_block(const uint8_t *block, int32_t *value)
+{
+    uint8_t inverted[4];
+
+    for (int i = 0; i < 4; i++)
+	inverted[i] = ~block[4 + i];
+
+    if (memcmp(block, inverted, 4) || memcmp(block, block + 8, 4) ||
+	(block[12] != block[14]) || ((block[12] ^ block[13]) != 0xff) || (block[13] != block[15]))
+	return false;
+
+    *value = (int32_t)((uint32_t)block[0] | ((uint32_t)block[1] << 8) | ((uint32_t)block[2] << 16) | ((uint32_t)block[3] << 24));
+    return true;
+}
+
+static int
+classic_transceive(struct freefare_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    size_t block_count = emu->memory_size / CLASSIC_BLOCK_SIZE;
+
+    if ((tx_len < 2) || (tx[1] >= block_count))
+	return NFC_ERFTRANS;
+
+    uint8_t *block = emu->memory + tx[1] * CLASSIC_BLOCK_SIZE;
+    uint8_t *trailer = emu->memory + classic_trailer(tx[1]) * CLASSIC_BLOCK_SIZE;
+    int32_t value;
+
+    if ((0x60 == tx[0]) || (0x61 == tx[0])) {
+	if (tx_len != 12)
+	    return NFC_ERFTRANS;
+	const uint8_t *key = trailer + ((0x60 == tx[0]) ? 0 : 10);
+	if (memcmp(key, tx + 2, 6)) {
+	    emu->authenticated_sector = NO_SECTOR;
+	    return NFC_EMFCAUTHFAIL;
+	}
+	emu->authenticated_sector = classic_sector(tx[1]);
+	return 0;
+    }
+
+    if (emu->authenticated_sector != classic_sector(tx[1]))
+	return NFC_ERFTRANS;
+
+    switch (tx[0]) {
+    case 0x30:
+	if (rx_len < CLASSIC_BLOCK_SIZE)
+	    return NFC_EOVFLOW;
+	memcpy(rx, block, CLASSIC_BLOCK_SIZE);
+	/* Key A is never readable */
+	if (block == trailer)
+	    memset(rx, 0, 6);
+	return CLASSIC_BLOCK_SIZE;
+    case 0xA0:
+	/* The manufacturer block is read-only */
+	if ((tx_len != 2 + CLASSIC_BLOCK_SIZE) || (0 == tx[1]))
+	    return NFC_ERFTRANS;
+	memcpy(block, tx + 2, CLASSIC_BLOCK_SIZE);
+	return 0;
+    case 0xC0:
+    case 0xC1:
+    case 0xC2:
+	if ((tx_len != 6) || (block == trailer) || !classic_value_block(block, &value))
+	    return NFC_ERFTRANS;
+	uint32_t amount = tx[2] | (tx[3] << 8) | (tx[4] << 16) | ((uint32_t)tx[5] << 24);
+	if (0xC0 == tx[0])
+	    value -= amount;
+	else if (0xC1 == tx[0])
+	    value += amount;
+	emu->value_register = value;
+	return 0;
+    case 0xB0:
+	if ((tx_len != 2) || (block == trailer))
+	    return NFC_ERFTRANS;
+	for (int i = 0; i < 4; i++) {
+	    block[i] = block[8 + i] = emu->value_register >> (8 * i);
+	    block[4 + i] = ~block[i];
+	}
+	return 0;
+    default:
+	return NFC_ERFTRANS;
+    }
+}
+
+/*
+ * MIFARE Ultralight, Ultralight C and NTAG21x
+ */
+
+static size_t
+ultralight_page_count(const struct freefare_emulator *emu)
+{
+    return emu->memory_size / ULTRALIGHT_PAGE_SIZE;
+}
+
+/*
+ * Number of pages returned before READ wraps to page 0.
+ */
+static size_t
+ultralight_readable_page_count(const struct freefare_emulator *emu)
+{
+    switch (emu->type) {
+    case MIFARE_ULTRALIGHT_C:
+	return MIFARE_ULTRALIGHT_C_PAGE_COUNT_READ;
+    default:
+	return ultralight_page_count(emu);
+    }
+}
+
+static void
+ultralight_read_page(const struct freefare_emulator *emu, size_t page, uint8_t *data)
+{
+    memcpy(data, emu->memory + page * ULTRALIGHT_PAGE_SIZE, ULTRALIGHT_PAGE_SIZE);
+
+    /* Passwords read back as zero */
+    if ((NTAG_21x == emu->type) && ((NTAG213_PWD == page) || (NTAG213_PACK == page)))
+	memset(data, 0, ULTRALIGHT_PAGE_SIZE);
+}
+
+static int
+ultralight_write_page(struct freefare_emulator *emu, uint8_t page, const uint8_t *data)
+{
+    if ((page < 2) || (page >= ultralight_page_count(emu)))
+	return NFC_ERFTRANS;
+
+    uint8_t *p = emu->memory + page * ULTRALIGHT_PAGE_SIZE;
+
+    switch (page) {
+    case 2:
+	/* Lock bytes */
+	p[2] |= data[2];
+	p[3] |= data[3];
+	break;
+    case 3:
+	/* OTP / Capability Container */
+	for (int i = 0; i < ULTRALIGHT_PAGE_SIZE; i++)
+	    p[i] |= data[i];
+	break;
+    default:
+	memcpy(p, data, ULTRALIGHT_PAGE_SIZE);
+	break;
+    }
+
+    return 0;
+}
+
+static MifareDESFireKey
+ultralightc_key(const struct freefare_emulator *emu)
+{
+    uint8_t data[16];
+    const uint8_t *p = emu->memory + 0x2C * ULTRALIGHT_PAGE_SIZE;
+
+    /* Each half of the key is stored in reverse byte order */
+    for (int i = 0; i < 8; i++) {
+	data[i] = p[7 - i];
+	data[8 + i] = p[15 - i];
+    }
+
+    return mifare_desfire_3des_key_new(data);
+}
+
+static int
+ultralightc_authenticate(struct freefare_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    MifareDESFireKey key;
+
+    if (rx_len < 9)
+	return NFC_EOVFLOW;
+    if (!(key = ultralightc_key(emu)))
+	return NFC_ESOFT;
+
+    int res = NFC_ERFTRANS;
+    if ((0x1A == tx[0]) && (2 == tx_len)) {
+	memset(emu->ivect, 0, sizeof(emu->ivect));
+	RAND_bytes(emu->rndb, sizeof(emu->rndb));
+	rx[0] = 0xAF;
+	memcpy(rx + 1, emu->rndb, 8);
+	mifare_cypher_single_block(key, rx + 1, emu->ivect, MCD_SEND, MCO_ENCYPHER, 8);
+	emu->authenticating = true;
+	res = 9;
+    } else if ((0xAF == tx[0]) && (17 == tx_len) && emu->authenticating) {
+	uint8_t token[16];
+	memcpy(token, tx + 1, 16);
+	mifare_cypher_single_block(key, token, emu->ivect, MCD_RECEIVE, MCO_DECYPHER, 8);
+	mifare_cypher_single_block(key, token + 8, emu->ivect, MCD_RECEIVE, MCO_DECYPHER, 8);
+
+	uint8_t rndb_s[8];
+	memcpy(rndb_s, emu->rndb, 8);
+	rol(rndb_s, 8);
+	if (0 == memcmp(rndb_s, token + 8, 8)) {
+	    rx[0] = 0x00;
+	    memcpy(rx + 1, token, 8);
+	    rol(rx + 1, 8);
+	    mifare_cypher_single_block(key, rx + 1, emu->ivect, MCD_SEND, MCO_ENCYPHER, 8);
+	    res = 9;
+	}
+	emu->authenticating = false;
+    }
+
+    mifare_desfire_key_free(key);
+    return res;
+}
+
+static int
+ntag21x_command(struct freefare_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    size_t page_count = ultralight_page_count(emu);
+
+    switch (tx[0]) {
+    case 0x3A:
+	if ((tx_len != 3) || (tx[1] > tx[2]) || (tx[2] >= page_count))
+	    return NFC_ERFTRANS;
+	if (rx_len < (size_t)(tx[2] - tx[1] + 1) * ULTRALIGHT_PAGE_SIZE)
+	    return NFC_EOVFLOW;
+	for (int page = tx[1]; page <= tx[2]; page++)
+	    ultralight_read_page(emu, page, rx + (page - tx[1]) * ULTRALIGHT_PAGE_SIZE);
+	return (tx[2] - tx[1] + 1) * ULTRALIGHT_PAGE_SIZE;
+    case 0x39:
+	if ((tx_len != 2) || (0x02 != tx[1]))
+	    return NFC_ERFTRANS;
+	if (rx_len < 3)
+	    return NFC_EOVFLOW;
+	rx[0] = emu->counter;
+	rx[1] = emu->counter >> 8;
+	rx[2] = emu->counter >> 16;
+	return 3;
+    case 0x3C:
+	if (rx_len < 32)
+	    return NFC_EOVFLOW;
+	memset(rx, 0, 32);
+	return 32;
+    case 0x1B:
+	if (tx_len != 5)
+	    return NFC_ERFTRANS;
+	if (memcmp(tx + 1, emu->memory + NTAG213_PWD * ULTRALIGHT_PAGE_SIZE, 4))
+	    return NFC_ERFTRANS;
+	if (rx_len < 2)
+	    return NFC_EOVFLOW;
+	memcpy(rx, emu->memory + NTAG213_PACK * ULTRALIGHT_PAGE_SIZE, 2);
+	return 2;
+    case 0xA0:
+	if (tx_len != 18)
+	    return NFC_ERFTRANS;
+	return ultralight_write_page(emu, tx[1], tx + 2);
+    default:
+	return NFC_ERFTRANS;
+    }
+}
+
+static int
+ultralight_transceive(struct freefare_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    if (!tx_len)
+	return NFC_ERFTRANS;
+
+    if ((MIFARE_ULTRALIGHT_C == emu->type) && ((0x1A == tx[0]) || (0xAF == tx[0])))
+	return ultralightc_authenticate(emu, tx, tx_len, rx, rx_len);
+
+    switch (tx[0]) {
+    case 0x30: {
+	size_t readable = ultralight_readable_page_count(emu);
+	if ((tx_len != 2) || (tx[1] >= readable))
+	    return NFC_ERFTRANS;
+	if (rx_len < 4 * ULTRALIGHT_PAGE_SIZE)
+	    return NFC_EOVFLOW;
+	for (int i = 0; i < 4; i++)
+	    ultralight_read_page(emu, (tx[1] + i) % readable, rx + i * ULTRALIGHT_PAGE_SIZE);
+	return 4 * ULTRALIGHT_PAGE_SIZE;
+    }
+    case 0xA2:
+	if (tx_len != 2 + ULTRALIGHT_PAGE_SIZE)
+	    return NFC_ERFTRANS;
+	return ultralight_write_page(emu, tx[1], tx + 2);
+    case 0x60:
+	if (!emu->has_version)
+	    return NFC_ERFTRANS;
+	if (rx_len < sizeof(emu->version))
+	    return NFC_EOVFLOW;
+	memcpy(rx, emu->version, sizeof(emu->version));
+	return sizeof(emu->version);
+    default:
+	if (NTAG_21x == emu->type)
+	    return ntag21x_command(emu, tx, tx_len, rx, rx_len);
+	return NFC_ERFTRANS;
+    }
+}
+
+/*
+ * FeliCa
+ */
+
+static int
+felica_transceive(struct freefare_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    if ((tx_len < 14) || (tx[0] != tx_len) || memcmp(tx + 2, emu->target.nti.nfi.abtId, 8))
+	return NFC_ERFTRANS;
+
+    uint8_t block_count = tx[13];
+    if (tx_len < 14 + 2 * (size_t) block_count)
+	return NFC_ERFTRANS;
+
+    const uint8_t *blocks = tx + 14;
+    size_t n;
+
+    switch (tx[1]) {
+    case 0x06:
+	n = 13 + FELICA_BLOCK_SIZE * block_count;
+	if (rx_len < n)
+	    return NFC_EOVFLOW;
+	rx[12] = block_count;
+	for (int i = 0; i < block_count; i++)
+	    memcpy(rx + 13 + FELICA_BLOCK_SIZE * i, emu->memory + blocks[2 * i + 1] * FELICA_BLOCK_SIZE, FELICA_BLOCK_SIZE);
+	break;
+    case 0x08:
+	n = 12;
+	if (tx_len != 14 + (2 + FELICA_BLOCK_SIZE) * (size_t) block_count)
+	    return NFC_ERFTRANS;
+	if (rx_len < n)
+	    return NFC_EOVFLOW;
+	for (int i = 0; i < block_count; i++)
+	    memcpy(emu->memory + blocks[2 * i + 1] * FELICA_BLOCK_SIZE, tx + 14 + 2 * block_count + FELICA_BLOCK_SIZE * i, FELICA_BLOCK_SIZE);
+	break;
+    default:
+	return NFC_ERFTRANS;
+    }
+
+    rx[0] = n;
+    rx[1] = tx[1] + 1;
+    memcpy(rx + 2, emu->target.nti.nfi.abtId, 8);
+    rx[10] = 0x00;
+    rx[11] = 0x00;
+
+    return n;
+}
+
+/*
+ * Transport callbacks
+ */
+
+static int
+emulator_transceive(void *data, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout)
+{
+    struct freefare_emulator *emu = data;
+
+    (void) timeout;
+
+    switch (emu->type) {
+    case FELICA:
+	return felica_transceive(emu, tx, tx_len, rx, rx_len);
+    case MIFARE_MINI:
+    case MIFARE_CLASSIC_1K:
+    case MIFARE_CLASSIC_4K:
+	return classic_transceive(emu, tx, tx_len, rx, rx_len);
+    case MIFARE_DESFIRE:
+	return mifare_desfire_emulator_transceive(emu->desfire, tx, tx_len, rx, rx_len);
+    case MIFARE_ULTRALIGHT:
+    case MIFARE_ULTRALIGHT_C:
+    case NTAG_21x:
+	return ultralight_transceive(emu, tx, tx_len, rx, rx_len);
+    }
+
+    return NFC_EINVARG;
+}
+
+static int
+emulator_select(void *data, nfc_modulation modulation, const uint8_t *uid, size_t uid_len)
+{
+    struct freefare_emulator *emu = data;
+    const uint8_t *emu_uid;
+    size_t emu_uid_len;
+
+    if (modulation.nmt != emu->target.nm.nmt)
+	return NFC_ETIMEOUT;
+
+    if (NMT_FELICA == modulation.nmt) {
+	emu_uid = emu->target.nti.nfi.abtId;
+	emu_uid_len = 8;
+    } else {
+	emu_uid = emu->target.nti.nai.abtUid;
+	emu_uid_len = emu->target.nti.nai.szUidLen;
+    }
+
+    if (uid && ((uid_len != emu_uid_len) || memcmp(uid, emu_uid, uid_len)))
+	return NFC_ETIMEOUT;
+
+    emu->authenticated_sector = NO_SECTOR;
+    emu->authenticating = false;
+    if (emu->desfire)
+	mifare_desfire_emulator_reset(emu->desfire);
+
+    return 1;
+}
+
+static int
+emulator_deselect(void *data)
+{
+    struct freefare_emulator *emu = data;
+
+    emu->authenticated_sector = NO_SECTOR;
+    emu->authenticating = false;
+
+    return NFC_SUCCESS;
+}
+
+static int
+emulator_set_property_bool(void *data, nfc_property property, bool enable)
+{
+    (void) data;
+    (void) property;
+    (void) enable;
+
+    return NFC_SUCCESS;
+}
+
+const struct freefare_transport freefare_emulator_transport = {
+    .transceive = emulator_transceive,
+    .select = emulator_select,
+    .deselect = emulator_deselect,
+    .set_property_bool = emulator_set_property_bool,
+    .max_frame_size = 256,
+};
+
+/*
+ * Memory initialisation
+ */
+
+static void
+ultralight_format(struct freefare_emulator *emu)
+{
+    const uint8_t *uid = emu->target.nti.nai.abtUid;
+    uint8_t *p = emu->memory;
+
+    /* Serial number with check bytes */
+    p[0] = uid[0];
+    p[1] = uid[1];
+    p[2] = uid[2];
+    p[3] = 0x88 ^ uid[0] ^ uid[1] ^ uid[2];
+    memcpy(p + 4, uid + 3, 4);
+    p[8] = uid[3] ^ uid[4] ^ uid[5] ^ uid[6];
+
+    switch (emu->type) {
+    case MIFARE_ULTRALIGHT_C:
+	memcpy(emu->memory + 0x2C * ULTRALIGHT_PAGE_SIZE, ULTRALIGHTC_DEFAULT_KEY, sizeof(ULTRALIGHTC_DEFAULT_KEY));
+	break;
+    case NTAG_21x:
+	/* Capability Container */
+	p[12] = 0xE1;
+	p[13] = 0x10;
+	p[14] = 0x12;
+	p[15] = 0x00;
+	/* AUTH0 disables password protection */
+	emu->memory[NTAG213_CFG0 * ULTRALIGHT_PAGE_SIZE + 3] = 0xFF;
+	memset(emu->memory + NTAG213_PWD * ULTRALIGHT_PAGE_SIZE, 0xFF, ULTRALIGHT_PAGE_SIZE);
+	break;
+    default:
+	break;
+    }
+}
+
+static void
+classic_format(struct freefare_emulator *emu)
+{
+    const nfc_iso14443a_info *nai = &emu->target.nti.nai;
+    size_t block_count = emu->memory_size / CLASSIC_BLOCK_SIZE;
+
+    /* Manufacturer block */
+    memcpy(emu->memory, nai->abtUid, nai->szUidLen);
+    if (4 == nai->szUidLen) {
+	emu->memory[4] = nai->abtUid[0] ^ nai->abtUid[1] ^ nai->abtUid[2] ^ nai->abtUid[3];
+	emu->memory[5] = nai->btSak;
+	emu->memory[6] = nai->abtAtqa[1];
+	emu->memory[7] = nai->abtAtqa[0];
+    }
+
+    for (size_t block = 0; block < block_count; block++) {
+	if ((int)block == classic_trailer(block))
+	    memcpy(emu->memory + block * CLASSIC_BLOCK_SIZE, CLASSIC_DEFAULT_TRAILER, CLASSIC_BLOCK_SIZE);
+    }
+}
+
+/*
+ * Allocate an emulated tag of the given type.
+ */
+FreefareEmulator
+freefare_emulator_new(enum freefare_tag_type type, const uint8_t *uid, size_t uid_len)
+{
+    FreefareEmulator emu;
+    nfc_iso14443a_info *nai;
+
+    switch (type) {
+    case FELICA:
+	if (8 != uid_len)
+	    return errno = EINVAL, NULL;
+	break;
+    case MIFARE_MINI:
+    case MIFARE_CLASSIC_1K:
+    case MIFARE_CLASSIC_4K:
+	if ((4 != uid_len) && (7 != uid_len))
+	    return errno = EINVAL, NULL;
+	break;
+    case MIFARE_DESFIRE:
+    case MIFARE_ULTRALIGHT:
+    case MIFARE_ULTRALIGHT_C:
+    case NTAG_21x:
+	if (7 != uid_len)
+	    return errno = EINVAL, NULL;
+	break;
+    default:
+	return errno = EINVAL, NULL;
+    }
+
+    if (!(emu = calloc(1, sizeof(*emu))))
+	return NULL;
+
+    emu->type = type;
+    emu->authenticated_sector = NO_SECTOR;
+
+    if (FELICA == type) {
+	emu->target.nm.nmt = NMT_FELICA;
+	emu->target.nm.nbr = NBR_424;
+	memcpy(emu->target.nti.nfi.abtId, uid, 8);
+	emu->memory_size = FELICA_BLOCK_COUNT * FELICA_BLOCK_SIZE;
+    } else {
+	emu->target.nm.nmt = NMT_ISO14443A;
+	emu->target.nm.nbr = NBR_106;
+	nai = &emu->target.nti.nai;
+	memcpy(nai->abtUid, uid, uid_len);
+	nai->szUidLen = uid_len;
+	nai->abtAtqa[1] = (7 == uid_len) ? 0x44 : 0x04;
+
+	switch (type) {
+	case MIFARE_MINI:
+	    nai->btSak = 0x09;
+	    emu->memory_size = 20 * CLASSIC_BLOCK_SIZE;
+	    break;
+	case MIFARE_CLASSIC_1K:
+	    nai->btSak = 0x08;
+	    emu->memory_size = 64 * CLASSIC_BLOCK_SIZE;
+	    break;
+	case MIFARE_CLASSIC_4K:
+	    nai->abtAtqa[1] = (7 == uid_len) ? 0x42 : 0x02;
+	    nai->btSak = 0x18;
+	    emu->memory_size = 256 * CLASSIC_BLOCK_SIZE;
+	    break;
+	case MIFARE_DESFIRE:
+	    nai->btSak = 0x20;
+	    nai->abtAtqa[0] = 0x03;
+	    break;
+	case MIFARE_ULTRALIGHT:
+	    emu->memory_size = MIFARE_ULTRALIGHT_PAGE_COUNT * ULTRALIGHT_PAGE_SIZE;
+	    break;
+	case MIFARE_ULTRALIGHT_C:
+	    emu->memory_size = MIFARE_ULTRALIGHT_C_PAGE_COUNT * ULTRALIGHT_PAGE_SIZE;
+	    break;
+	case NTAG_21x:
+	    emu->memory_size = NTAG213_PAGE_COUNT * ULTRALIGHT_PAGE_SIZE;
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    if (MIFARE_DESFIRE == type) {
+	if (!(emu->desfire = mifare_desfire_emulator_new(uid))) {
+	    free(emu);
+	    return NULL;
+	}
+	const uint8_t *ats = mifare_desfire_emulator_get_ats(emu->desfire, &emu->target.nti.nai.szAtsLen);
+	memcpy(emu->target.nti.nai.abtAts, ats, emu->target.nti.nai.szAtsLen);
+    } else {
+	if (!(emu->memory = calloc(1, emu->memory_size))) {
+	    free(emu);
+	    return NULL;
+	}
+    }
+
+    switch (type) {
+    case MIFARE_MINI:
+    case MIFARE_CLASSIC_1K:
+    case MIFARE_CLASSIC_4K:
+	classic_format(emu);
+	break;
+    case MIFARE_ULTRALIGHT:
+    case MIFARE_ULTRALIGHT_C:
+    case NTAG_21x:
+	ultralight_format(emu);
+	break;
+    default:
+	break;
+    }
+
+    if (NTAG_21x == type)
+	freefare_emulator_set_version(emu, NTAG213_VERSION);
+
+    return emu;
+}
+
+/*
+ * Allocate a FreefareTag bound to the provided emulator.  The tag has no NFC
+ * device and shall be freed before the emulator.
+ */
+FreefareTag
+freefare_emulator_tag_new(FreefareEmulator emulator)
+{
+    FreefareTag tag = freefare_tag_new_with_type(emulator->type, NULL, emulator->target);
+
+    if (tag)
+	freefare_set_tag_transport(tag, &freefare_emulator_transport, emulator);
+
+    return tag;
+}
+
+/*
+ * Return the target the provided emulator presents to the initiator.
+ */
+const nfc_target *
+freefare_emulator_get_target(FreefareEmulator emulator)
+{
+    return &emulator->target;
+}
+
+/*
+ * Make the provided emulated tag answer GET_VERSION with version, e.g. for a
+ * MIFARE Ultralight to pass for a MIFARE Ultralight EV1.
+ */
+void
+freefare_emulator_set_version(FreefareEmulator emulator, const uint8_t version[8])
+{
+    memcpy(emulator->version, version, sizeof(emulator->version));
+    emulator->has_version = true;
+}
+
+/*
+ * Free the provided emulator.
+ */
+void
+freefare_emulator_free(FreefareEmulator emulator)
+{
+    if (emulator) {
+	mifare_desfire_emulator_free(emulator->desfire);
+	free(emulator->memory);
+	free(emulator);
+    }
+}
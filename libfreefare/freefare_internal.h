@@ -5,7 +5,13 @@
     #include "config.h"
 #endif
 
+#if defined(HAVE_PTHREAD_H)
+    #include <pthread.h>
+#endif
+
+#include <openssl/aes.h>
 #include <openssl/des.h>
+#include <openssl/evp.h>
 
 /*
  * Endienness macros
@@ -83,6 +89,34 @@
 
 void		*memdup(const void *p, const size_t n);
 
+FreefareTag	 freefare_tag_new_with_type(enum freefare_tag_type type, nfc_device *device, nfc_target target);
+FreefareTag	 freefare_tag_new_with_transport(nfc_device *device, nfc_target target, const struct freefare_transport *transport, void *data);
+int		 freefare_transceive_bytes(FreefareTag tag, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout);
+int		 freefare_select_target(FreefareTag tag, nfc_modulation modulation);
+int		 freefare_deselect_target(FreefareTag tag);
+int		 freefare_set_property_bool(FreefareTag tag, nfc_property property, bool enable);
+int		 freefare_tag_error(FreefareTag tag, enum freefare_error_source source, int error);
+int		 freefare_random_bytes(FreefareTag tag, uint8_t *buf, size_t n);
+
+uint64_t	 freefare_stats_clock(void);
+void		 freefare_stats_crypto(struct freefare_crypto_stats *stats, uint64_t start);
+void		 freefare_trace_frame(FreefareTag tag, const uint8_t *tx, size_t tx_len, const uint8_t *rx, int res, uint64_t start, uint64_t end);
+void		 freefare_trace_random(FreefareTag tag, const uint8_t *buf, size_t n);
+int		 freefare_trace_replay_random(FreefareTag tag, uint8_t *buf, size_t n);
+
+/*
+ * NFC initiator polling for targets.  Tags found are bound to transport with
+ * the data select_passive_target() returned for them in tag_data.
+ */
+struct freefare_initiator {
+    int (*init)(void *data);
+    int (*select_passive_target)(void *data, nfc_modulation modulation, nfc_target *target, void **tag_data);
+    const struct freefare_transport *transport;
+};
+
+void		 freefare_poller_set_initiator(FreefarePoller poller, const struct freefare_initiator *initiator, void *data);
+void		 freefare_reader_pool_set_enumerator(FreefareReaderPool pool, int (*enumerate)(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data));
+
 struct mad_sector_0x00;
 struct mad_sector_0x10;
 
@@ -123,8 +157,10 @@ typedef enum {
 void		*mifare_cryto_preprocess_data(FreefareTag tag, void *data, size_t *nbytes, off_t offset, int communication_settings);
 void		*mifare_cryto_postprocess_data(FreefareTag tag, void *data, ssize_t *nbytes, int communication_settings);
 void		 mifare_cypher_single_block(MifareDESFireKey key, uint8_t *data, uint8_t *ivect, MifareCryptoDirection direction, MifareCryptoOperation operation, size_t block_size);
-void		 mifare_cypher_blocks_chained(FreefareTag tag, MifareDESFireKey key, uint8_t *ivect, uint8_t *data, size_t data_size, MifareCryptoDirection direction, MifareCryptoOperation operation);
+int		 mifare_cypher_blocks_chained(FreefareTag tag, MifareDESFireKey key, uint8_t *ivect, uint8_t *data, size_t data_size, MifareCryptoDirection direction, MifareCryptoOperation operation);
+void		 mifare_cypher_rekey(FreefareTag tag);
 void		 rol(uint8_t *data, const size_t len);
+uint32_t	 desfire_crc32_update(uint32_t crc, const uint8_t *data, size_t len);
 void		 desfire_crc32(const uint8_t *data, const size_t len, uint8_t *crc);
 void		 desfire_crc32_append(uint8_t *data, const size_t len);
 size_t		 key_block_size(const MifareDESFireKey key);
@@ -132,11 +168,92 @@ size_t		 padded_data_length(const size_t nbytes, const size_t block_size);
 size_t		 maced_data_length(const MifareDESFireKey key, const size_t nbytes);
 size_t		 enciphered_data_length(const FreefareTag tag, const size_t nbytes, int communication_settings);
 
+/*
+ * Incremental CMAC computation.  The last block is kept until cmac_final()
+ * because it is xored with a subkey before being enciphered.
+ */
+struct mifare_cmac_ctx {
+    MifareDESFireKey key;
+    uint8_t *ivect;
+    uint8_t block[MAX_CRYPTO_BLOCK_SIZE];
+    size_t block_n;
+};
+
+/*
+ * Post-processing of a response received in several frames.  Data is
+ * handed out as soon as it is known not to be part of the trailing MAC, CRC
+ * or padding, and verified when the last frame has been received.
+ */
+#define MIFARE_CRYTO_STREAM_BUFFER_SIZE 512
+
+struct mifare_cryto_stream {
+    FreefareTag tag;
+    int communication_settings;
+    int mode;
+    size_t hold;
+    uint8_t buffer[MIFARE_CRYTO_STREAM_BUFFER_SIZE];
+    size_t buffer_n;
+    size_t decyphered;
+    size_t received;
+    size_t delivered;
+    uint16_t crc16;
+    uint32_t crc32;
+    struct mifare_cmac_ctx mac;
+};
+
+int		 mifare_cryto_stream_init(struct mifare_cryto_stream *stream, FreefareTag tag, int communication_settings);
+int		 mifare_cryto_stream_update(struct mifare_cryto_stream *stream, const uint8_t *data, size_t nbytes, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data);
+int		 mifare_cryto_stream_final(struct mifare_cryto_stream *stream, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data);
+
+/*
+ * Pre-processing of a command sent in several frames.  The command header is
+ * sent as is, and the secured data is produced as frames are filled.
+ */
+struct mifare_cryto_send_stream {
+    FreefareTag tag;
+    int communication_settings;
+    int mode;
+    const uint8_t *header;
+    size_t header_n;
+    const uint8_t *data;
+    size_t data_n;
+    size_t consumed;
+    size_t length;
+    bool trailer;
+    uint8_t block[MAX_CRYPTO_BLOCK_SIZE];
+    size_t block_n;
+    uint8_t pending[2 * MAX_CRYPTO_BLOCK_SIZE];
+    size_t pending_n;
+    size_t pending_pos;
+    uint16_t crc16;
+    uint32_t crc32;
+    struct mifare_cmac_ctx mac;
+};
+
+int		 mifare_cryto_send_stream_init(struct mifare_cryto_send_stream *stream, FreefareTag tag, const uint8_t *header, size_t header_n, const uint8_t *data, size_t data_n, int communication_settings);
+size_t		 mifare_cryto_send_stream_read(struct mifare_cryto_send_stream *stream, uint8_t *buffer, size_t nbytes);
+
 void		 cmac_generate_subkeys(MifareDESFireKey key);
+void		 cmac_init(struct mifare_cmac_ctx *ctx, const MifareDESFireKey key, uint8_t *ivect);
+void		 cmac_update(struct mifare_cmac_ctx *ctx, const uint8_t *data, size_t len);
+void		 cmac_final(struct mifare_cmac_ctx *ctx, uint8_t *cmac);
 void		 cmac(const MifareDESFireKey key, uint8_t *ivect, const uint8_t *data, size_t len, uint8_t *cmac);
 void		 cmac_an10922(const MifareDESFireKey key, uint8_t *ivect, const uint8_t *data, size_t len, uint8_t *cmac);
 void		*assert_crypto_buffer_size(FreefareTag tag, size_t nbytes);
 
+struct mifare_desfire_emulator;
+
+struct mifare_desfire_emulator *mifare_desfire_emulator_new(const uint8_t uid[7]);
+void		 mifare_desfire_emulator_free(struct mifare_desfire_emulator *emu);
+void		 mifare_desfire_emulator_reset(struct mifare_desfire_emulator *emu);
+const uint8_t	*mifare_desfire_emulator_get_ats(struct mifare_desfire_emulator *emu, size_t *ats_len);
+int		 mifare_desfire_emulator_transceive(struct mifare_desfire_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len);
+
+extern const struct freefare_transport freefare_emulator_transport;
+
+const nfc_target *freefare_emulator_get_target(FreefareEmulator emulator);
+void		 freefare_emulator_set_version(FreefareEmulator emulator, const uint8_t version[8]);
+
 #define MIFARE_ULTRALIGHT_PAGE_COUNT  0x10
 #define MIFARE_ULTRALIGHT_C_PAGE_COUNT 0x30
 #define MIFARE_ULTRALIGHT_C_PAGE_COUNT_READ 0x2C
@@ -144,6 +261,9 @@ void		*assert_crypto_buffer_size(FreefareTag tag, size_t nbytes);
 #define MIFARE_ULTRALIGHT_MAX_PAGE_COUNT 0x30
 // Default timeout (ms) for tag operations
 #define MIFARE_DEFAULT_TIMEOUT 2000
+// Default parameters of adaptive timeout models
+#define TIMEOUT_MODEL_DEFAULT_MULTIPLIER 4
+#define TIMEOUT_MODEL_DEFAULT_FLOOR 10
 
 /*
  * This structure is common to all supported MIFARE targets but shall not be
@@ -155,10 +275,20 @@ void		*assert_crypto_buffer_size(FreefareTag tag, size_t nbytes);
  */
 struct freefare_tag {
     nfc_device *device;
+    const struct freefare_transport *transport;
+    void *transport_data;
+    struct freefare_tag_stats *stats;
+    struct freefare_timeout_model *timeout_model;
+    struct freefare_trace *trace;
+    uint32_t trace_session;
     nfc_target info;
     int type;
     int active;
     int timeout;
+    /* Command code and frame index of the last exchange */
+    uint8_t command;
+    size_t frame;
+    struct freefare_error_info error;
     void (*free_tag)(FreefareTag tag);
 };
 
@@ -193,18 +323,26 @@ struct mifare_desfire_key {
     DES_key_schedule ks1;
     DES_key_schedule ks2;
     DES_key_schedule ks3;
+    AES_KEY aes_ks_encypher;
+    AES_KEY aes_ks_decypher;
     uint8_t cmac_sk1[24];
     uint8_t cmac_sk2[24];
     uint8_t aes_version;
 };
 
+struct mifare_desfire_file_settings_cache;
+
 struct mifare_desfire_tag {
     struct freefare_tag __tag;
 
     uint8_t last_picc_error;
     uint8_t last_internal_error;
     uint8_t last_pcd_error;
-    MifareDESFireKey session_key;
+    MifareDESFireKey session_key; /* NULL or &session_key_storage */
+    struct mifare_desfire_key session_key_storage;
+    EVP_CIPHER_CTX *cbc_encypher; /* Keyed with the session key */
+    EVP_CIPHER_CTX *cbc_decypher;
+    const EVP_CIPHER *cbc_cipher; /* NULL when the contexts are not keyed */
     enum { AS_LEGACY, AS_NEW } authentication_scheme;
     uint8_t authenticated_key_no;
     uint8_t ivect[MAX_CRYPTO_BLOCK_SIZE];
@@ -212,6 +350,9 @@ struct mifare_desfire_tag {
     uint8_t *crypto_buffer;
     size_t crypto_buffer_size;
     uint32_t selected_application;
+    struct mifare_desfire_file_settings_cache *file_settings_cache;
+    size_t max_capdu_size;
+    size_t max_rapdu_size;
 };
 
 struct mifare_key_deriver {
@@ -220,9 +361,46 @@ struct mifare_key_deriver {
     uint8_t m[32];
     int len;
     int flags;
+    MifareKeyCache cache;
+};
+
+/*
+ * Derived keys are cached by master key, output key type, flags and
+ * diversification input (without the DIV constant in m[0]).
+ */
+struct mifare_key_cache_entry {
+    struct mifare_key_cache_entry *lru_prev;
+    struct mifare_key_cache_entry *lru_next;
+    struct mifare_key_cache_entry *bucket_next;
+    uint32_t hash;
+    MifareKeyType master_key_type;
+    uint8_t master_key_data[24];
+    uint8_t master_key_version;
+    MifareKeyType output_key_type;
+    int flags;
+    uint8_t m[32];
+    int len;
+    struct mifare_desfire_key key;
+};
+
+struct mifare_key_cache {
+    size_t capacity;
+    size_t count;
+    size_t buckets_mask;
+    struct mifare_key_cache_entry *entries;
+    struct mifare_key_cache_entry **buckets;
+    struct mifare_key_cache_entry *lru_first; /* Most recently used */
+    struct mifare_key_cache_entry *lru_last;
+    unsigned long hits;
+    unsigned long misses;
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_t mutex;
+#endif
 };
 
+MifareDESFireKey mifare_desfire_key_copy(MifareDESFireKey key);
 MifareDESFireKey mifare_desfire_session_key_new(const uint8_t rnda[], const uint8_t rndb[], MifareDESFireKey authentication_key);
+void		 mifare_desfire_session_key_init(MifareDESFireKey key, const uint8_t rnda[], const uint8_t rndb[], MifareDESFireKey authentication_key);
 const char	*mifare_desfire_error_lookup(uint8_t error);
 
 struct mifare_ultralight_tag {
@@ -258,6 +436,7 @@ struct ntag21x_key {
 };
 
 const char      *ntag21x_error_lookup(uint8_t code);
+void		 ntag21x_set_version(FreefareTag tag, const uint8_t version[8]);
 
 /*
  * FreefareTag assertion macros
@@ -265,8 +444,8 @@ const char      *ntag21x_error_lookup(uint8_t code);
  * This macros provide a simple and unified way to perform various tests at the
  * beginning of the different targets functions.
  */
-#define ASSERT_ACTIVE(tag) do { if (!tag->active) return errno = ENXIO, -1; } while (0)
-#define ASSERT_INACTIVE(tag) do { if (tag->active) return errno = ENXIO, -1; } while (0)
+#define ASSERT_ACTIVE(tag) do { if (!tag->active) return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENXIO); } while (0)
+#define ASSERT_INACTIVE(tag) do { if (tag->active) return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENXIO); } while (0)
 
 /*
  * FreefareTag cast macros
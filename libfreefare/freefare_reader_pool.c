@@ -0,0 +1,357 @@
+/*
+ * Reader pools
+ *
+ * A reader pool polls several NFC devices at once, and runs a job for each
+ * tag arriving in the field of any of them.  Each device is driven by its own
+ * thread: a tag can only be reached through the device it was found on, so
+ * the job runs on that thread, between two polls of the device.  The number
+ * of jobs running at the same time is bounded.
+ *
+ * Tags are connected before the job is run, and disconnected and freed after
+ * it returns.
+ */
+
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#if defined(HAVE_PTHREAD_H)
+    #include <pthread.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <freefare.h>
+
+#include "freefare_internal.h"
+
+#define READER_POOL_POLL_INTERVAL 100 /* ms */
+
+#if defined(HAVE_PTHREAD_H)
+
+struct freefare_reader {
+    struct freefare_reader_pool *pool;
+    nfc_device *device;
+    FreefarePoller poller;
+    pthread_t thread;
+    bool started;
+};
+
+struct freefare_reader_pool {
+    struct freefare_reader *readers;
+    size_t reader_count;
+    int (*job)(FreefareTag tag, void *data);
+    void *data;
+    int (*enumerate)(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data);
+    unsigned int max_jobs;
+    unsigned int running_jobs;
+    bool running;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+FreefareReaderPool
+freefare_reader_pool_new(nfc_device *devices[], size_t device_count, unsigned int max_jobs, int (*job)(FreefareTag tag, void *data), void *data)
+{
+    FreefareReaderPool pool;
+
+    if (!devices || !device_count || !job) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    if (!(pool = calloc(1, sizeof(*pool))))
+	return NULL;
+    if (!(pool->readers = calloc(device_count, sizeof(*pool->readers)))) {
+	free(pool);
+	return NULL;
+    }
+
+    for (size_t i = 0; i < device_count; i++) {
+	pool->readers[i].pool = pool;
+	pool->readers[i].device = devices[i];
+    }
+    pool->reader_count = device_count;
+    pool->job = job;
+    pool->data = data;
+    pool->max_jobs = max_jobs ? max_jobs : device_count;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    return pool;
+}
+
+/*
+ * Find the tags in the field of the devices of pool with enumerate instead
+ * of pollers, e.g. to drive the pool with emulated tags.
+ */
+void
+freefare_reader_pool_set_enumerator(FreefareReaderPool pool, int (*enumerate)(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data))
+{
+    pool->enumerate = enumerate;
+}
+
+static int
+reader_pool_connect(FreefareTag tag)
+{
+    switch (freefare_get_tag_type(tag)) {
+    case FELICA:
+	return 0;
+    case MIFARE_MINI:
+    case MIFARE_CLASSIC_1K:
+    case MIFARE_CLASSIC_4K:
+	return mifare_classic_connect(tag);
+    case MIFARE_DESFIRE:
+	return mifare_desfire_connect(tag);
+    case MIFARE_ULTRALIGHT:
+    case MIFARE_ULTRALIGHT_C:
+	return mifare_ultralight_connect(tag);
+    case NTAG_21x:
+	return ntag21x_connect(tag);
+    }
+
+    return errno = EINVAL, -1;
+}
+
+static void
+reader_pool_disconnect(FreefareTag tag)
+{
+    if (!tag->active)
+	return;
+
+    switch (freefare_get_tag_type(tag)) {
+    case FELICA:
+	break;
+    case MIFARE_MINI:
+    case MIFARE_CLASSIC_1K:
+    case MIFARE_CLASSIC_4K:
+	mifare_classic_disconnect(tag);
+	break;
+    case MIFARE_DESFIRE:
+	mifare_desfire_disconnect(tag);
+	break;
+    case MIFARE_ULTRALIGHT:
+    case MIFARE_ULTRALIGHT_C:
+	mifare_ultralight_disconnect(tag);
+	break;
+    case NTAG_21x:
+	ntag21x_disconnect(tag);
+	break;
+    }
+}
+
+/*
+ * Called by the poller of a reader for each tag found in its field.
+ */
+static int
+reader_pool_tag_found(FreefareTag tag, void *data)
+{
+    struct freefare_reader_pool *pool = data;
+    int res = 0;
+
+    if (reader_pool_connect(tag) >= 0) {
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->running && (pool->running_jobs >= pool->max_jobs))
+	    pthread_cond_wait(&pool->cond, &pool->mutex);
+	bool run = pool->running;
+	if (run)
+	    pool->running_jobs++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (run) {
+	    res = pool->job(tag, pool->data);
+
+	    pthread_mutex_lock(&pool->mutex);
+	    pool->running_jobs--;
+	    if (res)
+		pool->running = false;
+	    pthread_cond_broadcast(&pool->cond);
+	    pthread_mutex_unlock(&pool->mutex);
+	}
+
+	reader_pool_disconnect(tag);
+    }
+
+    freefare_free_tag(tag);
+
+    return res;
+}
+
+static void *
+reader_pool_worker(void *data)
+{
+    struct freefare_reader *reader = data;
+    struct freefare_reader_pool *pool = reader->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running) {
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (pool->enumerate)
+	    pool->enumerate(reader->device, reader_pool_tag_found, pool);
+	else
+	    freefare_poller_enumerate_tags(reader->poller, reader_pool_tag_found, pool);
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += READER_POOL_POLL_INTERVAL * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->running)
+	    pthread_cond_timedwait(&pool->cond, &pool->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+static void
+reader_pool_free_pollers(FreefareReaderPool pool)
+{
+    for (size_t i = 0; i < pool->reader_count; i++) {
+	freefare_poller_free(pool->readers[i].poller);
+	pool->readers[i].poller = NULL;
+    }
+}
+
+int
+freefare_reader_pool_start(FreefareReaderPool pool)
+{
+    int res;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (size_t i = 0; i < pool->reader_count; i++) {
+	if (pool->readers[i].started) {
+	    pthread_mutex_unlock(&pool->mutex);
+	    return errno = EBUSY, -1;
+	}
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    // Pollers are created beforehand so that workers cannot fail to start
+    for (size_t i = 0; !pool->enumerate && (i < pool->reader_count); i++) {
+	if (!(pool->readers[i].poller = freefare_poller_new(pool->readers[i].device))) {
+	    res = errno;
+	    reader_pool_free_pollers(pool);
+	    return errno = res, -1;
+	}
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = true;
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->reader_count; i++) {
+	if ((res = pthread_create(&pool->readers[i].thread, NULL, reader_pool_worker, &pool->readers[i]))) {
+	    freefare_reader_pool_stop(pool);
+	    return errno = res, -1;
+	}
+	pool->readers[i].started = true;
+    }
+
+    return 0;
+}
+
+int
+freefare_reader_pool_stop(FreefareReaderPool pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->running = false;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->reader_count; i++) {
+	if (pool->readers[i].started) {
+	    pthread_join(pool->readers[i].thread, NULL);
+	    pool->readers[i].started = false;
+	}
+    }
+    reader_pool_free_pollers(pool);
+
+    return 0;
+}
+
+bool
+freefare_reader_pool_is_running(FreefareReaderPool pool)
+{
+    bool running;
+
+    pthread_mutex_lock(&pool->mutex);
+    running = pool->running;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return running;
+}
+
+void
+freefare_reader_pool_free(FreefareReaderPool pool)
+{
+    if (!pool)
+	return;
+
+    freefare_reader_pool_stop(pool);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->readers);
+    free(pool);
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+FreefareReaderPool
+freefare_reader_pool_new(nfc_device *devices[], size_t device_count, unsigned int max_jobs, int (*job)(FreefareTag tag, void *data), void *data)
+{
+    (void) devices;
+    (void) device_count;
+    (void) max_jobs;
+    (void) job;
+    (void) data;
+
+    errno = ENOSYS;
+    return NULL;
+}
+
+void
+freefare_reader_pool_set_enumerator(FreefareReaderPool pool, int (*enumerate)(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data))
+{
+    (void) pool;
+    (void) enumerate;
+}
+
+int
+freefare_reader_pool_start(FreefareReaderPool pool)
+{
+    (void) pool;
+
+    return errno = ENOSYS, -1;
+}
+
+int
+freefare_reader_pool_stop(FreefareReaderPool pool)
+{
+    (void) pool;
+
+    return errno = ENOSYS, -1;
+}
+
+bool
+freefare_reader_pool_is_running(FreefareReaderPool pool)
+{
+    (void) pool;
+
+    return false;
+}
+
+void
+freefare_reader_pool_free(FreefareReaderPool pool)
+{
+    (void) pool;
+}
+
+#endif /* HAVE_PTHREAD_H */
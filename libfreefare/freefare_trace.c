@@ -0,0 +1,562 @@
+/*
+ * Binary traces
+ *
+ * Tags attached to a trace created with freefare_trace_create() append a
+ * record for each frame they exchange to the trace file.  A trace opened with
+ * freefare_trace_open() is mapped in memory, and can be walked record by
+ * record or replayed: tags returned by freefare_trace_tag_new() answer each
+ * frame with the response recorded for it, at CPU speed and without any NFC
+ * device.
+ *
+ * The random bytes drawn by the library for a tag (e.g. the challenges of
+ * MIFARE DESFire and Ultralight C authentication) are recorded as well, and
+ * replayed tags draw them from the trace instead, so that authenticated
+ * sessions replay like any other.
+ *
+ * Replay expects the library to send the same frames as when the trace was
+ * recorded.  A frame which differs from the recorded one, or is sent when
+ * random bytes were recorded, fails with NFC_ESOFT, and frames sent after the
+ * end of the session fail with NFC_ETIMEOUT, as if the tag had left the
+ * field.
+ */
+
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#if defined(HAVE_SYS_MMAN_H)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freefare.h>
+
+#include "freefare_internal.h"
+
+#define TRACE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+#if defined(__GNUC__)
+#  define TRACE_NEXT_SESSION(trace) __atomic_fetch_add(&(trace)->next_session, 1, __ATOMIC_RELAXED)
+#else
+#  define TRACE_NEXT_SESSION(trace) ((trace)->next_session++)
+#endif
+
+struct freefare_trace_session {
+    struct freefare_trace *trace;
+    const struct freefare_trace_record *record;
+    size_t next;
+    struct freefare_transport transport;
+};
+
+struct freefare_trace {
+    /* Recording */
+    FILE *file;
+    uint32_t next_session;
+
+    /* Replay */
+    const uint8_t *data;
+    size_t size;
+    size_t end;
+    struct freefare_trace_session *sessions;
+    size_t session_count;
+};
+
+/*
+ * Load the content of the trace file in memory.
+ */
+static int
+trace_load(FreefareTrace trace, const char *path)
+{
+#if defined(HAVE_SYS_MMAN_H)
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    if ((size_t) st.st_size < sizeof(struct freefare_trace_header)) {
+	close(fd);
+	return errno = EINVAL, -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == data)
+	return -1;
+
+    trace->data = data;
+    trace->size = st.st_size;
+#else
+    FILE *file;
+    long size;
+    uint8_t *data;
+
+    if (!(file = fopen(path, "rb")))
+	return -1;
+    if ((fseek(file, 0, SEEK_END) < 0) || ((size = ftell(file)) < 0) || (fseek(file, 0, SEEK_SET) < 0)) {
+	fclose(file);
+	return -1;
+    }
+    if ((size_t) size < sizeof(struct freefare_trace_header)) {
+	fclose(file);
+	return errno = EINVAL, -1;
+    }
+    if (!(data = malloc(size))) {
+	fclose(file);
+	return -1;
+    }
+    if (fread(data, 1, size, file) != (size_t) size) {
+	free(data);
+	fclose(file);
+	return errno = EIO, -1;
+    }
+    fclose(file);
+
+    trace->data = data;
+    trace->size = size;
+#endif
+
+    return 0;
+}
+
+static void
+trace_unload(FreefareTrace trace)
+{
+    if (!trace->data)
+	return;
+
+#if defined(HAVE_SYS_MMAN_H)
+    munmap((void *) trace->data, trace->size);
+#else
+    free((void *) trace->data);
+#endif
+    trace->data = NULL;
+    trace->size = trace->end = 0;
+
+    free(trace->sessions);
+    trace->sessions = NULL;
+    trace->session_count = 0;
+}
+
+static const struct freefare_trace_record *
+trace_record_at(FreefareTrace trace, size_t offset)
+{
+    if (offset >= trace->end)
+	return NULL;
+
+    return (const struct freefare_trace_record *) (trace->data + offset);
+}
+
+/*
+ * Check the records of the loaded trace and index its sessions.  A truncated
+ * last record (the recording process was interrupted) ends the trace.
+ */
+static int
+trace_index(FreefareTrace trace)
+{
+    const struct freefare_trace_header *header = (const struct freefare_trace_header *) trace->data;
+    size_t offset = sizeof(*header);
+    size_t count = 0;
+
+    if (memcmp(header->magic, FREEFARE_TRACE_MAGIC, sizeof(FREEFARE_TRACE_MAGIC)) || (FREEFARE_TRACE_VERSION != header->version))
+	return errno = EINVAL, -1;
+
+    while (offset + sizeof(struct freefare_trace_record) <= trace->size) {
+	const struct freefare_trace_record *record = (const struct freefare_trace_record *) (trace->data + offset);
+
+	if ((record->size % 8) || (record->size < TRACE_ALIGN(sizeof(*record) + record->tx_len + record->rx_len)) || (record->size > trace->size - offset))
+	    break;
+	if (FREEFARE_TRACE_SESSION == record->type)
+	    count++;
+	offset += record->size;
+    }
+    trace->end = offset;
+
+    if (count && !(trace->sessions = calloc(count, sizeof(*trace->sessions))))
+	return -1;
+
+    for (offset = sizeof(*header); offset < trace->end; offset += trace_record_at(trace, offset)->size) {
+	const struct freefare_trace_record *record = trace_record_at(trace, offset);
+
+	if (FREEFARE_TRACE_SESSION == record->type) {
+	    trace->sessions[trace->session_count].trace = trace;
+	    trace->sessions[trace->session_count].record = record;
+	    trace->session_count++;
+	}
+    }
+
+    return 0;
+}
+
+static int
+trace_write(FreefareTrace trace, struct freefare_trace_record *record, const void *tx, size_t tx_len, const void *rx, size_t rx_len)
+{
+    uint8_t stack_buffer[1024];
+    uint8_t *buffer = stack_buffer;
+
+    if ((tx_len > UINT16_MAX) || (rx_len > UINT16_MAX))
+	return errno = EINVAL, -1;
+
+    record->size = TRACE_ALIGN(sizeof(*record) + tx_len + rx_len);
+    record->tx_len = tx_len;
+    record->rx_len = rx_len;
+
+    if (record->size > sizeof(stack_buffer) && !(buffer = malloc(record->size)))
+	return -1;
+
+    memset(buffer, 0, record->size);
+    memcpy(buffer, record, sizeof(*record));
+    if (tx_len)
+	memcpy(buffer + sizeof(*record), tx, tx_len);
+    if (rx_len)
+	memcpy(buffer + sizeof(*record) + tx_len, rx, rx_len);
+
+    /* Records are written at once so that tags used by several threads do not
+     * interleave them.  They are buffered until the session ends or
+     * freefare_trace_flush() is called. */
+    int res = 0;
+    if (fwrite(buffer, record->size, 1, trace->file) != 1) {
+	errno = EIO;
+	res = -1;
+    }
+
+    if (buffer != stack_buffer)
+	free(buffer);
+
+    return res;
+}
+
+/*
+ * Open the provided trace file for recording, creating it if needed.  New
+ * records are appended to existing traces, after dropping a truncated last
+ * record.
+ */
+FreefareTrace
+freefare_trace_create(const char *path)
+{
+    FreefareTrace trace;
+    long size;
+    int res;
+
+    if (!(trace = calloc(1, sizeof(*trace))))
+	return NULL;
+
+    if (!(trace->file = fopen(path, "ab")))
+	goto error;
+    if ((fseek(trace->file, 0, SEEK_END) < 0) || ((size = ftell(trace->file)) < 0))
+	goto error;
+
+    if (size) {
+	// Continue the numbering of sessions
+	if ((trace_load(trace, path) < 0) || (trace_index(trace) < 0))
+	    goto error;
+	trace->next_session = trace->session_count;
+	size_t end = trace->end;
+	trace_unload(trace);
+
+	// Records appended after a truncated one would be lost
+	if (end < (size_t) size) {
+#if defined(HAVE_SYS_MMAN_H)
+	    if (ftruncate(fileno(trace->file), end) < 0)
+		goto error;
+#else
+	    errno = EINVAL;
+	    goto error;
+#endif
+	}
+    } else {
+	struct freefare_trace_header header = {
+	    .magic = FREEFARE_TRACE_MAGIC,
+	    .version = FREEFARE_TRACE_VERSION,
+	};
+	if ((fwrite(&header, sizeof(header), 1, trace->file) != 1) || fflush(trace->file)) {
+	    errno = EIO;
+	    goto error;
+	}
+    }
+
+    return trace;
+
+error:
+    res = errno;
+    freefare_trace_free(trace);
+    errno = res;
+    return NULL;
+}
+
+/*
+ * Open the provided trace file for replay.
+ */
+FreefareTrace
+freefare_trace_open(const char *path)
+{
+    FreefareTrace trace;
+
+    if (!(trace = calloc(1, sizeof(*trace))))
+	return NULL;
+
+    if ((trace_load(trace, path) < 0) || (trace_index(trace) < 0)) {
+	int res = errno;
+	freefare_trace_free(trace);
+	errno = res;
+	return NULL;
+    }
+
+    return trace;
+}
+
+/*
+ * Write the buffered records of trace to its file.
+ */
+int
+freefare_trace_flush(FreefareTrace trace)
+{
+    if (!trace->file)
+	return errno = EINVAL, -1;
+
+    if (fflush(trace->file))
+	return errno = EIO, -1;
+
+    return 0;
+}
+
+/*
+ * Record the frames exchanged with the provided tag in trace, or stop
+ * recording them if trace is NULL.  The records of the previous session of
+ * tag are flushed.
+ */
+int
+freefare_set_tag_trace(FreefareTag tag, FreefareTrace trace)
+{
+    if (tag->trace) {
+	freefare_trace_flush(tag->trace);
+	tag->trace = NULL;
+    }
+
+    if (!trace)
+	return 0;
+
+    if (!trace->file)
+	return errno = EINVAL, -1;
+
+    // Tags attached concurrently to the same trace get distinct sessions
+    uint32_t session = TRACE_NEXT_SESSION(trace);
+    uint32_t max_frame_size = tag->transport->max_frame_size;
+    struct freefare_trace_record record = {
+	.session = session,
+	.timestamp_ns = freefare_stats_clock(),
+	.result = tag->type,
+	.type = FREEFARE_TRACE_SESSION,
+    };
+
+    if (trace_write(trace, &record, &tag->info, sizeof(tag->info), &max_frame_size, sizeof(max_frame_size)) < 0)
+	return -1;
+
+    tag->trace = trace;
+    tag->trace_session = session;
+
+    return 0;
+}
+
+void
+freefare_trace_frame(FreefareTag tag, const uint8_t *tx, size_t tx_len, const uint8_t *rx, int res, uint64_t start, uint64_t end)
+{
+    struct freefare_trace_record record = {
+	.session = tag->trace_session,
+	.timestamp_ns = start,
+	.rtt_ns = MIN(end - start, UINT32_MAX),
+	.result = res,
+	.type = FREEFARE_TRACE_FRAME,
+    };
+
+    trace_write(tag->trace, &record, tx, tx_len, rx, (res > 0) ? res : 0);
+}
+
+void
+freefare_trace_random(FreefareTag tag, const uint8_t *buf, size_t n)
+{
+    struct freefare_trace_record record = {
+	.session = tag->trace_session,
+	.timestamp_ns = freefare_stats_clock(),
+	.result = n,
+	.type = FREEFARE_TRACE_RANDOM,
+    };
+
+    trace_write(tag->trace, &record, NULL, 0, buf, n);
+}
+
+/*
+ * Return the record following the provided one in a trace opened for
+ * replay, or the first record if record is NULL.
+ */
+const struct freefare_trace_record *
+freefare_trace_next_record(FreefareTrace trace, const struct freefare_trace_record *record)
+{
+    if (!trace->data)
+	return NULL;
+
+    if (!record)
+	return trace_record_at(trace, sizeof(struct freefare_trace_header));
+
+    return trace_record_at(trace, (const uint8_t *) record - trace->data + record->size);
+}
+
+size_t
+freefare_trace_get_session_count(FreefareTrace trace)
+{
+    return trace->session_count;
+}
+
+/*
+ * Return the next frame or random bytes record of the replayed session.
+ */
+static const struct freefare_trace_record *
+replay_next_record(struct freefare_trace_session *session)
+{
+    const struct freefare_trace_record *record;
+
+    while ((record = trace_record_at(session->trace, session->next))) {
+	session->next += record->size;
+	if ((FREEFARE_TRACE_SESSION != record->type) && (record->session == session->record->session))
+	    break;
+    }
+
+    return record;
+}
+
+static int
+replay_transceive(void *data, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len, int timeout)
+{
+    struct freefare_trace_session *session = data;
+    const struct freefare_trace_record *record;
+
+    (void) timeout;
+
+    if (!(record = replay_next_record(session)))
+	return NFC_ETIMEOUT;
+    if (FREEFARE_TRACE_FRAME != record->type)
+	return NFC_ESOFT;
+
+    const uint8_t *recorded_tx = (const uint8_t *) (record + 1);
+    if ((tx_len != record->tx_len) || memcmp(tx, recorded_tx, tx_len))
+	return NFC_ESOFT;
+
+    if (record->result < 0)
+	return record->result;
+    if (record->rx_len > rx_len)
+	return NFC_EOVFLOW;
+
+    memcpy(rx, recorded_tx + record->tx_len, record->rx_len);
+    return record->result;
+}
+
+/*
+ * Copy the random bytes recorded next in the session replayed by tag.
+ * Returns 1 if they were copied, 0 if tag does not replay a trace and -1 if
+ * the session recorded something else.
+ */
+int
+freefare_trace_replay_random(FreefareTag tag, uint8_t *buf, size_t n)
+{
+    const struct freefare_trace_record *record;
+
+    if (replay_transceive != tag->transport->transceive)
+	return 0;
+
+    if (!(record = replay_next_record(tag->transport_data)) || (FREEFARE_TRACE_RANDOM != record->type) || (n != record->rx_len))
+	return -1;
+
+    memcpy(buf, (const uint8_t *) (record + 1) + record->tx_len, n);
+    return 1;
+}
+
+static int
+replay_select(void *data, nfc_modulation modulation, const uint8_t *uid, size_t uid_len)
+{
+    (void) data;
+    (void) modulation;
+    (void) uid;
+    (void) uid_len;
+
+    return NFC_SUCCESS;
+}
+
+static int
+replay_deselect(void *data)
+{
+    (void) data;
+
+    return NFC_SUCCESS;
+}
+
+static int
+replay_set_property_bool(void *data, nfc_property property, bool enable)
+{
+    (void) data;
+    (void) property;
+    (void) enable;
+
+    return NFC_SUCCESS;
+}
+
+/*
+ * Allocate a tag replaying the provided session of trace.  The tag shall be
+ * freed before the trace.
+ */
+FreefareTag
+freefare_trace_tag_new(FreefareTrace trace, size_t session)
+{
+    struct freefare_trace_session *s;
+    nfc_target target;
+    uint32_t max_frame_size;
+    FreefareTag tag;
+
+    if (session >= trace->session_count) {
+	errno = EINVAL;
+	return NULL;
+    }
+    s = &trace->sessions[session];
+
+    // The target was recorded by a library built against the same libnfc
+    if ((s->record->tx_len != sizeof(target)) || (s->record->rx_len != sizeof(max_frame_size))) {
+	errno = EINVAL;
+	return NULL;
+    }
+    memcpy(&target, s->record + 1, sizeof(target));
+    memcpy(&max_frame_size, (const uint8_t *) (s->record + 1) + sizeof(target), sizeof(max_frame_size));
+
+    if (!(tag = freefare_tag_new_with_type(s->record->result, NULL, target)))
+	return NULL;
+
+    s->next = (const uint8_t *) s->record - trace->data + s->record->size;
+    s->transport.transceive = replay_transceive;
+    s->transport.select = replay_select;
+    s->transport.deselect = replay_deselect;
+    s->transport.set_property_bool = replay_set_property_bool;
+    s->transport.max_frame_size = max_frame_size;
+    freefare_set_tag_transport(tag, &s->transport, s);
+
+    return tag;
+}
+
+void
+freefare_trace_free(FreefareTrace trace)
+{
+    if (!trace)
+	return;
+
+    if (trace->file)
+	fclose(trace->file);
+    trace_unload(trace);
+    free(trace);
+}
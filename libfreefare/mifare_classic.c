@@ -73,13 +73,13 @@
 	errno = 0; \
 	DEBUG_XFER (msg, __##msg##_n, "===> "); \
 	int _res; \
-	if ((_res = nfc_initiator_transceive_bytes (tag->device, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
+	if ((_res = freefare_transceive_bytes (tag, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
 	    if (disconnect) { \
 		tag->active = false; \
 	    } \
 	    if (_res == NFC_EMFCAUTHFAIL) \
-		return errno = EACCES, -1; \
-	    return errno = EIO, -1; \
+		return freefare_tag_error(tag, FREEFARE_ERROR_PICC, EACCES); \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	__##res##_n = _res; \
 	DEBUG_XFER (res, __##res##_n, "<=== "); \
@@ -225,6 +225,12 @@ _mifare_classic_tag_new(nfc_device *device, nfc_target target, int tag_type)
 	tag->type = tag_type;
 	tag->free_tag = mifare_classic_tag_free;
 	tag->device = device;
+	tag->transport = &freefare_nfc_transport;
+	tag->transport_data = device;
+	tag->stats = NULL;
+	tag->timeout_model = NULL;
+	tag->trace = NULL;
+	freefare_reset_tag_error(tag);
 	tag->info = target;
 	tag->active = 0;
     }
@@ -277,16 +283,14 @@ mifare_classic_connect(FreefareTag tag)
 {
     ASSERT_INACTIVE(tag);
 
-    nfc_target pnti;
     nfc_modulation modulation = {
 	.nmt = NMT_ISO14443A,
 	.nbr = NBR_106
     };
-    if (nfc_initiator_select_passive_target(tag->device, modulation, tag->info.nti.nai.abtUid, tag->info.nti.nai.szUidLen, &pnti) >= 0) {
+    if (freefare_select_target(tag, modulation) >= 0) {
 	tag->active = 1;
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     }
     return 0;
 }
@@ -299,11 +303,10 @@ mifare_classic_disconnect(FreefareTag tag)
 {
     ASSERT_ACTIVE(tag);
 
-    if (nfc_initiator_deselect_target(tag->device) >= 0) {
+    if (freefare_deselect_target(tag) >= 0) {
 	tag->active = 0;
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     }
     return 0;
 }
@@ -395,15 +398,11 @@ mifare_classic_read_value(FreefareTag tag, const MifareClassicBlockNumber block,
     if (mifare_classic_read(tag, block, &b.data) < 0)
 	return -1;
 
-    if ((b.value.value ^ (uint32_t)~b.value.value_) || (b.value.value != b.value.value__)) {
-	errno = EIO;
-	return -1;
-    }
+    if ((b.value.value ^ (uint32_t)~b.value.value_) || (b.value.value != b.value.value__))
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EIO);
 
-    if ((b.value.address ^ (uint8_t)~b.value.address_) || (b.value.address != b.value.address__) || (b.value.address_ != b.value.address___)) {
-	errno = EIO;
-	return -1;
-    }
+    if ((b.value.address ^ (uint8_t)~b.value.address_) || (b.value.address != b.value.address__) || (b.value.address_ != b.value.address___))
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EIO);
 
     if (value)
 	*value = le32toh(b.value.value);
@@ -582,10 +581,8 @@ get_block_access_bits(FreefareTag tag, const MifareClassicBlockNumber block, Mif
      * The first block which holds the manufacturer block seems to have
      * inconsistent access bits.
      */
-    if (block == 0) {
-	errno = EINVAL;
-	return -1;
-    }
+    if (block == 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
 
     uint16_t sector_access_bits, sector_access_bits_;
 
@@ -615,8 +612,7 @@ get_block_access_bits(FreefareTag tag, const MifareClassicBlockNumber block, Mif
 
 	if (sector_access_bits ^ (uint16_t)~sector_access_bits_) {
 	    /* Sector locked */
-	    errno = EIO;
-	    return -1;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EIO);
 	}
 	MIFARE_CLASSIC(tag)->cached_access_bits.sector_trailer_block_number = trailer;
 	MIFARE_CLASSIC(tag)->cached_access_bits.block_number = -1;
@@ -667,8 +663,7 @@ mifare_classic_get_trailer_block_permission(FreefareTag tag, const MifareClassic
     if (MIFARE_CLASSIC(tag)->cached_access_bits.sector_trailer_block_number == block) {
 	return (mifare_trailer_access_permissions[access_bits] & (permission) << ((key_type == MFC_KEY_A) ? 1 : 0)) ? 1 : 0;
     } else {
-	errno = EINVAL;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
 }
 
@@ -686,8 +681,7 @@ mifare_classic_get_data_block_permission(FreefareTag tag, const MifareClassicBlo
     if (MIFARE_CLASSIC(tag)->cached_access_bits.sector_trailer_block_number != block) {
 	return ((mifare_data_access_permissions[access_bits] & (permission << ((key_type == MFC_KEY_A) ? 4 : 0))) ? 1 : 0);
     } else {
-	errno = EINVAL;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
 }
 
@@ -716,13 +710,13 @@ mifare_classic_format_sector(FreefareTag tag, const MifareClassicSectorNumber se
 
     for (int n = first_sector_block; n < last_sector_block; n++) {
 	if (mifare_classic_get_data_block_permission(tag, n, MCAB_W, MIFARE_CLASSIC(tag)->last_authentication_key_type) != 1) {
-	    return errno = EPERM, -1;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EPERM);
 	}
     }
     if ((mifare_classic_get_trailer_block_permission(tag, last_sector_block, MCAB_WRITE_KEYA, MIFARE_CLASSIC(tag)->last_authentication_key_type) != 1) ||
 	(mifare_classic_get_trailer_block_permission(tag, last_sector_block, MCAB_WRITE_ACCESS_BITS, MIFARE_CLASSIC(tag)->last_authentication_key_type) != 1) ||
 	(mifare_classic_get_trailer_block_permission(tag, last_sector_block, MCAB_WRITE_KEYB, MIFARE_CLASSIC(tag)->last_authentication_key_type) != 1)) {
-	return errno = EPERM, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EPERM);
     }
 
     MifareClassicBlock empty_data_block;
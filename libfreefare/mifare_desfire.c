@@ -80,44 +80,60 @@ struct mifare_desfire_raw_file_settings {
 
 #define CMAC_LENGTH 8
 
-static struct mifare_desfire_file_settings cached_file_settings[MAX_FILE_COUNT];
-static bool cached_file_settings_current[MAX_FILE_COUNT];
+/*
+ * File settings are cached per application until a command which may change
+ * them is sent to the tag.
+ */
+struct mifare_desfire_file_settings_cache {
+    uint32_t aid;
+    uint32_t current; /* One bit per file number */
+    struct mifare_desfire_file_settings settings[MAX_FILE_COUNT];
+    struct mifare_desfire_file_settings_cache *next;
+};
 
 static int	 desfire_transceive(FreefareTag tag, const uint8_t *msg, size_t msg_len, uint8_t *res, size_t res_size, size_t *res_len);
 static int	 authenticate(FreefareTag tag, uint8_t cmd, uint8_t key_no, MifareDESFireKey key);
 static int	 create_file1(FreefareTag tag, uint8_t command, uint8_t file_no, int has_iso_file_id, uint16_t iso_file_id, uint8_t communication_settings, uint16_t access_rights, uint32_t file_size);
 static int	 create_file2(FreefareTag tag, uint8_t command, uint8_t file_no, int has_iso_file_id, uint16_t iso_file_id, uint8_t communication_settings, uint16_t access_rights, uint32_t record_size, uint32_t max_number_of_records);
 static ssize_t	 write_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, const void *data, int cs);
-static ssize_t	 read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, void *data, int cs);
+static ssize_t	 read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, void *data, size_t data_size, int cs, const struct mifare_desfire_file_settings *settings);
+static struct mifare_desfire_file_settings_cache *file_settings_cache(FreefareTag tag, uint32_t aid, bool create);
+static void	 clear_session_key(FreefareTag tag);
+static void	 invalidate_file_settings(FreefareTag tag, uint8_t file_no);
+static void	 invalidate_transaction_file_settings(FreefareTag tag);
+static void	 invalidate_application_file_settings(FreefareTag tag, uint32_t aid);
+static void	 free_file_settings_cache(FreefareTag tag);
 
 #define NOT_YET_AUTHENTICATED 255
 
 #define ASSERT_AUTHENTICATED(tag) \
     do { \
 	if (MIFARE_DESFIRE (tag)->authenticated_key_no == NOT_YET_AUTHENTICATED) { \
-	    return errno = EINVAL, -1;\
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	} \
     } while (0)
 
 /*
  * XXX: cs < 0 is a CommunicationSettings detection error. Other values are
  * user errors. We may need to distinguish them.
+ *
+ * Detection errors are recorded in the tag by the failing command.
  */
-#define ASSERT_CS(cs) \
+#define ASSERT_CS(tag, cs) \
     do { \
 	if (cs < 0) { \
 	    return errno = EINVAL, -1; \
 	} else if (cs == 0x02) { \
-	    return errno = EINVAL, -1; \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	} else if (cs > 0x03) { \
-	    return errno = EINVAL, -1; \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	} \
     } while (0)
 
-#define ASSERT_NOT_NULL(argument) \
+#define ASSERT_NOT_NULL(tag, argument) \
     do { \
 	if (!argument) { \
-	    return errno = EINVAL, -1; \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	} \
     } while (0)
 
@@ -138,6 +154,19 @@ static ssize_t	 read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off
 #define MAX_CAPDU_SIZE 55
 #define MAX_RAPDU_SIZE 60
 
+/*
+ * Tags advertising a larger frame size in their ATS (FSCI) accept larger
+ * commands, up to what the transport supports.  Responses are only bound by
+ * the transport.
+ *
+ * MAX_FRAME_SIZE is the largest frame size defined by ISO14443-4 (FSCI 8),
+ * and FRAME_OVERHEAD accounts for the PCB, CID and CRC bytes of I-blocks.
+ */
+#define MAX_FRAME_SIZE 256
+#define FRAME_OVERHEAD 4
+
+static const size_t fsc_table[] = { 16, 24, 32, 40, 48, 64, 96, 128, 256 };
+
 /*
  * Transmit the message msg to the NFC tag and receive the response res.  The
  * response buffer's size is set according to the quantity of data received.
@@ -148,16 +177,14 @@ static ssize_t	 read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off
 static int
 desfire_transceive(FreefareTag tag, const uint8_t *msg, size_t msg_len, uint8_t *res, size_t res_size, size_t *res_len)
 {
-    uint8_t msg_buf[MAX_CAPDU_SIZE + 5];
-    uint8_t res_buf[MAX_RAPDU_SIZE + 1];
+    uint8_t msg_buf[MAX_FRAME_SIZE];
+    uint8_t res_buf[MAX_FRAME_SIZE + 1];
 
     size_t len = 5;
     int rc;
 
-    if (!msg) {
-	errno = EINVAL;
-	return -1;
-    }
+    if (!msg || msg_len + 5 > sizeof(msg_buf))
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
 
     memset (msg_buf, 0, sizeof(msg_buf));
     msg_buf[0] = 0x90; // CLA
@@ -175,18 +202,14 @@ desfire_transceive(FreefareTag tag, const uint8_t *msg, size_t msg_len, uint8_t
 
     DEBUG_XFER (msg_buf, len, "===> ");
 
-    if ((rc = nfc_initiator_transceive_bytes (tag->device, msg_buf, len, res_buf, sizeof(res_buf), tag->timeout)) < 2) {
-	errno = (errno == ETIMEDOUT) ? errno : EIO;
-	return -1;
-    }
+    if ((rc = freefare_transceive_bytes (tag, msg_buf, len, res_buf, sizeof(res_buf), tag->timeout)) < 2)
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, (errno == ETIMEDOUT) ? errno : EIO);
 
     DEBUG_XFER (res_buf, rc, "<=== ");
 
     rc--;
-    if (rc > (int)res_size) {
-	errno = ENOBUFS;
-	return -1;
-    }
+    if (rc > (int)res_size)
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, ENOBUFS);
 
     int lpe = res_buf[rc];
 
@@ -194,11 +217,8 @@ desfire_transceive(FreefareTag tag, const uint8_t *msg, size_t msg_len, uint8_t
 
     if ((1 == rc) && (ADDITIONAL_FRAME != res_buf[rc]) && (OPERATION_OK != res_buf[rc])) {
 
-	if (AUTHENTICATION_ERROR == lpe)
-	    errno = EACCES;
-
 	MIFARE_DESFIRE (tag)->last_picc_error = lpe;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_PICC, (AUTHENTICATION_ERROR == lpe) ? EACCES : EIO);
     }
 
     if (res_len)
@@ -234,6 +254,16 @@ desfire_transceive(FreefareTag tag, const uint8_t *msg, size_t msg_len, uint8_t
 
 static int32_t	 le24toh(uint8_t data[3]);
 
+static int
+madame_soleil_read_communication_settings(FreefareTag tag, const struct mifare_desfire_file_settings *settings)
+{
+    if ((MIFARE_DESFIRE(tag)->authenticated_key_no == MDAR_READ(settings->access_rights)) ||
+	(MIFARE_DESFIRE(tag)->authenticated_key_no == MDAR_READ_WRITE(settings->access_rights)))
+	return settings->communication_settings;
+    else
+	return 0;
+}
+
 static int
 madame_soleil_get_read_communication_settings(FreefareTag tag, uint8_t file_no)
 {
@@ -241,11 +271,7 @@ madame_soleil_get_read_communication_settings(FreefareTag tag, uint8_t file_no)
     if (mifare_desfire_get_file_settings(tag, file_no, &settings))
 	return -1;
 
-    if ((MIFARE_DESFIRE(tag)->authenticated_key_no == MDAR_READ(settings.access_rights)) ||
-	(MIFARE_DESFIRE(tag)->authenticated_key_no == MDAR_READ_WRITE(settings.access_rights)))
-	return settings.communication_settings;
-    else
-	return 0;
+    return madame_soleil_read_communication_settings(tag, &settings);
 }
 
 static int
@@ -268,6 +294,32 @@ le24toh(uint8_t data[3])
     return (data[2] << 16) | (data[1] << 8) | data[0];
 }
 
+/*
+ * Compute the largest native command and response sizes from the FSCI
+ * advertised by the tag and the capabilities of the transport.  Frames are
+ * never smaller than the ones defined by the MIFARE DESFire specification.
+ */
+static void
+negotiate_frame_sizes(FreefareTag tag)
+{
+    size_t fsc = fsc_table[2];
+    size_t transport_size = tag->transport->max_frame_size;
+
+    if (tag->info.nti.nai.szAtsLen > 0)
+	fsc = fsc_table[MIN(tag->info.nti.nai.abtAts[0] & 0x0F, 8)];
+
+    if (!transport_size || transport_size > MAX_FRAME_SIZE)
+	transport_size = MAX_FRAME_SIZE;
+    if (transport_size < fsc_table[0])
+	transport_size = fsc_table[0];
+
+    size_t capdu_size = MIN(fsc - FRAME_OVERHEAD, transport_size) - 5;
+    size_t rapdu_size = transport_size - 1;
+
+    MIFARE_DESFIRE(tag)->max_capdu_size = MAX(capdu_size, MAX_CAPDU_SIZE);
+    MIFARE_DESFIRE(tag)->max_rapdu_size = MAX(rapdu_size, MAX_RAPDU_SIZE);
+}
+
 bool
 mifare_desfire_taste(nfc_device *device, nfc_target target)
 {
@@ -303,11 +355,24 @@ mifare_desfire_tag_new(nfc_device *device, nfc_target target)
 	MIFARE_DESFIRE(tag)->last_picc_error = OPERATION_OK;
 	MIFARE_DESFIRE(tag)->last_pcd_error = OPERATION_OK;
 	MIFARE_DESFIRE(tag)->session_key = NULL;
+	MIFARE_DESFIRE(tag)->cbc_encypher = NULL;
+	MIFARE_DESFIRE(tag)->cbc_decypher = NULL;
+	MIFARE_DESFIRE(tag)->cbc_cipher = NULL;
 	MIFARE_DESFIRE(tag)->crypto_buffer = NULL;
 	MIFARE_DESFIRE(tag)->crypto_buffer_size = 0;
+	MIFARE_DESFIRE(tag)->selected_application = 0;
+	MIFARE_DESFIRE(tag)->file_settings_cache = NULL;
+	MIFARE_DESFIRE(tag)->max_capdu_size = MAX_CAPDU_SIZE;
+	MIFARE_DESFIRE(tag)->max_rapdu_size = MAX_RAPDU_SIZE;
 	tag->type = MIFARE_DESFIRE;
 	tag->free_tag = mifare_desfire_tag_free;
 	tag->device = device;
+	tag->transport = &freefare_nfc_transport;
+	tag->transport_data = device;
+	tag->stats = NULL;
+	tag->timeout_model = NULL;
+	tag->trace = NULL;
+	freefare_reset_tag_error(tag);
 	tag->info = target;
 	tag->active = 0;
     }
@@ -320,11 +385,106 @@ mifare_desfire_tag_new(nfc_device *device, nfc_target target)
 void
 mifare_desfire_tag_free(FreefareTag tag)
 {
-    free(MIFARE_DESFIRE(tag)->session_key);
+    clear_session_key(tag);
+    EVP_CIPHER_CTX_free(MIFARE_DESFIRE(tag)->cbc_encypher);
+    EVP_CIPHER_CTX_free(MIFARE_DESFIRE(tag)->cbc_decypher);
     free(MIFARE_DESFIRE(tag)->crypto_buffer);
+    free_file_settings_cache(tag);
     free(tag);
 }
 
+/*
+ * The session key is stored in the tag and reused from one authentication to
+ * the next.  Forget it, wiping the key material.
+ */
+static void
+clear_session_key(FreefareTag tag)
+{
+    MIFARE_DESFIRE(tag)->session_key = NULL;
+    memset(&MIFARE_DESFIRE(tag)->session_key_storage, 0, sizeof(MIFARE_DESFIRE(tag)->session_key_storage));
+}
+
+/*
+ * File settings cache management.
+ */
+
+static struct mifare_desfire_file_settings_cache *
+file_settings_cache(FreefareTag tag, uint32_t aid, bool create)
+{
+    struct mifare_desfire_file_settings_cache *cache;
+
+    for (cache = MIFARE_DESFIRE(tag)->file_settings_cache; cache; cache = cache->next) {
+	if (cache->aid == aid)
+	    return cache;
+    }
+
+    if (create && (cache = malloc(sizeof(*cache)))) {
+	cache->aid = aid;
+	cache->current = 0;
+	cache->next = MIFARE_DESFIRE(tag)->file_settings_cache;
+	MIFARE_DESFIRE(tag)->file_settings_cache = cache;
+    }
+
+    return cache;
+}
+
+static void
+invalidate_file_settings(FreefareTag tag, uint8_t file_no)
+{
+    struct mifare_desfire_file_settings_cache *cache;
+
+    if (file_no < MAX_FILE_COUNT && (cache = file_settings_cache(tag, MIFARE_DESFIRE(tag)->selected_application, false)))
+	cache->current &= ~(1U << file_no);
+}
+
+/*
+ * Data manipulation commands leave the file settings untouched until the
+ * transaction is committed, which changes the limited credit value of value
+ * files and the number of records of record files.  Aborting it is handled
+ * the same way to stay on the safe side.
+ */
+static void
+invalidate_transaction_file_settings(FreefareTag tag)
+{
+    struct mifare_desfire_file_settings_cache *cache;
+
+    if (!(cache = file_settings_cache(tag, MIFARE_DESFIRE(tag)->selected_application, false)))
+	return;
+
+    for (int n = 0; n < MAX_FILE_COUNT; n++) {
+	if (!(cache->current & (1U << n)))
+	    continue;
+
+	switch (cache->settings[n].file_type) {
+	case MDFT_VALUE_FILE_WITH_BACKUP:
+	case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+	case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+	    cache->current &= ~(1U << n);
+	    break;
+	}
+    }
+}
+
+static void
+invalidate_application_file_settings(FreefareTag tag, uint32_t aid)
+{
+    struct mifare_desfire_file_settings_cache *cache;
+
+    if ((cache = file_settings_cache(tag, aid, false)))
+	cache->current = 0;
+}
+
+static void
+free_file_settings_cache(FreefareTag tag)
+{
+    struct mifare_desfire_file_settings_cache *cache;
+
+    while ((cache = MIFARE_DESFIRE(tag)->file_settings_cache)) {
+	MIFARE_DESFIRE(tag)->file_settings_cache = cache->next;
+	free(cache);
+    }
+}
+
 /*
  * MIFARE card communication preparation functions
  *
@@ -341,12 +501,11 @@ mifare_desfire_connect(FreefareTag tag)
 {
     ASSERT_INACTIVE(tag);
 
-    nfc_target pnti;
     nfc_modulation modulation = {
 	.nmt = NMT_ISO14443A,
 	.nbr = NBR_424
     };
-    if (nfc_initiator_select_passive_target(tag->device, modulation, tag->info.nti.nai.abtUid, tag->info.nti.nai.szUidLen, &pnti) >= 0) {
+    if (freefare_select_target(tag, modulation) >= 0) {
 	// The registered ISO AID of DESFire D2760000850100
 	// Selecting this AID selects the MF
 	BUFFER_INIT(cmd, 12);
@@ -358,20 +517,19 @@ mifare_desfire_connect(FreefareTag tag)
 	uint8_t AID[] = { 0xd2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x00};
 	BUFFER_APPEND(cmd, sizeof(AID));
 	BUFFER_APPEND_BYTES(cmd, AID, sizeof(AID));
-	if ((nfc_initiator_transceive_bytes(tag->device, cmd, BUFFER_SIZE(cmd), res, BUFFER_MAXSIZE(cmd), tag->timeout) < 0) || (res[0] != 0x90 || res[1] != 0x00)) {
-	    errno = (errno == ETIMEDOUT) ? errno : EIO;
-	    return -1;
+	if ((freefare_transceive_bytes(tag, cmd, BUFFER_SIZE(cmd), res, BUFFER_MAXSIZE(res), tag->timeout) < 0) || (res[0] != 0x90 || res[1] != 0x00)) {
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, (errno == ETIMEDOUT) ? errno : EIO);
 	}
 	tag->active = 1;
-	free(MIFARE_DESFIRE(tag)->session_key);
-	MIFARE_DESFIRE(tag)->session_key = NULL;
+	clear_session_key(tag);
 	MIFARE_DESFIRE(tag)->last_picc_error = OPERATION_OK;
 	MIFARE_DESFIRE(tag)->last_pcd_error = OPERATION_OK;
 	MIFARE_DESFIRE(tag)->authenticated_key_no = NOT_YET_AUTHENTICATED;
 	MIFARE_DESFIRE(tag)->selected_application = 0;
+	free_file_settings_cache(tag);
+	negotiate_frame_sizes(tag);
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EIO);
     }
     return 0;
 }
@@ -384,10 +542,9 @@ mifare_desfire_disconnect(FreefareTag tag)
 {
     ASSERT_ACTIVE(tag);
 
-    free(MIFARE_DESFIRE(tag)->session_key);
-    MIFARE_DESFIRE(tag)->session_key = NULL;
+    clear_session_key(tag);
 
-    if (nfc_initiator_deselect_target(tag->device) >= 0) {
+    if (freefare_deselect_target(tag) >= 0) {
 	tag->active = 0;
     }
     return 0;
@@ -408,8 +565,7 @@ authenticate(FreefareTag tag, uint8_t cmd, uint8_t key_no, MifareDESFireKey key)
     memset(MIFARE_DESFIRE(tag)->ivect, 0, MAX_CRYPTO_BLOCK_SIZE);
 
     MIFARE_DESFIRE(tag)->authenticated_key_no = NOT_YET_AUTHENTICATED;
-    free(MIFARE_DESFIRE(tag)->session_key);
-    MIFARE_DESFIRE(tag)->session_key = NULL;
+    clear_session_key(tag);
 
     MIFARE_DESFIRE(tag)->authentication_scheme = (AUTHENTICATE_LEGACY == cmd) ? AS_LEGACY : AS_NEW;
 
@@ -429,10 +585,12 @@ authenticate(FreefareTag tag, uint8_t cmd, uint8_t key_no, MifareDESFireKey key)
 
     uint8_t PICC_RndB[16];
     memcpy(PICC_RndB, PICC_E_RndB, key_length);
-    mifare_cypher_blocks_chained(tag, key, MIFARE_DESFIRE(tag)->ivect, PICC_RndB, key_length, MCD_RECEIVE, MCO_DECYPHER);
+    if (mifare_cypher_blocks_chained(tag, key, MIFARE_DESFIRE(tag)->ivect, PICC_RndB, key_length, MCD_RECEIVE, MCO_DECYPHER) < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EIO);
 
     uint8_t PCD_RndA[16];
-    RAND_bytes(PCD_RndA, 16);
+    if (1 != freefare_random_bytes(tag, PCD_RndA, 16))
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EIO);
 
     uint8_t PCD_r_RndB[16];
     memcpy(PCD_r_RndB, PICC_RndB, key_length);
@@ -442,7 +600,8 @@ authenticate(FreefareTag tag, uint8_t cmd, uint8_t key_no, MifareDESFireKey key)
     memcpy(token, PCD_RndA, key_length);
     memcpy(token + key_length, PCD_r_RndB, key_length);
 
-    mifare_cypher_blocks_chained(tag, key, MIFARE_DESFIRE(tag)->ivect, token, 2 * key_length, MCD_SEND, (AUTHENTICATE_LEGACY == cmd) ? MCO_DECYPHER : MCO_ENCYPHER);
+    if (mifare_cypher_blocks_chained(tag, key, MIFARE_DESFIRE(tag)->ivect, token, 2 * key_length, MCD_SEND, (AUTHENTICATE_LEGACY == cmd) ? MCO_DECYPHER : MCO_ENCYPHER) < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EIO);
 
     BUFFER_INIT(cmd2, 33);
 
@@ -457,7 +616,8 @@ authenticate(FreefareTag tag, uint8_t cmd, uint8_t key_no, MifareDESFireKey key)
 
     uint8_t PICC_RndA_s[16];
     memcpy(PICC_RndA_s, PICC_E_RndA_s, key_length);
-    mifare_cypher_blocks_chained(tag, key, MIFARE_DESFIRE(tag)->ivect, PICC_RndA_s, key_length, MCD_RECEIVE, MCO_DECYPHER);
+    if (mifare_cypher_blocks_chained(tag, key, MIFARE_DESFIRE(tag)->ivect, PICC_RndA_s, key_length, MCD_RECEIVE, MCO_DECYPHER) < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EIO);
 
     uint8_t PCD_RndA_s[key_length];
     memcpy(PCD_RndA_s, PCD_RndA, key_length);
@@ -469,22 +629,15 @@ authenticate(FreefareTag tag, uint8_t cmd, uint8_t key_no, MifareDESFireKey key)
 	hexdump(PCD_RndA_s, key_length, "PCD  ", 0);
 	hexdump(PICC_RndA_s, key_length, "PICC ", 0);
 #endif
-	errno = EACCES;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EACCES);
     }
 
     MIFARE_DESFIRE(tag)->authenticated_key_no = key_no;
-    MIFARE_DESFIRE(tag)->session_key = mifare_desfire_session_key_new(PCD_RndA, PICC_RndB, key);
+    mifare_desfire_session_key_init(&MIFARE_DESFIRE(tag)->session_key_storage, PCD_RndA, PICC_RndB, key);
+    MIFARE_DESFIRE(tag)->session_key = &MIFARE_DESFIRE(tag)->session_key_storage;
+    mifare_cypher_rekey(tag);
     memset(MIFARE_DESFIRE(tag)->ivect, 0, MAX_CRYPTO_BLOCK_SIZE);
 
-    switch (MIFARE_DESFIRE(tag)->authentication_scheme) {
-    case AS_LEGACY:
-	break;
-    case AS_NEW:
-	cmac_generate_subkeys(MIFARE_DESFIRE(tag)->session_key);
-	break;
-    }
-
     return 0;
 }
 
@@ -542,7 +695,7 @@ mifare_desfire_change_key_settings(FreefareTag tag, uint8_t settings)
     p = mifare_cryto_postprocess_data(tag, res, &n, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY | MAC_COMMAND | MAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -568,7 +721,7 @@ mifare_desfire_get_key_settings(FreefareTag tag, uint8_t *settings, uint8_t *max
     p = mifare_cryto_postprocess_data(tag, res, &n, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     if (settings)
 	*settings = p[0];
@@ -677,15 +830,14 @@ mifare_desfire_change_key(FreefareTag tag, uint8_t key_no, MifareDESFireKey new_
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     /*
      * If we changed the current authenticated key, we are not authenticated
      * anymore.
      */
     if (key_no == MIFARE_DESFIRE(tag)->authenticated_key_no) {
-	free(MIFARE_DESFIRE(tag)->session_key);
-	MIFARE_DESFIRE(tag)->session_key = NULL;
+	clear_session_key(tag);
     }
 
     return 0;
@@ -701,7 +853,7 @@ mifare_desfire_get_key_version(FreefareTag tag, uint8_t key_no, uint8_t *version
 
     ASSERT_ACTIVE(tag);
 
-    ASSERT_NOT_NULL(version);
+    ASSERT_NOT_NULL(tag, version);
 
     BUFFER_INIT(cmd, 2);
     BUFFER_APPEND(cmd, 0x64);
@@ -718,7 +870,7 @@ mifare_desfire_get_key_version(FreefareTag tag, uint8_t key_no, uint8_t *version
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY | MAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     *version = p[0];
 
@@ -759,7 +911,7 @@ create_application(FreefareTag tag, MifareDESFireAID aid, uint8_t settings1, uin
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY | MAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -822,15 +974,16 @@ mifare_desfire_delete_application(FreefareTag tag, MifareDESFireAID aid)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+
+    invalidate_application_file_settings(tag, aid->data[0] | aid->data[1] << 8 | aid->data[2] << 16);
 
     /*
      * If we have deleted the current application, we are not authenticated
      * anymore.
      */
     if (MIFARE_DESFIRE(tag)->selected_application == (uint32_t)(aid->data[0] | aid->data[1] << 8 | aid->data[2] << 16)) {
-	free(MIFARE_DESFIRE(tag)->session_key);
-	MIFARE_DESFIRE(tag)->session_key = NULL;
+	clear_session_key(tag);
 	MIFARE_DESFIRE(tag)->selected_application = 0x000000;
     }
 
@@ -845,41 +998,41 @@ mifare_desfire_get_application_ids(FreefareTag tag, MifareDESFireAID *aids[], si
     ASSERT_ACTIVE(tag);
 
     BUFFER_INIT(cmd, 1);
-    BUFFER_INIT(res, MAX_RAPDU_SIZE);
+    BUFFER_INIT(res, MIFARE_DESFIRE(tag)->max_rapdu_size);
 
     BUFFER_APPEND(cmd, 0x6A);
 
     uint8_t buffer[3 * MAX_APPLICATION_COUNT + CMAC_LENGTH + 1];
+    size_t buffer_n = 0;
     *count = 0;
 
     uint8_t *p = mifare_cryto_preprocess_data(tag, cmd, &__cmd_n, 0, MDCM_PLAIN | CMAC_COMMAND);
 
-    if ((rc = MIFARE_DESFIRE_TRANSCEIVE(tag, p, __cmd_n, res, __res_size, &__res_n)) < 0)
-	return rc;
-
-    // FIXME This code needs refactoring!
-    memcpy(buffer, res, __res_n);
-
-    if (res[__res_n - 1] == 0xAF) {
-	off_t offset = __res_n - 1;
-	p[0] = 0xAF;
+    do {
 	if ((rc = MIFARE_DESFIRE_TRANSCEIVE(tag, p, __cmd_n, res, __res_size, &__res_n)) < 0)
 	    return rc;
 
-	memcpy((uint8_t *)buffer + offset, res, __res_n);
-	__res_n += offset;
-    }
+	// Keep the status byte of the last frame only
+	if (buffer_n + __res_n > sizeof(buffer))
+	    return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, ENOBUFS);
+	memcpy(buffer + buffer_n, res, __res_n);
+	buffer_n += __res_n - 1;
+
+	p[0] = 0xAF;
+	__cmd_n = 1;
+    } while (res[__res_n - 1] == 0xAF);
+    __res_n = buffer_n + 1;
 
     ssize_t sn = __res_n;
     p = mifare_cryto_postprocess_data(tag, buffer, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY | MAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     *count = (sn - 1) / 3;
 
     if (!(*aids = malloc((*count + 1) * sizeof(MifareDESFireAID))))
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
 
     for (size_t i = 0; i < *count; i++) {
 	if (!((*aids)[i] = memdup(p + 3 * i, 3))) {
@@ -887,7 +1040,7 @@ mifare_desfire_get_application_ids(FreefareTag tag, MifareDESFireAID *aids[], si
 		free((*aids)[i]);
 	    }
 	    free(aids);
-	    return -1;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
 	}
     }
     (*aids)[*count] = NULL;
@@ -974,13 +1127,9 @@ mifare_desfire_select_application(FreefareTag tag, MifareDESFireAID aid)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
-    for (int n = 0; n < MAX_FILE_COUNT; n++)
-	cached_file_settings_current[n] = false;
-
-    free(MIFARE_DESFIRE(tag)->session_key);
-    MIFARE_DESFIRE(tag)->session_key = NULL;
+    clear_session_key(tag);
 
     MIFARE_DESFIRE(tag)->selected_application = aid->data[0] | aid->data[1] << 8 | aid->data[2] << 16;
 
@@ -1009,11 +1158,11 @@ mifare_desfire_format_picc(FreefareTag tag)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
-    free(MIFARE_DESFIRE(tag)->session_key);
-    MIFARE_DESFIRE(tag)->session_key = NULL;
+    clear_session_key(tag);
     MIFARE_DESFIRE(tag)->selected_application = 0x000000;
+    free_file_settings_cache(tag);
 
     return 0;
 }
@@ -1028,7 +1177,7 @@ mifare_desfire_get_version(FreefareTag tag, struct mifare_desfire_version_info *
 
     ASSERT_ACTIVE(tag);
 
-    ASSERT_NOT_NULL(version_info);
+    ASSERT_NOT_NULL(tag, version_info);
 
     BUFFER_INIT(cmd, 1);
     BUFFER_INIT(res, 15 + CMAC_LENGTH);  /* 8, 8, then 15 byte results */
@@ -1058,7 +1207,7 @@ mifare_desfire_get_version(FreefareTag tag, struct mifare_desfire_version_info *
     p = mifare_cryto_postprocess_data(tag, buffer, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -1070,7 +1219,7 @@ mifare_desfire_free_mem(FreefareTag tag, uint32_t *size)
 
     ASSERT_ACTIVE(tag);
 
-    ASSERT_NOT_NULL(size);
+    ASSERT_NOT_NULL(tag, size);
 
     BUFFER_INIT(cmd, 1);
     BUFFER_INIT(res, 4 + CMAC_LENGTH);
@@ -1086,7 +1235,7 @@ mifare_desfire_free_mem(FreefareTag tag, uint32_t *size)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     *size = p[0] | (p[1] << 8) | (p[2] << 16);
 
@@ -1116,7 +1265,7 @@ mifare_desfire_set_configuration(FreefareTag tag, bool disable_format, bool enab
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -1158,7 +1307,7 @@ mifare_desfire_set_default_key(FreefareTag tag, MifareDESFireKey key)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -1197,7 +1346,7 @@ mifare_desfire_set_ats(FreefareTag tag, uint8_t *ats)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -1209,7 +1358,7 @@ mifare_desfire_get_card_uid_raw(FreefareTag tag, uint8_t uid[])
 
     ASSERT_ACTIVE(tag);
 
-    ASSERT_NOT_NULL(uid);
+    ASSERT_NOT_NULL(tag, uid);
 
     BUFFER_INIT(cmd, 1);
     BUFFER_INIT(res, 17 + CMAC_LENGTH);
@@ -1225,7 +1374,7 @@ mifare_desfire_get_card_uid_raw(FreefareTag tag, uint8_t uid[])
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_ENCIPHERED);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     memcpy(uid, p, 7);
 
@@ -1242,7 +1391,7 @@ mifare_desfire_get_card_uid(FreefareTag tag, char **uid)
     }
 
     if (!(*uid = malloc(2 * 7 + 1))) {
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
     }
 
     sprintf(*uid, "%02x%02x%02x%02x%02x%02x%02x",
@@ -1277,14 +1426,12 @@ mifare_desfire_get_file_ids(FreefareTag tag, uint8_t **files, size_t *count)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     *count = sn - 1;
 
-    if (!(*files = malloc(*count))) {
-	errno = ENOMEM;
-	return -1;
-    }
+    if (!(*files = malloc(*count)))
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
     memcpy(*files, res, *count);
 
     return 0;
@@ -1304,7 +1451,7 @@ mifare_desfire_get_iso_file_ids(FreefareTag tag, uint16_t **files, size_t *count
 
     uint8_t *data;
     if (!(data = malloc((27 + 5) * 2 + 8)))
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
 
     off_t offset = 0;
 
@@ -1325,14 +1472,14 @@ mifare_desfire_get_iso_file_ids(FreefareTag tag, uint16_t **files, size_t *count
 
     if (!p) {
 	free(data);
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
     }
 
     *count = sn / 2;
     *files = malloc(sizeof(**files) * *count);
     if (!*files) {
 	free(data);
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
     }
 
     for (size_t i = 0; i < *count; i++) {
@@ -1351,8 +1498,12 @@ mifare_desfire_get_file_settings(FreefareTag tag, uint8_t file_no, struct mifare
 
     ASSERT_ACTIVE(tag);
 
-    if (cached_file_settings_current[file_no]) {
-	*settings = cached_file_settings[file_no];
+    struct mifare_desfire_file_settings_cache *cache = NULL;
+    if (file_no < MAX_FILE_COUNT)
+	cache = file_settings_cache(tag, MIFARE_DESFIRE(tag)->selected_application, true);
+
+    if (cache && (cache->current & (1U << file_no))) {
+	*settings = cache->settings[file_no];
 	return 0;
     }
 
@@ -1371,7 +1522,7 @@ mifare_desfire_get_file_settings(FreefareTag tag, uint8_t file_no, struct mifare
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     struct mifare_desfire_raw_file_settings raw_settings;
     memcpy(&raw_settings, p, sn - 1);
@@ -1399,8 +1550,10 @@ mifare_desfire_get_file_settings(FreefareTag tag, uint8_t file_no, struct mifare
 	break;
     }
 
-    cached_file_settings[file_no] = *settings;
-    cached_file_settings_current[file_no] = true;
+    if (cache) {
+	cache->settings[file_no] = *settings;
+	cache->current |= 1U << file_no;
+    }
 
     return 0;
 }
@@ -1417,7 +1570,7 @@ mifare_desfire_change_file_settings(FreefareTag tag, uint8_t file_no, uint8_t co
     if (res < 0)
 	return res;
 
-    cached_file_settings_current[file_no] = false;
+    invalidate_file_settings(tag, file_no);
 
     if (MDAR_CHANGE_AR(settings.access_rights) == MDAR_FREE) {
 	BUFFER_INIT(cmd, 5 + CMAC_LENGTH);
@@ -1437,7 +1590,7 @@ mifare_desfire_change_file_settings(FreefareTag tag, uint8_t file_no, uint8_t co
 	p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
 	if (!p)
-	    return errno = EINVAL, -1;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
     } else {
 	BUFFER_INIT(cmd, 10);
 	BUFFER_INIT(res, 1 + CMAC_LENGTH);
@@ -1456,7 +1609,7 @@ mifare_desfire_change_file_settings(FreefareTag tag, uint8_t file_no, uint8_t co
 	p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
 	if (!p)
-	    return errno = EINVAL, -1;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
     }
 
     return 0;
@@ -1489,9 +1642,9 @@ create_file1(FreefareTag tag, uint8_t command, uint8_t file_no, int has_iso_file
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
-    cached_file_settings_current[file_no] = false;
+    invalidate_file_settings(tag, file_no);
 
     return 0;
 }
@@ -1548,9 +1701,9 @@ mifare_desfire_create_value_file(FreefareTag tag, uint8_t file_no, uint8_t commu
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
-    cached_file_settings_current[file_no] = false;
+    invalidate_file_settings(tag, file_no);
 
     return 0;
 }
@@ -1583,9 +1736,9 @@ create_file2(FreefareTag tag, uint8_t command, uint8_t file_no, int has_iso_file
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
-    cached_file_settings_current[file_no] = false;
+    invalidate_file_settings(tag, file_no);
 
     return 0;
 }
@@ -1636,7 +1789,9 @@ mifare_desfire_delete_file(FreefareTag tag, uint8_t file_no)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+
+    invalidate_file_settings(tag, file_no);
 
     return 0;
 }
@@ -1645,18 +1800,42 @@ mifare_desfire_delete_file(FreefareTag tag, uint8_t file_no)
  * Data manipulation commands.
  */
 
+/*
+ * Size of the buffer required to receive nbytes of data, including the MAC /
+ * CRC and padding that may follow it and the trailing status byte.
+ */
+static size_t
+read_buffer_length(FreefareTag tag, size_t nbytes)
+{
+    return MAX(enciphered_data_length(tag, nbytes, 0), nbytes + CMAC_LENGTH) + 1;
+}
+
+size_t
+mifare_desfire_read_buffer_size(FreefareTag tag, size_t nbytes)
+{
+    return read_buffer_length(tag, nbytes);
+}
+
+/*
+ * Read data from a file.  The file settings are retrieved from the tag
+ * unless the caller already did so.
+ *
+ * When data_size is large enough to hold the raw response, frames are
+ * received straight into data and post-processed in place.  Otherwise the
+ * tag's crypto buffer is used as scratch space and the plain text is copied
+ * to data.
+ */
 static ssize_t
-read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, void *data, int cs)
+read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, void *data, size_t data_size, int cs, const struct mifare_desfire_file_settings *settings)
 {
     int rc;
 
     size_t bytes_received = 0;
 
     ASSERT_ACTIVE(tag);
-    ASSERT_CS(cs);
+    ASSERT_CS(tag, cs);
 
     BUFFER_INIT(cmd, 8);
-    BUFFER_INIT(res, MAX_RAPDU_SIZE);
 
     BUFFER_APPEND(cmd, command);
     BUFFER_APPEND(cmd, file_no);
@@ -1670,12 +1849,15 @@ read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_
      */
     int record_size = 1;
 
-    struct mifare_desfire_file_settings settings;
-    int r = mifare_desfire_get_file_settings(tag, file_no, &settings);
-    if (r < 0)
-	return r;
+    struct mifare_desfire_file_settings file_settings;
+    if (!settings) {
+	int r = mifare_desfire_get_file_settings(tag, file_no, &file_settings);
+	if (r < 0)
+	    return r;
+	settings = &file_settings;
+    }
 
-    switch (settings.file_type) {
+    switch (settings->file_type) {
     case MDFT_STANDARD_DATA_FILE:
     case MDFT_BACKUP_DATA_FILE:
     case MDFT_VALUE_FILE_WITH_BACKUP:
@@ -1685,21 +1867,21 @@ read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_
     case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
 	// length indicates a number of records, we need the record size to
 	// allocate enougth memory.
-	record_size = settings.settings.linear_record_file.record_size;
+	record_size = settings->settings.linear_record_file.record_size;
 	break;
     }
     if (!length) {
-	switch (settings.file_type) {
+	switch (settings->file_type) {
 	case MDFT_STANDARD_DATA_FILE:
 	case MDFT_BACKUP_DATA_FILE:
-	    length = settings.settings.standard_file.file_size;
+	    length = settings->settings.standard_file.file_size;
 	    break;
 	case MDFT_VALUE_FILE_WITH_BACKUP:
 	    abort();
 	    break;
 	case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
 	case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
-	    length = settings.settings.linear_record_file.current_number_of_records;
+	    length = settings->settings.linear_record_file.current_number_of_records;
 	    break;
 	}
     }
@@ -1723,117 +1905,228 @@ read_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_
      * can be a problem if the destination buffer is long enouth for the data
      * but the MAC / padding overflows.
      *
-     * Create a temporary read buffer to collect all read data, post-process it
-     * through the cryptography code and copy the actual data to the
-     * destination buffer.
+     * Unless the destination buffer has room for it, collect all read data
+     * in the crypto buffer, post-process it through the cryptography code
+     * and copy the actual data to the destination buffer.
+     */
+    size_t read_buffer_size = read_buffer_length(tag, length * record_size);
+    uint8_t *read_buffer = data;
+
+    if (data_size < read_buffer_size) {
+	if (!(read_buffer = assert_crypto_buffer_size(tag, read_buffer_size)))
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, ENOMEM);
+    }
+
+    /*
+     * With AS_NEW, the CMAC of non-enciphered data is computed frame by frame
+     * as the data is received, holding back the bytes that might be part of
+     * the trailing CMAC.
      */
-    uint8_t *read_buffer = malloc(enciphered_data_length(tag, length * record_size, 0) + 1);
+    struct mifare_cmac_ctx mac;
+    size_t maced = 0;
+    bool cmac_frames = MIFARE_DESFIRE(tag)->session_key &&
+		       (AS_NEW == MIFARE_DESFIRE(tag)->authentication_scheme) &&
+		       (MDCM_ENCIPHERED != (cs & MDCM_MASK));
+
+    if (cmac_frames)
+	cmac_init(&mac, MIFARE_DESFIRE(tag)->session_key, MIFARE_DESFIRE(tag)->ivect);
 
     do {
-	if ((rc = MIFARE_DESFIRE_TRANSCEIVE(tag, p, __cmd_n, res, __res_size, &__res_n)) < 0) {
-	    free(read_buffer);
+	size_t frame_bytes;
+
+	/*
+	 * Each frame overwrites the status byte of the previous one.
+	 */
+	if ((rc = MIFARE_DESFIRE_TRANSCEIVE(tag, p, __cmd_n, read_buffer + bytes_received, read_buffer_size - bytes_received, &frame_bytes)) < 0)
 	    return rc;
-	}
 
-	size_t frame_bytes = BUFFER_SIZE(res) - 1;
-	memcpy(read_buffer + bytes_received, res, frame_bytes);
-	bytes_received += frame_bytes;
+	bytes_received += frame_bytes - 1;
+
+	if (cmac_frames && (bytes_received > maced + CMAC_LENGTH)) {
+	    cmac_update(&mac, read_buffer + maced, bytes_received - CMAC_LENGTH - maced);
+	    maced = bytes_received - CMAC_LENGTH;
+	}
 
 	p[0] = 0xAF;
 	__cmd_n = 1;
-    } while (0xAF == res[__res_n - 1]);
+    } while (0xAF == read_buffer[bytes_received]);
 
     read_buffer[bytes_received++] = 0x00;
 
+    if (cmac_frames && (bytes_received > 1)) {
+	if (bytes_received < 1 + CMAC_LENGTH) {
+	    MIFARE_DESFIRE(tag)->last_pcd_error = CRYPTO_ERROR;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+	}
+
+	cmac_update(&mac, read_buffer + bytes_received - 1, 1);
+	cmac_final(&mac, MIFARE_DESFIRE(tag)->cmac);
+	bytes_received -= CMAC_LENGTH;
+
+	if (0 != memcmp(MIFARE_DESFIRE(tag)->cmac, read_buffer + bytes_received - 1, CMAC_LENGTH)) {
+	    MIFARE_DESFIRE(tag)->last_pcd_error = CRYPTO_ERROR;
+	    return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+	}
+
+	if (read_buffer != data)
+	    memcpy(data, read_buffer, bytes_received - 1);
+
+	return bytes_received - 1;
+    }
+
     ssize_t sr = bytes_received;
     p = mifare_cryto_postprocess_data(tag, read_buffer, &sr, cs | CMAC_COMMAND | CMAC_VERIFY | MAC_VERIFY);
 
-    if (sr > 0)
+    if (!p)
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+
+    if ((sr > 0) && (read_buffer != data))
 	memcpy(data, read_buffer, sr - 1);
 
-    free(read_buffer);
+    return (sr <= 0) ? sr : sr - 1;
+}
 
-    if (!p)
-	return errno = EINVAL, -1;
+/*
+ * Read data from a file and hand it out to callback frame by frame.  Since
+ * DESFire reads the file to end when no length is given, the file settings
+ * are not required.
+ */
+static ssize_t
+read_data_stream(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data, int cs)
+{
+    int rc;
+    struct mifare_cryto_stream stream;
 
-    return (sr <= 0) ? sr : sr - 1;
+    ASSERT_ACTIVE(tag);
+    ASSERT_CS(tag, cs);
+    ASSERT_NOT_NULL(tag, callback);
+
+    BUFFER_INIT(cmd, 8);
+    BUFFER_INIT(res, MIFARE_DESFIRE(tag)->max_rapdu_size);
+
+    BUFFER_APPEND(cmd, command);
+    BUFFER_APPEND(cmd, file_no);
+    BUFFER_APPEND_LE(cmd, offset, 3, sizeof(off_t));
+    BUFFER_APPEND_LE(cmd, length, 3, sizeof(size_t));
+
+    uint8_t *p = mifare_cryto_preprocess_data(tag, cmd, &__cmd_n, 8, MDCM_PLAIN | CMAC_COMMAND);
+
+    if (mifare_cryto_stream_init(&stream, tag, cs | CMAC_COMMAND | CMAC_VERIFY | MAC_VERIFY) < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
+
+    do {
+	if ((rc = MIFARE_DESFIRE_TRANSCEIVE(tag, p, __cmd_n, res, __res_size, &__res_n)) < 0)
+	    return rc;
+
+	if (mifare_cryto_stream_update(&stream, res, __res_n - 1, callback, user_data) < 0)
+	    return -1;
+
+	p[0] = 0xAF;
+	__cmd_n = 1;
+    } while (0xAF == res[__res_n - 1]);
+
+    if (mifare_cryto_stream_final(&stream, callback, user_data) < 0)
+	return -1;
+
+    return stream.delivered;
 }
 
 ssize_t
 mifare_desfire_read_data(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data)
 {
-    return mifare_desfire_read_data_ex(tag, file_no, offset, length, data, madame_soleil_get_read_communication_settings(tag, file_no));
+    struct mifare_desfire_file_settings settings;
+    if (mifare_desfire_get_file_settings(tag, file_no, &settings) < 0)
+	return -1;
+
+    return read_data(tag, 0xBD, file_no, offset, length, data, 0, madame_soleil_read_communication_settings(tag, &settings), &settings);
 }
 
 ssize_t
 mifare_desfire_read_data_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, int cs)
 {
-    return read_data(tag, 0xBD, file_no, offset, length, data, cs);
+    return read_data(tag, 0xBD, file_no, offset, length, data, 0, cs, NULL);
+}
+
+ssize_t
+mifare_desfire_read_data_stream(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data)
+{
+    return mifare_desfire_read_data_stream_ex(tag, file_no, offset, length, callback, user_data, madame_soleil_get_read_communication_settings(tag, file_no));
+}
+
+ssize_t
+mifare_desfire_read_data_stream_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data, int cs)
+{
+    return read_data_stream(tag, 0xBD, file_no, offset, length, callback, user_data, cs);
 }
 
+ssize_t
+mifare_desfire_read_data_in_place(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, size_t data_size)
+{
+    struct mifare_desfire_file_settings settings;
+    if (mifare_desfire_get_file_settings(tag, file_no, &settings) < 0)
+	return -1;
+
+    return read_data(tag, 0xBD, file_no, offset, length, data, data_size, madame_soleil_read_communication_settings(tag, &settings), &settings);
+}
+
+/*
+ * Write data to a file.  The data is enciphered and MACed frame by frame as
+ * it is sent, so that the memory used does not depend on its length.
+ */
 static ssize_t
 write_data(FreefareTag tag, uint8_t command, uint8_t file_no, off_t offset, size_t length, const void *data, int cs)
 {
     int rc;
-
-    size_t bytes_left;
-    size_t bytes_send = 0;
+    struct mifare_cryto_send_stream stream;
 
     ASSERT_ACTIVE(tag);
-    ASSERT_CS(cs);
+    ASSERT_CS(tag, cs);
 
-    BUFFER_INIT(cmd, 8 + length + CMAC_LENGTH);
+    BUFFER_INIT(cmd, 8);
     BUFFER_INIT(res, 1 + CMAC_LENGTH);
 
     BUFFER_APPEND(cmd, command);
     BUFFER_APPEND(cmd, file_no);
     BUFFER_APPEND_LE(cmd, offset, 3, sizeof(off_t));
     BUFFER_APPEND_LE(cmd, length, 3, sizeof(size_t));
-    BUFFER_APPEND_BYTES(cmd, data, length);
 
-    uint8_t *p = mifare_cryto_preprocess_data(tag, cmd, &__cmd_n, 8, cs | MAC_COMMAND | CMAC_COMMAND | ENC_COMMAND);
-    size_t overhead_size = __cmd_n - length; // (CRC | padding) + headers
+    if (mifare_cryto_send_stream_init(&stream, tag, cmd, __cmd_n, data, length, cs | MAC_COMMAND | CMAC_COMMAND | ENC_COMMAND) < 0)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
 
-    BUFFER_INIT(d, MAX_CAPDU_SIZE);
-    bytes_left = __d_size;
+    BUFFER_INIT(d, MIFARE_DESFIRE(tag)->max_capdu_size);
+    size_t bytes_left = stream.length;
 
-    while (bytes_send < __cmd_n) {
-	size_t frame_bytes = MIN(bytes_left, __cmd_n - bytes_send);
-	BUFFER_APPEND_BYTES(d, p + bytes_send, frame_bytes);
+    while (bytes_left) {
+	size_t frame_bytes = mifare_cryto_send_stream_read(&stream, d + __d_n, __d_size - __d_n);
+	if (!frame_bytes)
+	    return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
+	__d_n += frame_bytes;
+	bytes_left -= frame_bytes;
 
 	if ((rc = MIFARE_DESFIRE_TRANSCEIVE(tag, d, __d_n, res, __res_size, &__res_n)) < 0)
 	    return rc;
 
-	bytes_send += frame_bytes;
-
 	if (0x00 == res[__res_n - 1])
 	    break;
 
 	// PICC returned 0xAF and expects more data
 	BUFFER_CLEAR(d);
-	bytes_left = __d_size;
 	BUFFER_APPEND(d, 0xAF);
-	bytes_left--;
     }
 
     ssize_t sn = __res_n;
-    p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
+    uint8_t *p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
-    if (0x00 == p[__res_n - 1]) {
-	// Remove header length
-	bytes_send -= overhead_size;
-    } else {
+    if (0x00 != p[__res_n - 1]) {
 	// 0xAF (additionnal Frame) failure can happen here (wrong crypto method).
 	MIFARE_DESFIRE(tag)->last_picc_error = p[__res_n - 1];
-	bytes_send = -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_PICC, EIO);
     }
 
-    cached_file_settings_current[file_no] = false;
-
-    return bytes_send;
+    return length;
 }
 
 ssize_t
@@ -1859,10 +2152,10 @@ mifare_desfire_get_value_ex(FreefareTag tag, uint8_t file_no, int32_t *value, in
     int rc;
 
     if (!value)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
 
     ASSERT_ACTIVE(tag);
-    ASSERT_CS(cs);
+    ASSERT_CS(tag, cs);
 
     BUFFER_INIT(cmd, 2 + CMAC_LENGTH);
     BUFFER_INIT(res, 9 + CMAC_LENGTH);
@@ -1879,7 +2172,7 @@ mifare_desfire_get_value_ex(FreefareTag tag, uint8_t file_no, int32_t *value, in
     p = mifare_cryto_postprocess_data(tag, res, &sn, cs | CMAC_COMMAND | CMAC_VERIFY | MAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     *value = le32toh(*(int32_t *)(p));
 
@@ -1898,7 +2191,7 @@ mifare_desfire_credit_ex(FreefareTag tag, uint8_t file_no, int32_t amount, int c
     int rc;
 
     ASSERT_ACTIVE(tag);
-    ASSERT_CS(cs);
+    ASSERT_CS(tag, cs);
 
     BUFFER_INIT(cmd, 10 + CMAC_LENGTH);
     BUFFER_INIT(res, 1 + CMAC_LENGTH);
@@ -1915,9 +2208,7 @@ mifare_desfire_credit_ex(FreefareTag tag, uint8_t file_no, int32_t amount, int c
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
-
-    cached_file_settings_current[file_no] = false;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -1933,7 +2224,7 @@ mifare_desfire_debit_ex(FreefareTag tag, uint8_t file_no, int32_t amount, int cs
     int rc;
 
     ASSERT_ACTIVE(tag);
-    ASSERT_CS(cs);
+    ASSERT_CS(tag, cs);
 
     BUFFER_INIT(cmd, 10 + CMAC_LENGTH);
     BUFFER_INIT(res, 1 + CMAC_LENGTH);
@@ -1950,9 +2241,7 @@ mifare_desfire_debit_ex(FreefareTag tag, uint8_t file_no, int32_t amount, int cs
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
-
-    cached_file_settings_current[file_no] = false;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -1968,7 +2257,7 @@ mifare_desfire_limited_credit_ex(FreefareTag tag, uint8_t file_no, int32_t amoun
     int rc;
 
     ASSERT_ACTIVE(tag);
-    ASSERT_CS(cs);
+    ASSERT_CS(tag, cs);
 
     BUFFER_INIT(cmd, 10 + CMAC_LENGTH);
     BUFFER_INIT(res, 1 + CMAC_LENGTH);
@@ -1985,9 +2274,7 @@ mifare_desfire_limited_credit_ex(FreefareTag tag, uint8_t file_no, int32_t amoun
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
-
-    cached_file_settings_current[file_no] = false;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -2006,13 +2293,39 @@ mifare_desfire_write_record_ex(FreefareTag tag, uint8_t file_no, off_t offset, s
 ssize_t
 mifare_desfire_read_records(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data)
 {
-    return mifare_desfire_read_records_ex(tag, file_no, offset, length, data, madame_soleil_get_read_communication_settings(tag, file_no));
+    struct mifare_desfire_file_settings settings;
+    if (mifare_desfire_get_file_settings(tag, file_no, &settings) < 0)
+	return -1;
+
+    return read_data(tag, 0xBB, file_no, offset, length, data, 0, madame_soleil_read_communication_settings(tag, &settings), &settings);
 }
 
 ssize_t
 mifare_desfire_read_records_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, int cs)
 {
-    return read_data(tag, 0xBB, file_no, offset, length, data, cs);
+    return read_data(tag, 0xBB, file_no, offset, length, data, 0, cs, NULL);
+}
+
+ssize_t
+mifare_desfire_read_records_stream(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data)
+{
+    return mifare_desfire_read_records_stream_ex(tag, file_no, offset, length, callback, user_data, madame_soleil_get_read_communication_settings(tag, file_no));
+}
+
+ssize_t
+mifare_desfire_read_records_stream_ex(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, int (*callback)(FreefareTag tag, const uint8_t *data, size_t length, void *user_data), void *user_data, int cs)
+{
+    return read_data_stream(tag, 0xBB, file_no, offset, length, callback, user_data, cs);
+}
+
+ssize_t
+mifare_desfire_read_records_in_place(FreefareTag tag, uint8_t file_no, off_t offset, size_t length, void *data, size_t data_size)
+{
+    struct mifare_desfire_file_settings settings;
+    if (mifare_desfire_get_file_settings(tag, file_no, &settings) < 0)
+	return -1;
+
+    return read_data(tag, 0xBB, file_no, offset, length, data, data_size, madame_soleil_read_communication_settings(tag, &settings), &settings);
 }
 
 int
@@ -2037,9 +2350,7 @@ mifare_desfire_clear_record_file(FreefareTag tag, uint8_t file_no)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
-
-    cached_file_settings_current[file_no] = false;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
 
     return 0;
 }
@@ -2065,7 +2376,9 @@ mifare_desfire_commit_transaction(FreefareTag tag)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+
+    invalidate_transaction_file_settings(tag);
 
     return 0;
 }
@@ -2091,7 +2404,9 @@ mifare_desfire_abort_transaction(FreefareTag tag)
     p = mifare_cryto_postprocess_data(tag, res, &sn, MDCM_PLAIN | CMAC_COMMAND | CMAC_VERIFY);
 
     if (!p)
-	return errno = EINVAL, -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+
+    invalidate_transaction_file_settings(tag);
 
     return 0;
 }
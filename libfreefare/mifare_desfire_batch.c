@@ -0,0 +1,685 @@
+/*
+ * Queues of MIFARE DESFire commands, run back to back on a tag.
+ *
+ * A terminal typically sends the very same short sequence of commands to every
+ * card it sees (select an application, authenticate, read or update a value
+ * file, commit).  A batch records this sequence once, and each run executes it
+ * in order on a tag, stopping at the first failing step and keeping the result
+ * of every step so that the caller does not have to check and unwind each
+ * command individually.
+ *
+ * Each command of a secured session is chained to the reply of the previous
+ * one (the CBC initialisation vector of the session carries the MAC of the
+ * last response), so commands cannot be prepared before the previous reply is
+ * received: steps are run through the regular mifare_desfire_* functions.
+ */
+
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freefare.h>
+#include "freefare_internal.h"
+
+enum mifare_desfire_batch_op {
+    BATCH_SELECT_APPLICATION,
+    BATCH_AUTHENTICATE,
+    BATCH_GET_VALUE,
+    BATCH_CREDIT,
+    BATCH_DEBIT,
+    BATCH_LIMITED_CREDIT,
+    BATCH_READ_DATA,
+    BATCH_WRITE_DATA,
+    BATCH_READ_RECORDS,
+    BATCH_WRITE_RECORD,
+    BATCH_COMMIT_TRANSACTION,
+    BATCH_ABORT_TRANSACTION,
+};
+
+struct mifare_desfire_batch_step {
+    enum mifare_desfire_batch_op op;
+    uint8_t file_no;
+    union {
+	struct mifare_desfire_aid aid;
+	struct {
+	    uint8_t key_no;
+	    MifareDESFireKey key;
+	} authenticate;
+	int32_t *value;
+	int32_t amount;
+	struct {
+	    off_t offset;
+	    size_t length;
+	    void *data;
+	} io;
+    } args;
+    /* Outcome of the last run */
+    bool done;
+    ssize_t result;
+    int error;
+    uint8_t picc_error;
+};
+
+struct mifare_desfire_batch {
+    struct mifare_desfire_batch_step *steps;
+    size_t count;
+    size_t capacity;
+};
+
+MifareDESFireBatch
+mifare_desfire_batch_new(void)
+{
+    return calloc(1, sizeof(struct mifare_desfire_batch));
+}
+
+void
+mifare_desfire_batch_free(MifareDESFireBatch batch)
+{
+    if (batch)
+	free(batch->steps);
+    free(batch);
+}
+
+/*
+ * Append a step to the batch and return it, or NULL if the batch cannot grow.
+ */
+static struct mifare_desfire_batch_step *
+batch_append(MifareDESFireBatch batch, enum mifare_desfire_batch_op op, uint8_t file_no)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (batch->count == batch->capacity) {
+	size_t capacity = batch->capacity ? 2 * batch->capacity : 8;
+
+	if (!(step = realloc(batch->steps, capacity * sizeof(*step)))) {
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	batch->steps = step;
+	batch->capacity = capacity;
+    }
+
+    step = &batch->steps[batch->count++];
+    memset(step, 0, sizeof(*step));
+    step->op = op;
+    step->file_no = file_no;
+
+    return step;
+}
+
+#define BATCH_STEP_INDEX(batch, step) ((int)((step) - (batch)->steps))
+
+int
+mifare_desfire_batch_select_application(MifareDESFireBatch batch, MifareDESFireAID aid)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!(step = batch_append(batch, BATCH_SELECT_APPLICATION, 0)))
+	return -1;
+    if (aid)
+	step->args.aid = *aid;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+int
+mifare_desfire_batch_authenticate(MifareDESFireBatch batch, uint8_t key_no, MifareDESFireKey key)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!key)
+	return errno = EINVAL, -1;
+
+    if (!(step = batch_append(batch, BATCH_AUTHENTICATE, 0)))
+	return -1;
+    step->args.authenticate.key_no = key_no;
+    step->args.authenticate.key = key;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+int
+mifare_desfire_batch_get_value(MifareDESFireBatch batch, uint8_t file_no, int32_t *value)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!value)
+	return errno = EINVAL, -1;
+
+    if (!(step = batch_append(batch, BATCH_GET_VALUE, file_no)))
+	return -1;
+    step->args.value = value;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+static int
+batch_value_operation(MifareDESFireBatch batch, enum mifare_desfire_batch_op op, uint8_t file_no, int32_t amount)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!(step = batch_append(batch, op, file_no)))
+	return -1;
+    step->args.amount = amount;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+int
+mifare_desfire_batch_credit(MifareDESFireBatch batch, uint8_t file_no, int32_t amount)
+{
+    return batch_value_operation(batch, BATCH_CREDIT, file_no, amount);
+}
+
+int
+mifare_desfire_batch_debit(MifareDESFireBatch batch, uint8_t file_no, int32_t amount)
+{
+    return batch_value_operation(batch, BATCH_DEBIT, file_no, amount);
+}
+
+int
+mifare_desfire_batch_limited_credit(MifareDESFireBatch batch, uint8_t file_no, int32_t amount)
+{
+    return batch_value_operation(batch, BATCH_LIMITED_CREDIT, file_no, amount);
+}
+
+static int
+batch_io_operation(MifareDESFireBatch batch, enum mifare_desfire_batch_op op, uint8_t file_no, off_t offset, size_t length, void *data)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!data)
+	return errno = EINVAL, -1;
+
+    if (!(step = batch_append(batch, op, file_no)))
+	return -1;
+    step->args.io.offset = offset;
+    step->args.io.length = length;
+    step->args.io.data = data;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+int
+mifare_desfire_batch_read_data(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, void *data)
+{
+    return batch_io_operation(batch, BATCH_READ_DATA, file_no, offset, length, data);
+}
+
+int
+mifare_desfire_batch_write_data(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, const void *data)
+{
+    return batch_io_operation(batch, BATCH_WRITE_DATA, file_no, offset, length, (void *)data);
+}
+
+int
+mifare_desfire_batch_read_records(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, void *data)
+{
+    return batch_io_operation(batch, BATCH_READ_RECORDS, file_no, offset, length, data);
+}
+
+int
+mifare_desfire_batch_write_record(MifareDESFireBatch batch, uint8_t file_no, off_t offset, size_t length, const void *data)
+{
+    return batch_io_operation(batch, BATCH_WRITE_RECORD, file_no, offset, length, (void *)data);
+}
+
+int
+mifare_desfire_batch_commit_transaction(MifareDESFireBatch batch)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!(step = batch_append(batch, BATCH_COMMIT_TRANSACTION, 0)))
+	return -1;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+int
+mifare_desfire_batch_abort_transaction(MifareDESFireBatch batch)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!(step = batch_append(batch, BATCH_ABORT_TRANSACTION, 0)))
+	return -1;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+size_t
+mifare_desfire_batch_count(MifareDESFireBatch batch)
+{
+    return batch->count;
+}
+
+static ssize_t
+batch_step_run(FreefareTag tag, struct mifare_desfire_batch_step *step)
+{
+    switch (step->op) {
+    case BATCH_SELECT_APPLICATION: {
+	struct mifare_desfire_aid aid = step->args.aid;
+	return mifare_desfire_select_application(tag, &aid);
+    }
+    case BATCH_AUTHENTICATE:
+	return mifare_desfire_authenticate(tag, step->args.authenticate.key_no, step->args.authenticate.key);
+    case BATCH_GET_VALUE:
+	return mifare_desfire_get_value(tag, step->file_no, step->args.value);
+    case BATCH_CREDIT:
+	return mifare_desfire_credit(tag, step->file_no, step->args.amount);
+    case BATCH_DEBIT:
+	return mifare_desfire_debit(tag, step->file_no, step->args.amount);
+    case BATCH_LIMITED_CREDIT:
+	return mifare_desfire_limited_credit(tag, step->file_no, step->args.amount);
+    case BATCH_READ_DATA:
+	return mifare_desfire_read_data(tag, step->file_no, step->args.io.offset, step->args.io.length, step->args.io.data);
+    case BATCH_WRITE_DATA:
+	return mifare_desfire_write_data(tag, step->file_no, step->args.io.offset, step->args.io.length, step->args.io.data);
+    case BATCH_READ_RECORDS:
+	return mifare_desfire_read_records(tag, step->file_no, step->args.io.offset, step->args.io.length, step->args.io.data);
+    case BATCH_WRITE_RECORD:
+	return mifare_desfire_write_record(tag, step->file_no, step->args.io.offset, step->args.io.length, step->args.io.data);
+    case BATCH_COMMIT_TRANSACTION:
+	return mifare_desfire_commit_transaction(tag);
+    case BATCH_ABORT_TRANSACTION:
+	return mifare_desfire_abort_transaction(tag);
+    }
+
+    return errno = EINVAL, -1; /* NOTREACHED */
+}
+
+int
+mifare_desfire_batch_run(FreefareTag tag, MifareDESFireBatch batch)
+{
+    if (tag->type != MIFARE_DESFIRE)
+	return errno = EINVAL, -1;
+    ASSERT_ACTIVE(tag);
+
+    for (size_t i = 0; i < batch->count; i++)
+	batch->steps[i].done = false;
+
+    for (size_t i = 0; i < batch->count; i++) {
+	struct mifare_desfire_batch_step *step = &batch->steps[i];
+
+	step->result = batch_step_run(tag, step);
+	step->error = (step->result < 0) ? errno : 0;
+	step->picc_error = mifare_desfire_last_picc_error(tag);
+	step->done = true;
+
+	if (step->result < 0)
+	    return errno = step->error, -1;
+    }
+
+    return 0;
+}
+
+ssize_t
+mifare_desfire_batch_result(MifareDESFireBatch batch, size_t n)
+{
+    if (n >= batch->count)
+	return errno = EINVAL, -1;
+    if (!batch->steps[n].done)
+	return errno = ECANCELED, -1;
+    if (batch->steps[n].result < 0)
+	return errno = batch->steps[n].error, -1;
+
+    return batch->steps[n].result;
+}
+
+uint8_t
+mifare_desfire_batch_picc_error(MifareDESFireBatch batch, size_t n)
+{
+    if (n >= batch->count || !batch->steps[n].done)
+	return OPERATION_OK;
+
+    return batch->steps[n].picc_error;
+}
+
+/*
+ * Plans
+ *
+ * A plan is a set of file operations, each bound to an application and to the
+ * key it has to be run with.  Selecting an application drops the current
+ * session, so mifare_desfire_plan_batch() orders the operations so that each
+ * application is selected and each key authenticated as few times as possible,
+ * and returns the corresponding batch.
+ *
+ * Operations are ordered greedily: the next operation is, among those whose
+ * constraints are satisfied, the first declared one that can run in the
+ * current session, then in the current application, then anywhere.  Without
+ * ordering constraints, this selects each application and authenticates each
+ * key exactly once.
+ */
+
+struct mifare_desfire_plan_operation {
+    struct mifare_desfire_aid aid;
+    uint8_t key_no;
+    MifareDESFireKey key;
+    struct mifare_desfire_batch_step step;
+    /* Index of the step of the last planned batch */
+    int batch_step;
+};
+
+struct mifare_desfire_plan_constraint {
+    size_t before;
+    size_t after;
+};
+
+struct mifare_desfire_plan {
+    struct mifare_desfire_plan_operation *operations;
+    size_t count;
+    size_t capacity;
+    struct mifare_desfire_plan_constraint *constraints;
+    size_t constraint_count;
+    size_t constraint_capacity;
+};
+
+MifareDESFirePlan
+mifare_desfire_plan_new(void)
+{
+    return calloc(1, sizeof(struct mifare_desfire_plan));
+}
+
+void
+mifare_desfire_plan_free(MifareDESFirePlan plan)
+{
+    if (plan) {
+	free(plan->operations);
+	free(plan->constraints);
+    }
+    free(plan);
+}
+
+static int
+plan_append(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, const struct mifare_desfire_batch_step *step)
+{
+    struct mifare_desfire_plan_operation *operation;
+
+    if (!aid)
+	return errno = EINVAL, -1;
+
+    if (plan->count == plan->capacity) {
+	size_t capacity = plan->capacity ? 2 * plan->capacity : 8;
+
+	if (!(operation = realloc(plan->operations, capacity * sizeof(*operation))))
+	    return errno = ENOMEM, -1;
+	plan->operations = operation;
+	plan->capacity = capacity;
+    }
+
+    operation = &plan->operations[plan->count];
+    operation->aid = *aid;
+    operation->key_no = key_no;
+    operation->key = key;
+    operation->step = *step;
+    operation->batch_step = -1;
+
+    return plan->count++;
+}
+
+static int
+plan_value_operation(MifareDESFirePlan plan, enum mifare_desfire_batch_op op, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount)
+{
+    struct mifare_desfire_batch_step step = {
+	.op = op,
+	.file_no = file_no,
+	.args.amount = amount,
+    };
+
+    return plan_append(plan, aid, key_no, key, &step);
+}
+
+static int
+plan_io_operation(MifareDESFirePlan plan, enum mifare_desfire_batch_op op, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, void *data)
+{
+    struct mifare_desfire_batch_step step = {
+	.op = op,
+	.file_no = file_no,
+	.args.io = {
+	    .offset = offset,
+	    .length = length,
+	    .data = data,
+	},
+    };
+
+    if (!data)
+	return errno = EINVAL, -1;
+
+    return plan_append(plan, aid, key_no, key, &step);
+}
+
+int
+mifare_desfire_plan_get_value(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t *value)
+{
+    struct mifare_desfire_batch_step step = {
+	.op = BATCH_GET_VALUE,
+	.file_no = file_no,
+	.args.value = value,
+    };
+
+    if (!value)
+	return errno = EINVAL, -1;
+
+    return plan_append(plan, aid, key_no, key, &step);
+}
+
+int
+mifare_desfire_plan_credit(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount)
+{
+    return plan_value_operation(plan, BATCH_CREDIT, aid, key_no, key, file_no, amount);
+}
+
+int
+mifare_desfire_plan_debit(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount)
+{
+    return plan_value_operation(plan, BATCH_DEBIT, aid, key_no, key, file_no, amount);
+}
+
+int
+mifare_desfire_plan_limited_credit(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, int32_t amount)
+{
+    return plan_value_operation(plan, BATCH_LIMITED_CREDIT, aid, key_no, key, file_no, amount);
+}
+
+int
+mifare_desfire_plan_read_data(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, void *data)
+{
+    return plan_io_operation(plan, BATCH_READ_DATA, aid, key_no, key, file_no, offset, length, data);
+}
+
+int
+mifare_desfire_plan_write_data(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, const void *data)
+{
+    return plan_io_operation(plan, BATCH_WRITE_DATA, aid, key_no, key, file_no, offset, length, (void *)data);
+}
+
+int
+mifare_desfire_plan_read_records(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, void *data)
+{
+    return plan_io_operation(plan, BATCH_READ_RECORDS, aid, key_no, key, file_no, offset, length, data);
+}
+
+int
+mifare_desfire_plan_write_record(MifareDESFirePlan plan, MifareDESFireAID aid, uint8_t key_no, MifareDESFireKey key, uint8_t file_no, off_t offset, size_t length, const void *data)
+{
+    return plan_io_operation(plan, BATCH_WRITE_RECORD, aid, key_no, key, file_no, offset, length, (void *)data);
+}
+
+int
+mifare_desfire_plan_order(MifareDESFirePlan plan, int before, int after)
+{
+    struct mifare_desfire_plan_constraint *constraint;
+
+    if ((before < 0) || (after < 0) || ((size_t)before >= plan->count) || ((size_t)after >= plan->count) || (before == after))
+	return errno = EINVAL, -1;
+
+    if (plan->constraint_count == plan->constraint_capacity) {
+	size_t capacity = plan->constraint_capacity ? 2 * plan->constraint_capacity : 8;
+
+	if (!(constraint = realloc(plan->constraints, capacity * sizeof(*constraint))))
+	    return errno = ENOMEM, -1;
+	plan->constraints = constraint;
+	plan->constraint_capacity = capacity;
+    }
+
+    constraint = &plan->constraints[plan->constraint_count++];
+    constraint->before = before;
+    constraint->after = after;
+
+    return 0;
+}
+
+static bool
+plan_operation_modifies(const struct mifare_desfire_plan_operation *operation)
+{
+    switch (operation->step.op) {
+    case BATCH_CREDIT:
+    case BATCH_DEBIT:
+    case BATCH_LIMITED_CREDIT:
+    case BATCH_WRITE_DATA:
+    case BATCH_WRITE_RECORD:
+	return true;
+    default:
+	return false;
+    }
+}
+
+/*
+ * An operation is ready when the operations it has been declared to follow,
+ * and the operations on the same file declared before it, are planned.
+ */
+static bool
+plan_operation_ready(MifareDESFirePlan plan, const bool *planned, size_t n)
+{
+    const struct mifare_desfire_plan_operation *operation = &plan->operations[n];
+
+    for (size_t i = 0; i < plan->constraint_count; i++) {
+	if ((plan->constraints[i].after == n) && !planned[plan->constraints[i].before])
+	    return false;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+	if (!planned[i] && (plan->operations[i].step.file_no == operation->step.file_no) && !memcmp(&plan->operations[i].aid, &operation->aid, sizeof(operation->aid)))
+	    return false;
+    }
+
+    return true;
+}
+
+static int
+plan_batch_append(MifareDESFireBatch batch, const struct mifare_desfire_batch_step *template)
+{
+    struct mifare_desfire_batch_step *step;
+
+    if (!(step = batch_append(batch, template->op, template->file_no)))
+	return -1;
+    step->args = template->args;
+
+    return BATCH_STEP_INDEX(batch, step);
+}
+
+MifareDESFireBatch
+mifare_desfire_plan_batch(MifareDESFirePlan plan)
+{
+    MifareDESFireBatch batch;
+    bool *planned;
+    const struct mifare_desfire_plan_operation *current = NULL;
+    MifareDESFireKey session_key = NULL;
+    uint8_t session_key_no = 0;
+    bool pending = false;
+    int res = 0;
+
+    if (!(batch = mifare_desfire_batch_new()))
+	return NULL;
+    if (!(planned = calloc(plan->count ? plan->count : 1, sizeof(*planned)))) {
+	mifare_desfire_batch_free(batch);
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    for (size_t i = 0; i < plan->count; i++)
+	plan->operations[i].batch_step = -1;
+
+    for (size_t n = 0; n < plan->count; n++) {
+	struct mifare_desfire_plan_operation *next = NULL;
+	int next_rank = 3;
+
+	for (size_t i = 0; i < plan->count; i++) {
+	    struct mifare_desfire_plan_operation *operation = &plan->operations[i];
+	    int rank = 2;
+
+	    if (planned[i] || !plan_operation_ready(plan, planned, i))
+		continue;
+
+	    if (current && !memcmp(&operation->aid, &current->aid, sizeof(operation->aid))) {
+		rank = 1;
+		if (!operation->key || ((operation->key == session_key) && (operation->key_no == session_key_no)))
+		    rank = 0;
+	    }
+	    if (rank < next_rank) {
+		next = operation;
+		next_rank = rank;
+	    }
+	}
+
+	if (!next) {
+	    // Circular ordering constraints
+	    errno = EINVAL;
+	    res = -1;
+	    break;
+	}
+
+	if (2 == next_rank) {
+	    if (pending && (res = mifare_desfire_batch_commit_transaction(batch)) < 0)
+		break;
+	    struct mifare_desfire_batch_step select = {
+		.op = BATCH_SELECT_APPLICATION,
+		.args.aid = next->aid,
+	    };
+	    if ((res = plan_batch_append(batch, &select)) < 0)
+		break;
+	    session_key = NULL;
+	    pending = false;
+	}
+	if (next_rank >= 1 && next->key) {
+	    if (pending && (res = mifare_desfire_batch_commit_transaction(batch)) < 0)
+		break;
+	    if ((res = mifare_desfire_batch_authenticate(batch, next->key_no, next->key)) < 0)
+		break;
+	    session_key = next->key;
+	    session_key_no = next->key_no;
+	    pending = false;
+	}
+
+	if ((res = plan_batch_append(batch, &next->step)) < 0)
+	    break;
+	next->batch_step = res;
+	pending |= plan_operation_modifies(next);
+	planned[next - plan->operations] = true;
+	current = next;
+    }
+
+    if ((res >= 0) && pending)
+	res = mifare_desfire_batch_commit_transaction(batch);
+
+    free(planned);
+
+    if (res < 0) {
+	mifare_desfire_batch_free(batch);
+	return NULL;
+    }
+
+    return batch;
+}
+
+int
+mifare_desfire_plan_step(MifareDESFirePlan plan, int n)
+{
+    if ((n < 0) || ((size_t)n >= plan->count) || (plan->operations[n].batch_step < 0))
+	return errno = EINVAL, -1;
+
+    return plan->operations[n].batch_step;
+}
@@ -0,0 +1,1918 @@
+/*
+ * Software model of a MIFARE DESFire EV1 PICC.
+ *
+ * This is the card side of the frames produced by mifare_desfire.c: native
+ * commands are unwrapped from their ISO 7816-4 envelope, processed against an
+ * in-memory card (applications, keys and files) and the response is wrapped
+ * back.  Secure messaging is handled with the same crypto primitives the
+ * library uses on the PCD side, so that a session established with the
+ * emulator behaves exactly like one established with a physical card.
+ *
+ * This implementation was written based on information provided by the
+ * following documents:
+ *
+ * MIFARE DESFire EV1 Functional specification
+ *
+ * http://ridrix.wordpress.com/2009/09/19/mifare-desfire-communication-example/
+ */
+
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/rand.h>
+
+#include <freefare.h>
+#include "freefare_internal.h"
+
+#define MAX_APPLICATION_COUNT 28
+#define MAX_FILE_COUNT 32
+#define MAX_KEY_COUNT 14
+
+/* Data bytes of a response frame (MAX_RAPDU_SIZE - 1) */
+#define FRAME_SIZE 59
+#define MAX_FRAME_COUNT 32
+
+/* User memory of a 8k card and allocation granularity */
+#define PICC_CAPACITY 7936
+#define PICC_BLOCK_SIZE 32
+
+#define MAC_LENGTH 4
+#define CMAC_LENGTH 8
+
+#define NO_KEY -1
+
+struct desfire_file {
+    bool exists;
+    uint8_t type;
+    uint8_t communication_settings;
+    uint16_t access_rights;
+    bool has_iso_file_id;
+    uint16_t iso_file_id;
+
+    /* Data files */
+    uint32_t file_size;
+    uint8_t *data;
+    uint8_t *backup;
+
+    /* Value files */
+    int32_t lower_limit;
+    int32_t upper_limit;
+    int32_t value;
+    int32_t pending_value;
+    int32_t pending_debit;
+    int32_t limited_credit_value;
+    uint8_t limited_credit_enabled;
+
+    /* Record files */
+    uint32_t record_size;
+    uint32_t max_number_of_records;
+    uint32_t current_number_of_records;
+    uint32_t first_record;
+    uint8_t *pending_record;
+    bool pending_clear;
+
+    bool dirty;
+};
+
+struct desfire_application {
+    bool exists;
+    uint32_t aid;
+    uint8_t key_settings;
+    uint8_t key_count;
+    uint8_t crypto;
+    bool iso_file_identifiers;
+    bool has_iso_file_id;
+    uint16_t iso_file_id;
+    uint8_t df_name[16];
+    size_t df_name_len;
+    MifareDESFireKey keys[MAX_KEY_COUNT];
+    struct desfire_file files[MAX_FILE_COUNT];
+};
+
+struct mifare_desfire_emulator {
+    uint8_t uid[7];
+    uint8_t configuration;
+    uint8_t default_key[24];
+    uint8_t default_key_version;
+    uint8_t ats[20];
+
+    struct desfire_application picc;
+    struct desfire_application applications[MAX_APPLICATION_COUNT];
+    struct desfire_application *selected;
+
+    /* Authentication state */
+    MifareDESFireKey session_key;
+    struct mifare_desfire_key session_key_storage;
+    int authentication_scheme;
+    int authenticated_key_no;
+    uint8_t ivect[MAX_CRYPTO_BLOCK_SIZE];
+
+    /* Pending authentication */
+    uint8_t authentication_command;
+    int authentication_key_no;
+    uint8_t rndb[16];
+    size_t rnd_length;
+
+    /* Command received over several frames */
+    uint8_t *command;
+    size_t command_size;
+    size_t command_length;
+    bool receiving;
+
+    /* Response sent over several frames */
+    uint8_t *response;
+    size_t response_size;
+    size_t response_length;
+    size_t response_offset;
+    uint8_t response_status;
+    size_t frames[MAX_FRAME_COUNT];
+    int frame_count;
+    int frame_index;
+    bool response_secured;
+};
+
+static const uint8_t DESFIRE_ATS[] = { 0x75, 0x77, 0x81, 0x02, 0x80 };
+
+static uint8_t	 dispatch(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len);
+
+/*
+ * Miscellaneous low-level memory manipulation functions.
+ */
+
+static uint32_t
+get_le24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static int32_t
+get_le32(const uint8_t *p)
+{
+    return (int32_t)((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static void
+put_le24(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+}
+
+static void
+put_le32(uint8_t *p, int32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int
+reserve(uint8_t **buffer, size_t *size, size_t n)
+{
+    if (*size < n) {
+	uint8_t *p;
+	if (!(p = realloc(*buffer, n)))
+	    return -1;
+	*buffer = p;
+	*size = n;
+    }
+    return 0;
+}
+
+/*
+ * Key management.
+ */
+
+static MifareDESFireKey
+key_new(uint8_t crypto, const uint8_t *data, uint8_t aes_version)
+{
+    switch (crypto) {
+    case APPLICATION_CRYPTO_3K3DES:
+	return mifare_desfire_3k3des_key_new_with_version(data);
+    case APPLICATION_CRYPTO_AES:
+	return mifare_desfire_aes_key_new_with_version(data, aes_version);
+    default:
+	/*
+	 * The PICC treats a 2K3DES key which halves are identical (including
+	 * parity bits) as a DES key.
+	 */
+	if (0 == memcmp(data, data + 8, 8))
+	    return mifare_desfire_des_key_new_with_version(data);
+	return mifare_desfire_3des_key_new_with_version(data);
+    }
+}
+
+static size_t
+key_length(uint8_t crypto)
+{
+    return (APPLICATION_CRYPTO_3K3DES == crypto) ? 24 : 16;
+}
+
+static size_t
+block_size(const MifareDESFireKey key)
+{
+    return (MIFARE_KEY_AES128 == key->type) ? 16 : 8;
+}
+
+/*
+ * Session management.
+ */
+
+static void
+reset_authentication(struct mifare_desfire_emulator *emu)
+{
+    emu->session_key = NULL;
+    memset(&emu->session_key_storage, 0, sizeof(emu->session_key_storage));
+    emu->authenticated_key_no = NO_KEY;
+    emu->authentication_key_no = NO_KEY;
+    memset(emu->ivect, 0, sizeof(emu->ivect));
+}
+
+static bool
+authenticated_with(const struct mifare_desfire_emulator *emu, int key_no)
+{
+    return emu->session_key && (emu->authenticated_key_no == key_no);
+}
+
+static void
+application_wipe(struct desfire_application *app)
+{
+    for (int i = 0; i < MAX_KEY_COUNT; i++) {
+	if (app->keys[i])
+	    mifare_desfire_key_free(app->keys[i]);
+    }
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+	free(app->files[i].data);
+	free(app->files[i].backup);
+	free(app->files[i].pending_record);
+    }
+    memset(app, 0, sizeof(*app));
+}
+
+static void
+file_rollback(struct desfire_file *file)
+{
+    free(file->backup);
+    file->backup = NULL;
+    free(file->pending_record);
+    file->pending_record = NULL;
+    file->pending_clear = false;
+    file->pending_value = file->value;
+    file->pending_debit = 0;
+    file->dirty = false;
+}
+
+static void
+file_commit(struct desfire_file *file)
+{
+    switch (file->type) {
+    case MDFT_BACKUP_DATA_FILE:
+	if (file->backup) {
+	    free(file->data);
+	    file->data = file->backup;
+	    file->backup = NULL;
+	}
+	break;
+    case MDFT_VALUE_FILE_WITH_BACKUP:
+	/* The amount debited becomes available for a limited credit */
+	if (file->pending_debit)
+	    file->limited_credit_value = file->pending_debit;
+	file->value = file->pending_value;
+	file->pending_debit = 0;
+	break;
+    case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+    case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+	if (file->pending_clear) {
+	    file->current_number_of_records = 0;
+	    file->first_record = 0;
+	}
+	if (file->pending_record) {
+	    uint32_t capacity = file->max_number_of_records;
+	    if (MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP == file->type)
+		capacity--;
+	    if (file->current_number_of_records == capacity) {
+		file->first_record = (file->first_record + 1) % file->max_number_of_records;
+		file->current_number_of_records--;
+	    }
+	    uint32_t slot = (file->first_record + file->current_number_of_records) % file->max_number_of_records;
+	    memcpy(file->data + slot * file->record_size, file->pending_record, file->record_size);
+	    file->current_number_of_records++;
+	}
+	break;
+    }
+    file->pending_clear = false;
+    free(file->pending_record);
+    file->pending_record = NULL;
+    file->dirty = false;
+}
+
+static void
+application_transaction(struct desfire_application *app, bool commit)
+{
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+	if (app->files[i].exists && app->files[i].dirty) {
+	    if (commit)
+		file_commit(&app->files[i]);
+	    else
+		file_rollback(&app->files[i]);
+	}
+    }
+}
+
+static void
+select_picc(struct mifare_desfire_emulator *emu)
+{
+    if (emu->selected)
+	application_transaction(emu->selected, false);
+    emu->selected = &emu->picc;
+    reset_authentication(emu);
+}
+
+/*
+ * Secure messaging, PICC side.
+ *
+ * The PCD always deciphers when sending data in legacy mode, so the PICC
+ * enciphers received data and sends enciphered data.
+ */
+
+static void
+decipher_command(struct mifare_desfire_emulator *emu, uint8_t *data, size_t len)
+{
+    if (AS_LEGACY == emu->authentication_scheme) {
+	memset(emu->ivect, 0, sizeof(emu->ivect));
+	mifare_cypher_blocks_chained(NULL, emu->session_key, emu->ivect, data, len, MCD_RECEIVE, MCO_ENCYPHER);
+    } else {
+	mifare_cypher_blocks_chained(NULL, emu->session_key, emu->ivect, data, len, MCD_RECEIVE, MCO_DECYPHER);
+    }
+}
+
+static void
+encipher_response(struct mifare_desfire_emulator *emu, uint8_t *data, size_t len)
+{
+    if (AS_LEGACY == emu->authentication_scheme)
+	memset(emu->ivect, 0, sizeof(emu->ivect));
+    mifare_cypher_blocks_chained(NULL, emu->session_key, emu->ivect, data, len, MCD_SEND, MCO_ENCYPHER);
+}
+
+static void
+legacy_mac(struct mifare_desfire_emulator *emu, const uint8_t *data, size_t len, uint8_t mac[MAC_LENGTH])
+{
+    size_t edl = padded_data_length(len, 8);
+    uint8_t buffer[edl];
+    uint8_t ivect[MAX_CRYPTO_BLOCK_SIZE];
+
+    memset(buffer, 0, edl);
+    memcpy(buffer, data, len);
+    memset(ivect, 0, sizeof(ivect));
+    mifare_cypher_blocks_chained(NULL, emu->session_key, ivect, buffer, edl, MCD_SEND, MCO_ENCYPHER);
+    memcpy(mac, buffer + edl - 8, MAC_LENGTH);
+}
+
+static size_t
+crc_length(const struct mifare_desfire_emulator *emu)
+{
+    return (AS_LEGACY == emu->authentication_scheme) ? 2 : 4;
+}
+
+/*
+ * Check the CRC of deciphered command data.  Legacy CRC16 only covers the
+ * data, while CRC32 also covers the command header.
+ */
+static bool
+crc_verified(const struct mifare_desfire_emulator *emu, const uint8_t *cmd, size_t header_len, size_t data_len)
+{
+    uint8_t crc[4];
+
+    if (AS_LEGACY == emu->authentication_scheme) {
+	iso14443a_crc((uint8_t *)cmd + header_len, data_len, crc);
+	return 0 == memcmp(crc, cmd + header_len + data_len, 2);
+    } else {
+	desfire_crc32(cmd, header_len + data_len, crc);
+	return 0 == memcmp(crc, cmd + header_len + data_len, 4);
+    }
+}
+
+/*
+ * Length of a command which data_len bytes of data following a header of
+ * header_len bytes are transmitted with the given communication mode.
+ */
+static size_t
+secured_length(const struct mifare_desfire_emulator *emu, size_t header_len, size_t data_len, int mode)
+{
+    if (!emu->session_key)
+	return header_len + data_len;
+
+    switch (mode) {
+    case MDCM_MACED:
+	return header_len + data_len + ((AS_LEGACY == emu->authentication_scheme) ? MAC_LENGTH : CMAC_LENGTH);
+    case MDCM_ENCIPHERED:
+	return header_len + padded_data_length(data_len + crc_length(emu), block_size(emu->session_key));
+    default:
+	return header_len + data_len;
+    }
+}
+
+/*
+ * Remove the secure messaging layer of a command.  On success *len is
+ * updated to the length of the plain command.
+ */
+static uint8_t
+unsecure_command(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t *len, size_t header_len, size_t data_len, int mode)
+{
+    uint8_t mac[MAX_CRYPTO_BLOCK_SIZE];
+
+    if (*len != secured_length(emu, header_len, data_len, mode))
+	return LENGTH_ERROR;
+
+    if (!emu->session_key)
+	return OPERATION_OK;
+
+    switch (mode) {
+    case MDCM_PLAIN:
+	if (AS_NEW == emu->authentication_scheme)
+	    cmac(emu->session_key, emu->ivect, cmd, *len, mac);
+	break;
+    case MDCM_MACED:
+	if (AS_LEGACY == emu->authentication_scheme) {
+	    *len -= MAC_LENGTH;
+	    legacy_mac(emu, cmd + header_len, data_len, mac);
+	    if (memcmp(mac, cmd + *len, MAC_LENGTH))
+		return INTEGRITY_ERROR;
+	} else {
+	    *len -= CMAC_LENGTH;
+	    cmac(emu->session_key, emu->ivect, cmd, *len, mac);
+	    if (memcmp(mac, cmd + *len, CMAC_LENGTH))
+		return INTEGRITY_ERROR;
+	}
+	break;
+    case MDCM_ENCIPHERED:
+	decipher_command(emu, cmd + header_len, *len - header_len);
+	if (!crc_verified(emu, cmd, header_len, data_len))
+	    return INTEGRITY_ERROR;
+	for (size_t n = header_len + data_len + crc_length(emu); n < *len; n++) {
+	    if (cmd[n])
+		return INTEGRITY_ERROR;
+	}
+	*len = header_len + data_len;
+	break;
+    }
+
+    return OPERATION_OK;
+}
+
+/*
+ * Response management.
+ */
+
+static int
+response_append(struct mifare_desfire_emulator *emu, const void *data, size_t len)
+{
+    if (reserve(&emu->response, &emu->response_size, emu->response_length + len + 32) < 0)
+	return -1;
+    memcpy(emu->response + emu->response_length, data, len);
+    emu->response_length += len;
+    return 0;
+}
+
+static void
+response_frame(struct mifare_desfire_emulator *emu, size_t len)
+{
+    if (emu->frame_count < MAX_FRAME_COUNT)
+	emu->frames[emu->frame_count++] = len;
+}
+
+/*
+ * Add the secure messaging layer to the response data.
+ */
+static int
+secure_response(struct mifare_desfire_emulator *emu, int mode)
+{
+    uint8_t mac[MAX_CRYPTO_BLOCK_SIZE];
+    uint8_t crc[4];
+    size_t len = emu->response_length;
+
+    emu->response_secured = true;
+
+    if (!emu->session_key)
+	return 0;
+
+    switch (mode) {
+    case MDCM_PLAIN:
+    case MDCM_MACED:
+	if (AS_NEW == emu->authentication_scheme) {
+	    uint8_t status = OPERATION_OK;
+	    if (response_append(emu, &status, 1) < 0)
+		return -1;
+	    cmac(emu->session_key, emu->ivect, emu->response, len + 1, mac);
+	    emu->response_length = len;
+	    return response_append(emu, mac, CMAC_LENGTH);
+	} else if (MDCM_MACED == mode) {
+	    legacy_mac(emu, emu->response, len, mac);
+	    return response_append(emu, mac, MAC_LENGTH);
+	}
+	break;
+    case MDCM_ENCIPHERED:
+	if (AS_LEGACY == emu->authentication_scheme) {
+	    iso14443a_crc(emu->response, len, crc);
+	} else {
+	    uint8_t status = OPERATION_OK;
+	    if (response_append(emu, &status, 1) < 0)
+		return -1;
+	    desfire_crc32(emu->response, len + 1, crc);
+	    emu->response_length = len;
+	}
+	if (response_append(emu, crc, crc_length(emu)) < 0)
+	    return -1;
+	size_t edl = padded_data_length(emu->response_length, block_size(emu->session_key));
+	if (reserve(&emu->response, &emu->response_size, edl) < 0)
+	    return -1;
+	memset(emu->response + emu->response_length, 0, edl - emu->response_length);
+	emu->response_length = edl;
+	encipher_response(emu, emu->response, edl);
+	break;
+    }
+
+    return 0;
+}
+
+/*
+ * Access control.
+ */
+
+static struct desfire_file *
+lookup_file(struct mifare_desfire_emulator *emu, uint8_t file_no, uint8_t *status)
+{
+    if (emu->selected == &emu->picc) {
+	*status = PERMISSION_ERROR;
+	return NULL;
+    }
+    if ((file_no >= MAX_FILE_COUNT) || !emu->selected->files[file_no].exists) {
+	*status = FILE_NOT_FOUND;
+	return NULL;
+    }
+    return &emu->selected->files[file_no];
+}
+
+/*
+ * Resolve the communication mode used for accessing a file through any of the
+ * provided access rights.
+ */
+static uint8_t
+file_access(struct mifare_desfire_emulator *emu, const struct desfire_file *file, const uint8_t *rights, size_t n, int *mode)
+{
+    bool free_access = false;
+    bool denied = true;
+
+    for (size_t i = 0; i < n; i++) {
+	if (MDAR_DENY != rights[i])
+	    denied = false;
+	if (MDAR_FREE == rights[i]) {
+	    free_access = true;
+	} else if (authenticated_with(emu, rights[i])) {
+	    *mode = file->communication_settings;
+	    return OPERATION_OK;
+	}
+    }
+
+    if (free_access) {
+	*mode = MDCM_PLAIN;
+	return OPERATION_OK;
+    }
+
+    return (denied || emu->session_key) ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+}
+
+static bool
+listing_allowed(struct mifare_desfire_emulator *emu)
+{
+    return (emu->selected->key_settings & 0x02) || authenticated_with(emu, 0);
+}
+
+static bool
+create_delete_allowed(struct mifare_desfire_emulator *emu)
+{
+    return (emu->selected->key_settings & 0x04) || authenticated_with(emu, 0);
+}
+
+static size_t
+used_memory(struct mifare_desfire_emulator *emu)
+{
+    size_t used = 0;
+
+    for (int a = 0; a < MAX_APPLICATION_COUNT; a++) {
+	struct desfire_application *app = &emu->applications[a];
+	if (!app->exists)
+	    continue;
+	used += PICC_BLOCK_SIZE;
+	for (int f = 0; f < MAX_FILE_COUNT; f++) {
+	    struct desfire_file *file = &app->files[f];
+	    if (!file->exists)
+		continue;
+	    switch (file->type) {
+	    case MDFT_STANDARD_DATA_FILE:
+		used += padded_data_length(file->file_size, PICC_BLOCK_SIZE);
+		break;
+	    case MDFT_BACKUP_DATA_FILE:
+		used += 2 * padded_data_length(file->file_size, PICC_BLOCK_SIZE);
+		break;
+	    case MDFT_VALUE_FILE_WITH_BACKUP:
+		used += PICC_BLOCK_SIZE;
+		break;
+	    default:
+		used += padded_data_length(file->record_size * file->max_number_of_records, PICC_BLOCK_SIZE);
+		break;
+	    }
+	}
+    }
+
+    return used;
+}
+
+/*
+ * Authentication.
+ */
+
+static uint8_t
+authenticate_step1(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    reset_authentication(emu);
+
+    if (len != 2)
+	return LENGTH_ERROR;
+
+    uint8_t key_no = cmd[1];
+    if (key_no >= emu->selected->key_count)
+	return NO_SUCH_KEY;
+
+    MifareDESFireKey key = emu->selected->keys[key_no];
+    switch (cmd[0]) {
+    case 0x0A:
+	if ((MIFARE_KEY_DES != key->type) && (MIFARE_KEY_2K3DES != key->type))
+	    return AUTHENTICATION_ERROR;
+	break;
+    case 0x1A:
+	if (MIFARE_KEY_AES128 == key->type)
+	    return AUTHENTICATION_ERROR;
+	break;
+    case 0xAA:
+	if (MIFARE_KEY_AES128 != key->type)
+	    return AUTHENTICATION_ERROR;
+	break;
+    }
+
+    emu->authentication_scheme = (0x0A == cmd[0]) ? AS_LEGACY : AS_NEW;
+    emu->authentication_command = cmd[0];
+    emu->authentication_key_no = key_no;
+    emu->rnd_length = (MIFARE_KEY_3K3DES == key->type || MIFARE_KEY_AES128 == key->type) ? 16 : 8;
+
+    RAND_bytes(emu->rndb, emu->rnd_length);
+
+    uint8_t e_rndb[16];
+    memcpy(e_rndb, emu->rndb, emu->rnd_length);
+    mifare_cypher_blocks_chained(NULL, key, emu->ivect, e_rndb, emu->rnd_length, MCD_SEND, MCO_ENCYPHER);
+
+    response_append(emu, e_rndb, emu->rnd_length);
+    emu->response_secured = true;
+
+    return ADDITIONAL_FRAME;
+}
+
+static uint8_t
+authenticate_step2(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    int key_no = emu->authentication_key_no;
+    MifareDESFireKey key = emu->selected->keys[key_no];
+    size_t rl = emu->rnd_length;
+
+    emu->authentication_key_no = NO_KEY;
+
+    if (len != 1 + 2 * rl)
+	return LENGTH_ERROR;
+
+    uint8_t token[32];
+    memcpy(token, cmd + 1, 2 * rl);
+
+    if (AS_LEGACY == emu->authentication_scheme) {
+	memset(emu->ivect, 0, sizeof(emu->ivect));
+	mifare_cypher_blocks_chained(NULL, key, emu->ivect, token, 2 * rl, MCD_RECEIVE, MCO_ENCYPHER);
+    } else {
+	mifare_cypher_blocks_chained(NULL, key, emu->ivect, token, 2 * rl, MCD_RECEIVE, MCO_DECYPHER);
+    }
+
+    uint8_t rndb_s[16];
+    memcpy(rndb_s, emu->rndb, rl);
+    rol(rndb_s, rl);
+    if (memcmp(rndb_s, token + rl, rl)) {
+	reset_authentication(emu);
+	return AUTHENTICATION_ERROR;
+    }
+
+    uint8_t rnda[16];
+    uint8_t e_rnda_s[16];
+    memcpy(rnda, token, rl);
+    memcpy(e_rnda_s, token, rl);
+    rol(e_rnda_s, rl);
+
+    if (AS_LEGACY == emu->authentication_scheme)
+	memset(emu->ivect, 0, sizeof(emu->ivect));
+    mifare_cypher_blocks_chained(NULL, key, emu->ivect, e_rnda_s, rl, MCD_SEND, MCO_ENCYPHER);
+
+    response_append(emu, e_rnda_s, rl);
+    emu->response_secured = true;
+
+    mifare_desfire_session_key_init(&emu->session_key_storage, rnda, emu->rndb, key);
+    emu->session_key = &emu->session_key_storage;
+    emu->authenticated_key_no = key_no;
+    memset(emu->ivect, 0, sizeof(emu->ivect));
+
+    return OPERATION_OK;
+}
+
+/*
+ * PICC level commands.
+ */
+
+static uint8_t
+get_version(struct mifare_desfire_emulator *emu)
+{
+    static const uint8_t hardware[] = { 0x04, 0x01, 0x01, 0x01, 0x00, 0x1A, 0x05 };
+    static const uint8_t software[] = { 0x04, 0x01, 0x01, 0x01, 0x04, 0x1A, 0x05 };
+    static const uint8_t production[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x10 };
+
+    response_append(emu, hardware, sizeof(hardware));
+    response_append(emu, software, sizeof(software));
+    response_append(emu, emu->uid, sizeof(emu->uid));
+    response_append(emu, production, sizeof(production));
+
+    response_frame(emu, sizeof(hardware));
+    response_frame(emu, sizeof(software));
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_key_settings(struct mifare_desfire_emulator *emu)
+{
+    if (!listing_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    uint8_t data[2] = {
+	emu->selected->key_settings,
+	emu->selected->key_count | emu->selected->crypto,
+    };
+    response_append(emu, data, sizeof(data));
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+change_key_settings(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    uint8_t status;
+
+    if (!authenticated_with(emu, 0))
+	return PERMISSION_ERROR;
+    if ((status = unsecure_command(emu, cmd, &len, 1, 1, MDCM_ENCIPHERED)))
+	return status;
+    if (!(emu->selected->key_settings & 0x08))
+	return PERMISSION_ERROR;
+
+    emu->selected->key_settings = cmd[1];
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_key_version(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    if (len != 2)
+	return LENGTH_ERROR;
+    if ((cmd[1] & 0x0F) >= emu->selected->key_count)
+	return NO_SUCH_KEY;
+
+    uint8_t version = mifare_desfire_key_get_version(emu->selected->keys[cmd[1] & 0x0F]);
+    response_append(emu, &version, 1);
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+change_key(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_application *app = emu->selected;
+
+    if (len < 2)
+	return LENGTH_ERROR;
+    if (!emu->session_key)
+	return AUTHENTICATION_ERROR;
+
+    uint8_t key_no = cmd[1] & 0x0F;
+    uint8_t crypto = app->crypto;
+    if (app == &emu->picc) {
+	crypto = cmd[1] & 0xC0;
+	if (crypto == 0xC0)
+	    return PARAMETER_ERROR;
+    }
+    if (key_no >= app->key_count)
+	return NO_SUCH_KEY;
+
+    /* Check the change key access rights */
+    uint8_t change_key = app->key_settings >> 4;
+    if (0 == key_no) {
+	if (!(app->key_settings & 0x01) || !authenticated_with(emu, 0))
+	    return PERMISSION_ERROR;
+    } else if (0x0F == change_key) {
+	return PERMISSION_ERROR;
+    } else if (0x0E == change_key) {
+	if (!authenticated_with(emu, key_no))
+	    return PERMISSION_ERROR;
+    } else if (!authenticated_with(emu, change_key)) {
+	return PERMISSION_ERROR;
+    }
+
+    size_t kl = key_length(crypto);
+    size_t dl = kl + ((APPLICATION_CRYPTO_AES == crypto) ? 1 : 0);
+    bool same_key = (emu->authenticated_key_no == key_no);
+    size_t cl = crc_length(emu);
+    size_t edl = padded_data_length(dl + cl + (same_key ? 0 : cl), block_size(emu->session_key));
+
+    if (len != 2 + edl)
+	return LENGTH_ERROR;
+
+    decipher_command(emu, cmd + 2, edl);
+    if (!crc_verified(emu, cmd, 2, dl))
+	return INTEGRITY_ERROR;
+
+    uint8_t new_key[24];
+    memcpy(new_key, cmd + 2, kl);
+    if (!same_key) {
+	uint8_t crc[4];
+	for (size_t n = 0; n < kl; n++)
+	    new_key[n] ^= app->keys[key_no]->data[n];
+	if (AS_LEGACY == emu->authentication_scheme)
+	    iso14443a_crc(new_key, kl, crc);
+	else
+	    desfire_crc32(new_key, kl, crc);
+	if (memcmp(crc, cmd + 2 + dl + cl, cl))
+	    return INTEGRITY_ERROR;
+    }
+
+    MifareDESFireKey key;
+    if (!(key = key_new(crypto, new_key, cmd[2 + kl])))
+	return OUT_OF_EEPROM_ERROR;
+
+    mifare_desfire_key_free(app->keys[key_no]);
+    app->keys[key_no] = key;
+    if (app == &emu->picc)
+	app->crypto = crypto;
+
+    if (same_key) {
+	reset_authentication(emu);
+	emu->response_secured = true;
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+create_application(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    if (emu->selected != &emu->picc)
+	return PERMISSION_ERROR;
+    if (!create_delete_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+    if ((len != 6) && ((len < 8) || (len > 8 + 16)))
+	return LENGTH_ERROR;
+
+    uint32_t aid = get_le24(cmd + 1);
+    uint8_t key_count = cmd[5] & 0x0F;
+    uint8_t crypto = cmd[5] & 0xC0;
+
+    if (!aid || (key_count > MAX_KEY_COUNT) || (0xC0 == crypto))
+	return PARAMETER_ERROR;
+
+    uint16_t iso_file_id = (len > 6) ? (cmd[6] | (cmd[7] << 8)) : 0;
+    size_t df_name_len = (len > 8) ? len - 8 : 0;
+
+    struct desfire_application *app = NULL;
+    for (int i = 0; i < MAX_APPLICATION_COUNT; i++) {
+	struct desfire_application *a = &emu->applications[i];
+	if (a->exists) {
+	    if (a->aid == aid)
+		return DUPLICATE_ERROR;
+	    if ((len > 6) && a->has_iso_file_id && (a->iso_file_id == iso_file_id))
+		return DUPLICATE_ERROR;
+	    if (df_name_len && (a->df_name_len == df_name_len) && (0 == memcmp(a->df_name, cmd + 8, df_name_len)))
+		return DUPLICATE_ERROR;
+	} else if (!app) {
+	    app = a;
+	}
+    }
+    if (!app)
+	return COUNT_ERROR;
+    if (used_memory(emu) + PICC_BLOCK_SIZE > PICC_CAPACITY)
+	return OUT_OF_EEPROM_ERROR;
+
+    uint8_t key_data[24];
+    memset(key_data, 0, sizeof(key_data));
+    if (crypto == emu->picc.crypto || APPLICATION_CRYPTO_DES == crypto)
+	memcpy(key_data, emu->default_key, sizeof(key_data));
+
+    for (int i = 0; i < key_count; i++) {
+	if (!(app->keys[i] = key_new(crypto, key_data, emu->default_key_version))) {
+	    application_wipe(app);
+	    return OUT_OF_EEPROM_ERROR;
+	}
+    }
+
+    app->exists = true;
+    app->aid = aid;
+    app->key_settings = cmd[4];
+    app->key_count = key_count;
+    app->crypto = crypto;
+    app->iso_file_identifiers = cmd[5] & 0x20;
+    if (len > 6) {
+	app->has_iso_file_id = true;
+	app->iso_file_id = iso_file_id;
+	app->df_name_len = df_name_len;
+	memcpy(app->df_name, cmd + 8, df_name_len);
+    }
+
+    return OPERATION_OK;
+}
+
+static struct desfire_application *
+lookup_application(struct mifare_desfire_emulator *emu, uint32_t aid)
+{
+    for (int i = 0; i < MAX_APPLICATION_COUNT; i++) {
+	if (emu->applications[i].exists && emu->applications[i].aid == aid)
+	    return &emu->applications[i];
+    }
+    return NULL;
+}
+
+static uint8_t
+delete_application(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    if (len != 4)
+	return LENGTH_ERROR;
+
+    struct desfire_application *app;
+    if (!(app = lookup_application(emu, get_le24(cmd + 1))))
+	return APPLICATION_NOT_FOUND;
+
+    if (!authenticated_with(emu, 0) || ((emu->selected != &emu->picc) && (emu->selected != app)))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    application_wipe(app);
+
+    if (emu->selected == app) {
+	emu->selected = &emu->picc;
+	reset_authentication(emu);
+	emu->response_secured = true;
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_application_ids(struct mifare_desfire_emulator *emu)
+{
+    if (emu->selected != &emu->picc)
+	return PERMISSION_ERROR;
+    if (!listing_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    for (int i = 0; i < MAX_APPLICATION_COUNT; i++) {
+	if (emu->applications[i].exists) {
+	    uint8_t aid[3];
+	    put_le24(aid, emu->applications[i].aid);
+	    response_append(emu, aid, sizeof(aid));
+	}
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_df_names(struct mifare_desfire_emulator *emu)
+{
+    if (emu->selected != &emu->picc)
+	return PERMISSION_ERROR;
+    if (!listing_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    /* One application per frame */
+    for (int i = 0; i < MAX_APPLICATION_COUNT; i++) {
+	struct desfire_application *app = &emu->applications[i];
+	if (app->exists && app->has_iso_file_id) {
+	    uint8_t header[5];
+	    put_le24(header, app->aid);
+	    header[3] = app->iso_file_id;
+	    header[4] = app->iso_file_id >> 8;
+	    response_append(emu, header, sizeof(header));
+	    response_append(emu, app->df_name, app->df_name_len);
+	    response_frame(emu, sizeof(header) + app->df_name_len);
+	}
+    }
+    emu->response_secured = true;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+select_application(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    if (len != 4)
+	return LENGTH_ERROR;
+
+    uint32_t aid = get_le24(cmd + 1);
+    struct desfire_application *app = &emu->picc;
+    if (aid && !(app = lookup_application(emu, aid)))
+	return APPLICATION_NOT_FOUND;
+
+    select_picc(emu);
+    emu->selected = app;
+    emu->response_secured = true;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+format_picc(struct mifare_desfire_emulator *emu)
+{
+    if ((emu->selected != &emu->picc) || !authenticated_with(emu, 0))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+    if (emu->configuration & 0x01)
+	return PERMISSION_ERROR;
+
+    for (int i = 0; i < MAX_APPLICATION_COUNT; i++) {
+	if (emu->applications[i].exists)
+	    application_wipe(&emu->applications[i]);
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+free_mem(struct mifare_desfire_emulator *emu)
+{
+    uint8_t data[3];
+    put_le24(data, PICC_CAPACITY - used_memory(emu));
+    response_append(emu, data, sizeof(data));
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+set_configuration(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    uint8_t status;
+
+    if ((emu->selected != &emu->picc) || !authenticated_with(emu, 0))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+    if (len < 3)
+	return LENGTH_ERROR;
+
+    switch (cmd[1]) {
+    case 0x00:
+	if ((status = unsecure_command(emu, cmd, &len, 2, 1, MDCM_ENCIPHERED)))
+	    return status;
+	emu->configuration = cmd[2];
+	break;
+    case 0x01:
+	if ((status = unsecure_command(emu, cmd, &len, 2, 25, MDCM_ENCIPHERED)))
+	    return status;
+	memcpy(emu->default_key, cmd + 2, 24);
+	emu->default_key_version = cmd[26];
+	break;
+    case 0x02:
+	/* The ATS is followed by its CRC and 0x80 padding */
+	decipher_command(emu, cmd + 2, len - 2);
+	if ((cmd[2] < 1) || (cmd[2] > sizeof(emu->ats)) || (2 + cmd[2] + crc_length(emu) >= len))
+	    return LENGTH_ERROR;
+	if (!crc_verified(emu, cmd, 2, cmd[2]) || (0x80 != cmd[2 + cmd[2] + crc_length(emu)]))
+	    return INTEGRITY_ERROR;
+	memcpy(emu->ats, cmd + 2, cmd[2]);
+	break;
+    default:
+	return PARAMETER_ERROR;
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_card_uid(struct mifare_desfire_emulator *emu)
+{
+    if (!emu->session_key)
+	return AUTHENTICATION_ERROR;
+
+    response_append(emu, emu->uid, sizeof(emu->uid));
+    secure_response(emu, MDCM_ENCIPHERED);
+
+    return OPERATION_OK;
+}
+
+/*
+ * Application level commands.
+ */
+
+static uint8_t
+get_file_ids(struct mifare_desfire_emulator *emu)
+{
+    if (emu->selected == &emu->picc)
+	return PERMISSION_ERROR;
+    if (!listing_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    for (uint8_t i = 0; i < MAX_FILE_COUNT; i++) {
+	if (emu->selected->files[i].exists)
+	    response_append(emu, &i, 1);
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_iso_file_ids(struct mifare_desfire_emulator *emu)
+{
+    if (emu->selected == &emu->picc)
+	return PERMISSION_ERROR;
+    if (!listing_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    for (int i = 0; i < MAX_FILE_COUNT; i++) {
+	struct desfire_file *file = &emu->selected->files[i];
+	if (file->exists && file->has_iso_file_id) {
+	    uint8_t fid[2] = { file->iso_file_id, file->iso_file_id >> 8 };
+	    response_append(emu, fid, sizeof(fid));
+	}
+    }
+    emu->response_secured = true;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_file_settings(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+
+    if (len != 2)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+    if (!listing_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    uint8_t data[17];
+    size_t n = 4;
+    data[0] = file->type;
+    data[1] = file->communication_settings;
+    data[2] = file->access_rights;
+    data[3] = file->access_rights >> 8;
+
+    switch (file->type) {
+    case MDFT_STANDARD_DATA_FILE:
+    case MDFT_BACKUP_DATA_FILE:
+	put_le24(data + n, file->file_size);
+	n += 3;
+	break;
+    case MDFT_VALUE_FILE_WITH_BACKUP:
+	put_le32(data + n, file->lower_limit);
+	put_le32(data + n + 4, file->upper_limit);
+	put_le32(data + n + 8, file->limited_credit_value);
+	data[n + 12] = file->limited_credit_enabled;
+	n += 13;
+	break;
+    case MDFT_LINEAR_RECORD_FILE_WITH_BACKUP:
+    case MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP:
+	put_le24(data + n, file->record_size);
+	put_le24(data + n + 3, file->max_number_of_records);
+	put_le24(data + n + 6, file->current_number_of_records);
+	n += 9;
+	break;
+    }
+    response_append(emu, data, n);
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+change_file_settings(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+    uint8_t mac[MAX_CRYPTO_BLOCK_SIZE];
+
+    if (len < 2)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+
+    uint8_t change_ar = MDAR_CHANGE_AR(file->access_rights);
+    if (MDAR_FREE == change_ar) {
+	if (len != 5)
+	    return LENGTH_ERROR;
+	if (emu->session_key && (AS_NEW == emu->authentication_scheme))
+	    cmac(emu->session_key, emu->ivect, cmd, len, mac);
+    } else if (MDAR_DENY == change_ar) {
+	return PERMISSION_ERROR;
+    } else {
+	if (!authenticated_with(emu, change_ar))
+	    return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+	if ((status = unsecure_command(emu, cmd, &len, 2, 3, MDCM_ENCIPHERED)))
+	    return status;
+    }
+
+    if ((cmd[2] & 0x03) == 0x02)
+	return PARAMETER_ERROR;
+
+    file->communication_settings = cmd[2] & 0x03;
+    file->access_rights = cmd[3] | (cmd[4] << 8);
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+create_file(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_application *app = emu->selected;
+
+    if (app == &emu->picc)
+	return PERMISSION_ERROR;
+    if (!create_delete_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+    if (len < 2)
+	return LENGTH_ERROR;
+    if (cmd[1] >= MAX_FILE_COUNT)
+	return PARAMETER_ERROR;
+
+    size_t base_len;
+    switch (cmd[0]) {
+    case 0xCD:
+    case 0xCB:
+	base_len = 8;
+	break;
+    case 0xCC:
+	base_len = 18;
+	break;
+    default:
+	base_len = 11;
+	break;
+    }
+
+    bool has_iso_file_id = false;
+    size_t n = 2;
+    if ((0xCC != cmd[0]) && (len == base_len + 2)) {
+	if (!app->iso_file_identifiers)
+	    return PARAMETER_ERROR;
+	has_iso_file_id = true;
+	n += 2;
+    } else if (len != base_len) {
+	return LENGTH_ERROR;
+    }
+
+    struct desfire_file *file = &app->files[cmd[1]];
+    if (file->exists)
+	return DUPLICATE_ERROR;
+    if (has_iso_file_id) {
+	for (int i = 0; i < MAX_FILE_COUNT; i++) {
+	    if (app->files[i].exists && app->files[i].has_iso_file_id && (app->files[i].iso_file_id == (cmd[2] | (cmd[3] << 8))))
+		return DUPLICATE_ERROR;
+	}
+    }
+    if ((cmd[n] & 0x03) == 0x02)
+	return PARAMETER_ERROR;
+
+    struct desfire_file f;
+    memset(&f, 0, sizeof(f));
+    f.exists = true;
+    f.has_iso_file_id = has_iso_file_id;
+    if (has_iso_file_id)
+	f.iso_file_id = cmd[2] | (cmd[3] << 8);
+    f.communication_settings = cmd[n] & 0x03;
+    f.access_rights = cmd[n + 1] | (cmd[n + 2] << 8);
+    n += 3;
+
+    size_t allocated;
+    switch (cmd[0]) {
+    case 0xCD:
+    case 0xCB:
+	f.type = (0xCD == cmd[0]) ? MDFT_STANDARD_DATA_FILE : MDFT_BACKUP_DATA_FILE;
+	f.file_size = get_le24(cmd + n);
+	allocated = f.file_size * ((MDFT_BACKUP_DATA_FILE == f.type) ? 2 : 1);
+	break;
+    case 0xCC:
+	f.type = MDFT_VALUE_FILE_WITH_BACKUP;
+	f.lower_limit = get_le32(cmd + n);
+	f.upper_limit = get_le32(cmd + n + 4);
+	f.value = f.pending_value = get_le32(cmd + n + 8);
+	f.limited_credit_enabled = cmd[n + 12];
+	if ((f.lower_limit > f.upper_limit) || (f.value < f.lower_limit) || (f.value > f.upper_limit))
+	    return BOUNDARY_ERROR;
+	allocated = PICC_BLOCK_SIZE;
+	break;
+    default:
+	f.type = (0xC1 == cmd[0]) ? MDFT_LINEAR_RECORD_FILE_WITH_BACKUP : MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP;
+	f.record_size = get_le24(cmd + n);
+	f.max_number_of_records = get_le24(cmd + n + 3);
+	if (!f.record_size || !f.max_number_of_records)
+	    return PARAMETER_ERROR;
+	if ((MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP == f.type) && (f.max_number_of_records < 2))
+	    return PARAMETER_ERROR;
+	f.file_size = f.record_size * f.max_number_of_records;
+	allocated = f.file_size;
+	break;
+    }
+
+    if (used_memory(emu) + padded_data_length(allocated, PICC_BLOCK_SIZE) > PICC_CAPACITY)
+	return OUT_OF_EEPROM_ERROR;
+
+    if (MDFT_VALUE_FILE_WITH_BACKUP != f.type) {
+	if (!(f.data = calloc(1, f.file_size ? f.file_size : 1)))
+	    return OUT_OF_EEPROM_ERROR;
+    }
+
+    *file = f;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+delete_file(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+
+    if (len != 2)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+    if (!create_delete_allowed(emu))
+	return emu->session_key ? PERMISSION_ERROR : AUTHENTICATION_ERROR;
+
+    free(file->data);
+    free(file->backup);
+    free(file->pending_record);
+    memset(file, 0, sizeof(*file));
+
+    return OPERATION_OK;
+}
+
+/*
+ * Data manipulation commands.
+ */
+
+static uint8_t
+read_data(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+    int mode;
+
+    if (len != 8)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+
+    uint32_t offset = get_le24(cmd + 2);
+    uint32_t length = get_le24(cmd + 5);
+
+    const uint8_t rights[] = { MDAR_READ(file->access_rights), MDAR_READ_WRITE(file->access_rights) };
+
+    if (0xBD == cmd[0]) {
+	if ((MDFT_STANDARD_DATA_FILE != file->type) && (MDFT_BACKUP_DATA_FILE != file->type))
+	    return PARAMETER_ERROR;
+	if ((status = file_access(emu, file, rights, 2, &mode)))
+	    return status;
+	if (offset > file->file_size)
+	    return BOUNDARY_ERROR;
+	if (!length)
+	    length = file->file_size - offset;
+	if ((uint64_t)offset + length > file->file_size)
+	    return BOUNDARY_ERROR;
+	response_append(emu, file->data + offset, length);
+    } else {
+	if ((MDFT_LINEAR_RECORD_FILE_WITH_BACKUP != file->type) && (MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP != file->type))
+	    return PARAMETER_ERROR;
+	if ((status = file_access(emu, file, rights, 2, &mode)))
+	    return status;
+	/* Records offset are counted from the latest one */
+	if (offset >= file->current_number_of_records)
+	    return BOUNDARY_ERROR;
+	if (!length)
+	    length = file->current_number_of_records - offset;
+	if ((uint64_t)offset + length > file->current_number_of_records)
+	    return BOUNDARY_ERROR;
+	uint32_t first = file->current_number_of_records - offset - length;
+	for (uint32_t r = first; r < first + length; r++) {
+	    uint32_t slot = (file->first_record + r) % file->max_number_of_records;
+	    response_append(emu, file->data + slot * file->record_size, file->record_size);
+	}
+    }
+
+    if (secure_response(emu, mode) < 0)
+	return OUT_OF_EEPROM_ERROR;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+write_data(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+    int mode;
+
+    if (len < 8)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+
+    uint32_t offset = get_le24(cmd + 2);
+    uint32_t length = get_le24(cmd + 5);
+
+    const uint8_t rights[] = { MDAR_WRITE(file->access_rights), MDAR_READ_WRITE(file->access_rights) };
+
+    if (0x3D == cmd[0]) {
+	if ((MDFT_STANDARD_DATA_FILE != file->type) && (MDFT_BACKUP_DATA_FILE != file->type))
+	    return PARAMETER_ERROR;
+	if ((uint64_t)offset + length > file->file_size)
+	    return BOUNDARY_ERROR;
+    } else {
+	if ((MDFT_LINEAR_RECORD_FILE_WITH_BACKUP != file->type) && (MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP != file->type))
+	    return PARAMETER_ERROR;
+	if ((uint64_t)offset + length > file->record_size)
+	    return BOUNDARY_ERROR;
+    }
+    if ((status = file_access(emu, file, rights, 2, &mode)))
+	return status;
+
+    /* Wait for the whole command before processing it */
+    size_t expected = secured_length(emu, 8, length, mode);
+    if (len < expected)
+	return ADDITIONAL_FRAME;
+
+    if ((status = unsecure_command(emu, cmd, &len, 8, length, mode)))
+	return status;
+
+    if (0x3D == cmd[0]) {
+	uint8_t *data = file->data;
+	if (MDFT_BACKUP_DATA_FILE == file->type) {
+	    if (!file->backup && !(file->backup = memdup(file->data, file->file_size ? file->file_size : 1)))
+		return OUT_OF_EEPROM_ERROR;
+	    data = file->backup;
+	    file->dirty = true;
+	}
+	memcpy(data + offset, cmd + 8, length);
+    } else {
+	/* A record file cleared in the current transaction is read-only */
+	if (file->pending_clear)
+	    return PERMISSION_ERROR;
+	if (!file->pending_record) {
+	    if ((MDFT_LINEAR_RECORD_FILE_WITH_BACKUP == file->type) &&
+		(file->current_number_of_records == file->max_number_of_records))
+		return BOUNDARY_ERROR;
+	    if (!(file->pending_record = calloc(1, file->record_size)))
+		return OUT_OF_EEPROM_ERROR;
+	}
+	memcpy(file->pending_record + offset, cmd + 8, length);
+	file->dirty = true;
+    }
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+get_value(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+    int mode;
+
+    if (len != 2)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+    if (MDFT_VALUE_FILE_WITH_BACKUP != file->type)
+	return PARAMETER_ERROR;
+
+    const uint8_t rights[] = { MDAR_READ(file->access_rights), MDAR_WRITE(file->access_rights), MDAR_READ_WRITE(file->access_rights) };
+    if ((status = file_access(emu, file, rights, 3, &mode)))
+	return status;
+
+    uint8_t data[4];
+    put_le32(data, file->value);
+    response_append(emu, data, sizeof(data));
+
+    if (secure_response(emu, mode) < 0)
+	return OUT_OF_EEPROM_ERROR;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+change_value(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+    int mode;
+
+    if (len < 2)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+    if (MDFT_VALUE_FILE_WITH_BACKUP != file->type)
+	return PARAMETER_ERROR;
+
+    uint8_t rights[3];
+    size_t n = 0;
+    switch (cmd[0]) {
+    case 0x0C:
+	rights[n++] = MDAR_READ_WRITE(file->access_rights);
+	break;
+    case 0xDC:
+	rights[n++] = MDAR_READ(file->access_rights);
+	rights[n++] = MDAR_WRITE(file->access_rights);
+	rights[n++] = MDAR_READ_WRITE(file->access_rights);
+	break;
+    case 0x1C:
+	rights[n++] = MDAR_WRITE(file->access_rights);
+	rights[n++] = MDAR_READ_WRITE(file->access_rights);
+	break;
+    }
+    if ((status = file_access(emu, file, rights, n, &mode)))
+	return status;
+    if ((status = unsecure_command(emu, cmd, &len, 2, 4, mode)))
+	return status;
+
+    int32_t amount = get_le32(cmd + 2);
+    if (amount < 0)
+	return PARAMETER_ERROR;
+
+    int64_t value = file->pending_value;
+    switch (cmd[0]) {
+    case 0x0C:
+	value += amount;
+	break;
+    case 0xDC:
+	value -= amount;
+	break;
+    case 0x1C:
+	if (!(file->limited_credit_enabled & 0x01) || (amount > file->limited_credit_value))
+	    return PERMISSION_ERROR;
+	value += amount;
+	break;
+    }
+    if ((value < file->lower_limit) || (value > file->upper_limit))
+	return BOUNDARY_ERROR;
+
+    if (0xDC == cmd[0])
+	file->pending_debit += amount;
+    else if (0x1C == cmd[0])
+	file->limited_credit_value = 0;
+    file->pending_value = value;
+    file->dirty = true;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+clear_record_file(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    struct desfire_file *file;
+    uint8_t status;
+    int mode;
+
+    if (len != 2)
+	return LENGTH_ERROR;
+    if (!(file = lookup_file(emu, cmd[1], &status)))
+	return status;
+    if ((MDFT_LINEAR_RECORD_FILE_WITH_BACKUP != file->type) && (MDFT_CYCLIC_RECORD_FILE_WITH_BACKUP != file->type))
+	return PARAMETER_ERROR;
+
+    const uint8_t rights[] = { MDAR_READ_WRITE(file->access_rights) };
+    if ((status = file_access(emu, file, rights, 1, &mode)))
+	return status;
+
+    free(file->pending_record);
+    file->pending_record = NULL;
+    file->pending_clear = true;
+    file->dirty = true;
+
+    return OPERATION_OK;
+}
+
+static uint8_t
+transaction(struct mifare_desfire_emulator *emu, bool commit)
+{
+    if (emu->selected == &emu->picc)
+	return PERMISSION_ERROR;
+
+    application_transaction(emu->selected, commit);
+
+    return OPERATION_OK;
+}
+
+/*
+ * Process a complete native command.
+ */
+static uint8_t
+dispatch(struct mifare_desfire_emulator *emu, uint8_t *cmd, size_t len)
+{
+    uint8_t mac[MAX_CRYPTO_BLOCK_SIZE];
+
+    switch (cmd[0]) {
+    case 0x0A:
+    case 0x1A:
+    case 0xAA:
+	return authenticate_step1(emu, cmd, len);
+    case 0x54:
+    case 0xC4:
+    case 0x5C:
+    case 0x5F:
+    case 0x3D:
+    case 0x3B:
+    case 0x0C:
+    case 0xDC:
+    case 0x1C:
+	/* These commands take care of their own secure messaging */
+	break;
+    default:
+	if (emu->session_key && (AS_NEW == emu->authentication_scheme))
+	    cmac(emu->session_key, emu->ivect, cmd, len, mac);
+	break;
+    }
+
+    switch (cmd[0]) {
+    case 0x60:
+	return get_version(emu);
+    case 0x45:
+	return get_key_settings(emu);
+    case 0x54:
+	return change_key_settings(emu, cmd, len);
+    case 0x64:
+	return get_key_version(emu, cmd, len);
+    case 0xC4:
+	return change_key(emu, cmd, len);
+    case 0xCA:
+	return create_application(emu, cmd, len);
+    case 0xDA:
+	return delete_application(emu, cmd, len);
+    case 0x6A:
+	return get_application_ids(emu);
+    case 0x6D:
+	return get_df_names(emu);
+    case 0x5A:
+	return select_application(emu, cmd, len);
+    case 0xFC:
+	return format_picc(emu);
+    case 0x6E:
+	return free_mem(emu);
+    case 0x5C:
+	return set_configuration(emu, cmd, len);
+    case 0x51:
+	return get_card_uid(emu);
+    case 0x6F:
+	return get_file_ids(emu);
+    case 0x61:
+	return get_iso_file_ids(emu);
+    case 0xF5:
+	return get_file_settings(emu, cmd, len);
+    case 0x5F:
+	return change_file_settings(emu, cmd, len);
+    case 0xCD:
+    case 0xCB:
+    case 0xCC:
+    case 0xC1:
+    case 0xC0:
+	return create_file(emu, cmd, len);
+    case 0xDF:
+	return delete_file(emu, cmd, len);
+    case 0xBD:
+    case 0xBB:
+	return read_data(emu, cmd, len);
+    case 0x3D:
+    case 0x3B:
+	return write_data(emu, cmd, len);
+    case 0x6C:
+	return get_value(emu, cmd, len);
+    case 0x0C:
+    case 0xDC:
+    case 0x1C:
+	return change_value(emu, cmd, len);
+    case 0xEB:
+	return clear_record_file(emu, cmd, len);
+    case 0xC7:
+	return transaction(emu, true);
+    case 0xA7:
+	return transaction(emu, false);
+    default:
+	return ILLEGAL_COMMAND_CODE;
+    }
+}
+
+/*
+ * Copy the next response frame to rx, wrapped in a ISO 7816-4 trailer.
+ */
+static int
+send_frame(struct mifare_desfire_emulator *emu, uint8_t *rx, size_t rx_len)
+{
+    size_t remaining = emu->response_length - emu->response_offset;
+    size_t n = FRAME_SIZE;
+
+    if (emu->frame_index < emu->frame_count)
+	n = emu->frames[emu->frame_index++];
+    n = MIN(n, remaining);
+
+    uint8_t status = (n < remaining) ? ADDITIONAL_FRAME : emu->response_status;
+
+    if (n + 2 > rx_len)
+	return NFC_EOVFLOW;
+
+    if (n)
+	memcpy(rx, emu->response + emu->response_offset, n);
+    rx[n] = 0x91;
+    rx[n + 1] = status;
+    emu->response_offset += n;
+
+    if (ADDITIONAL_FRAME != status)
+	emu->response_offset = emu->response_length = 0;
+
+    return n + 2;
+}
+
+static bool
+response_pending(const struct mifare_desfire_emulator *emu)
+{
+    return emu->response_offset < emu->response_length;
+}
+
+static int
+iso_select(struct mifare_desfire_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    static const uint8_t DESFIRE_DF_NAME[] = { 0xd2, 0x76, 0x00, 0x00, 0x85, 0x01, 0x00 };
+
+    if (rx_len < 2)
+	return NFC_EOVFLOW;
+
+    if ((tx_len >= 5 + sizeof(DESFIRE_DF_NAME)) && (tx[2] == 0x04) && (tx[4] == sizeof(DESFIRE_DF_NAME)) &&
+	(0 == memcmp(tx + 5, DESFIRE_DF_NAME, sizeof(DESFIRE_DF_NAME)))) {
+	select_picc(emu);
+	rx[0] = 0x90;
+	rx[1] = 0x00;
+    } else {
+	/* File or application not found */
+	rx[0] = 0x6A;
+	rx[1] = 0x82;
+    }
+
+    return 2;
+}
+
+int
+mifare_desfire_emulator_transceive(struct mifare_desfire_emulator *emu, const uint8_t *tx, size_t tx_len, uint8_t *rx, size_t rx_len)
+{
+    if ((tx_len >= 2) && (0x00 == tx[0]) && (0xA4 == tx[1]))
+	return iso_select(emu, tx, tx_len, rx, rx_len);
+
+    if ((tx_len < 5) || (0x90 != tx[0]))
+	return NFC_ERFTRANS;
+
+    /* Unwrap the native command */
+    size_t lc = (tx_len > 5) ? tx[4] : 0;
+    if (5 + lc > tx_len)
+	return NFC_ERFTRANS;
+
+    uint8_t frame[1 + 255];
+    frame[0] = tx[1];
+    memcpy(frame + 1, tx + 5, lc);
+    size_t len = 1 + lc;
+
+    uint8_t status;
+    if (ADDITIONAL_FRAME == frame[0] && response_pending(emu)) {
+	return send_frame(emu, rx, rx_len);
+    } else if (ADDITIONAL_FRAME == frame[0] && (NO_KEY != emu->authentication_key_no)) {
+	emu->response_length = emu->response_offset = 0;
+	emu->frame_count = emu->frame_index = 0;
+	status = authenticate_step2(emu, frame, len);
+    } else if (ADDITIONAL_FRAME == frame[0] && emu->receiving) {
+	if (reserve(&emu->command, &emu->command_size, emu->command_length + lc) < 0)
+	    return NFC_ESOFT;
+	memcpy(emu->command + emu->command_length, frame + 1, lc);
+	emu->command_length += lc;
+	emu->response_length = emu->response_offset = 0;
+	emu->frame_count = emu->frame_index = 0;
+	emu->response_secured = false;
+	status = dispatch(emu, emu->command, emu->command_length);
+    } else {
+	emu->authentication_key_no = NO_KEY;
+	emu->receiving = false;
+	emu->response_length = emu->response_offset = 0;
+	emu->frame_count = emu->frame_index = 0;
+	emu->response_secured = false;
+	if (ADDITIONAL_FRAME == frame[0]) {
+	    status = ILLEGAL_COMMAND_CODE;
+	} else {
+	    status = dispatch(emu, frame, len);
+	    if ((ADDITIONAL_FRAME == status) && ((0x3D == frame[0]) || (0x3B == frame[0]))) {
+		if (reserve(&emu->command, &emu->command_size, len) < 0)
+		    return NFC_ESOFT;
+		memcpy(emu->command, frame, len);
+		emu->command_length = len;
+		emu->receiving = true;
+	    }
+	}
+    }
+
+    if (ADDITIONAL_FRAME != status)
+	emu->receiving = false;
+
+    if ((OPERATION_OK != status) && (ADDITIONAL_FRAME != status)) {
+	/* Any error aborts the current transaction */
+	application_transaction(emu->selected, false);
+	emu->response_length = emu->response_offset = 0;
+	emu->frame_count = emu->frame_index = 0;
+    } else if ((OPERATION_OK == status) && !emu->response_secured) {
+	if (secure_response(emu, MDCM_PLAIN) < 0)
+	    return NFC_ESOFT;
+    }
+
+    emu->response_status = status;
+    emu->response_offset = 0;
+
+    return send_frame(emu, rx, rx_len);
+}
+
+/*
+ * Reset the PICC state as after a new activation.
+ */
+void
+mifare_desfire_emulator_reset(struct mifare_desfire_emulator *emu)
+{
+    emu->selected = NULL;
+    select_picc(emu);
+    emu->receiving = false;
+    emu->response_length = emu->response_offset = 0;
+    emu->frame_count = emu->frame_index = 0;
+}
+
+const uint8_t *
+mifare_desfire_emulator_get_ats(struct mifare_desfire_emulator *emu, size_t *ats_len)
+{
+    *ats_len = emu->ats[0] - 1;
+    return emu->ats + 1;
+}
+
+struct mifare_desfire_emulator *
+mifare_desfire_emulator_new(const uint8_t uid[7])
+{
+    struct mifare_desfire_emulator *emu;
+    uint8_t key_data[24];
+
+    if (!(emu = calloc(1, sizeof(*emu))))
+	return NULL;
+
+    memcpy(emu->uid, uid, sizeof(emu->uid));
+    emu->ats[0] = sizeof(DESFIRE_ATS) + 1;
+    memcpy(emu->ats + 1, DESFIRE_ATS, sizeof(DESFIRE_ATS));
+
+    memset(key_data, 0, sizeof(key_data));
+    emu->picc.exists = true;
+    emu->picc.key_settings = 0x0F;
+    emu->picc.key_count = 1;
+    emu->picc.crypto = APPLICATION_CRYPTO_DES;
+    if (!(emu->picc.keys[0] = key_new(APPLICATION_CRYPTO_DES, key_data, 0))) {
+	free(emu);
+	return NULL;
+    }
+
+    mifare_desfire_emulator_reset(emu);
+
+    return emu;
+}
+
+void
+mifare_desfire_emulator_free(struct mifare_desfire_emulator *emu)
+{
+    if (!emu)
+	return;
+
+    reset_authentication(emu);
+    application_wipe(&emu->picc);
+    for (int i = 0; i < MAX_APPLICATION_COUNT; i++)
+	application_wipe(&emu->applications[i]);
+    free(emu->command);
+    free(emu->response);
+    free(emu);
+}
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <openssl/aes.h>
 #include <openssl/des.h>
 
 #include <freefare.h>
@@ -11,11 +12,18 @@ static inline void update_key_schedules(MifareDESFireKey key);
 static inline void
 update_key_schedules(MifareDESFireKey key)
 {
-    DES_set_key((DES_cblock *)key->data, &(key->ks1));
-    DES_set_key((DES_cblock *)(key->data + 8), &(key->ks2));
-    if (MIFARE_KEY_3K3DES == key->type) {
-	DES_set_key((DES_cblock *)(key->data + 16), &(key->ks3));
+    if (MIFARE_KEY_AES128 == key->type) {
+	AES_set_encrypt_key(key->data, 8 * 16, &(key->aes_ks_encypher));
+	AES_set_decrypt_key(key->data, 8 * 16, &(key->aes_ks_decypher));
+    } else {
+	DES_set_key((DES_cblock *)key->data, &(key->ks1));
+	DES_set_key((DES_cblock *)(key->data + 8), &(key->ks2));
+	if (MIFARE_KEY_3K3DES == key->type) {
+	    DES_set_key((DES_cblock *)(key->data + 16), &(key->ks3));
+	}
     }
+
+    cmac_generate_subkeys(key);
 }
 
 MifareDESFireKey
@@ -105,6 +113,7 @@ mifare_desfire_aes_key_new_with_version(const uint8_t value[16], uint8_t version
 	memcpy(key->data, value, 16);
 	key->type = MIFARE_KEY_AES128;
 	key->aes_version = version;
+	update_key_schedules(key);
     }
     return key;
 }
@@ -170,22 +179,37 @@ mifare_desfire_key_set_version(MifareDESFireKey key, uint8_t version)
 MifareDESFireKey
 mifare_desfire_session_key_new(const uint8_t rnda[], const uint8_t rndb[], MifareDESFireKey authentication_key)
 {
-    MifareDESFireKey key = NULL;
+    MifareDESFireKey key;
 
+    if ((key = malloc(sizeof(struct mifare_desfire_key))))
+	mifare_desfire_session_key_init(key, rnda, rndb, authentication_key);
+    return key;
+}
+
+/*
+ * Set key to the session key negotiated with authentication_key, reusing the
+ * storage of key.
+ */
+void
+mifare_desfire_session_key_init(MifareDESFireKey key, const uint8_t rnda[], const uint8_t rndb[], MifareDESFireKey authentication_key)
+{
     uint8_t buffer[24];
 
+    key->type = authentication_key->type;
+
     switch (authentication_key->type) {
     case MIFARE_KEY_DES:
 	memcpy(buffer, rnda, 4);
 	memcpy(buffer + 4, rndb, 4);
-	key = mifare_desfire_des_key_new_with_version(buffer);
+	memcpy(key->data, buffer, 8);
+	memcpy(key->data + 8, buffer, 8);
 	break;
     case MIFARE_KEY_2K3DES:
 	memcpy(buffer, rnda, 4);
 	memcpy(buffer + 4, rndb, 4);
 	memcpy(buffer + 8, rnda + 4, 4);
 	memcpy(buffer + 12, rndb + 4, 4);
-	key = mifare_desfire_3des_key_new_with_version(buffer);
+	memcpy(key->data, buffer, 16);
 	break;
     case MIFARE_KEY_3K3DES:
 	memcpy(buffer, rnda, 4);
@@ -194,18 +218,36 @@ mifare_desfire_session_key_new(const uint8_t rnda[], const uint8_t rndb[], Mifar
 	memcpy(buffer + 12, rndb + 6, 4);
 	memcpy(buffer + 16, rnda + 12, 4);
 	memcpy(buffer + 20, rndb + 12, 4);
-	key = mifare_desfire_3k3des_key_new(buffer);
+	for (int n = 0; n < 8; n++)
+	    buffer[n] &= 0xfe;
+	memcpy(key->data, buffer, 24);
 	break;
     case MIFARE_KEY_AES128:
 	memcpy(buffer, rnda, 4);
 	memcpy(buffer + 4, rndb, 4);
 	memcpy(buffer + 8, rnda + 12, 4);
 	memcpy(buffer + 12, rndb + 12, 4);
-	key = mifare_desfire_aes_key_new(buffer);
+	memcpy(key->data, buffer, 16);
+	key->aes_version = 0;
 	break;
     }
 
-    return key;
+    update_key_schedules(key);
+
+    memset(buffer, 0, sizeof(buffer));
+}
+
+/*
+ * Duplicate key, including its key schedules.
+ */
+MifareDESFireKey
+mifare_desfire_key_copy(MifareDESFireKey key)
+{
+    MifareDESFireKey copy;
+
+    if ((copy = malloc(sizeof(struct mifare_desfire_key))))
+	memcpy(copy, key, sizeof(*copy));
+    return copy;
 }
 
 void
@@ -1,8 +1,18 @@
+#if defined(HAVE_CONFIG_H)
+    #include "config.h"
+#endif
+
+#if defined(HAVE_PTHREAD_H)
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include <openssl/des.h>
+#include <openssl/evp.h>
 
 #include <freefare.h>
 #include "freefare_internal.h"
@@ -58,6 +68,7 @@ mifare_key_deriver_new_an10922(MifareDESFireKey master_key, MifareKeyType output
 	deriver->output_key_type = output_key_type;
 	cmac_generate_subkeys(deriver->master_key);
 	deriver->flags = flags;
+	deriver->cache = NULL;
     }
 
     return deriver;
@@ -70,6 +81,234 @@ mifare_key_deriver_free(MifareKeyDeriver deriver)
     free(deriver);
 }
 
+void
+mifare_key_deriver_set_cache(MifareKeyDeriver deriver, MifareKeyCache cache)
+{
+    deriver->cache = cache;
+}
+
+MifareKeyCache
+mifare_key_cache_new(size_t capacity)
+{
+    MifareKeyCache cache;
+    size_t buckets = 1;
+
+    if (!capacity) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    while (buckets < capacity)
+	buckets <<= 1;
+
+    if (!(cache = malloc(sizeof(*cache))))
+	return NULL;
+
+    cache->capacity = capacity;
+    cache->count = 0;
+    cache->buckets_mask = buckets - 1;
+    cache->entries = calloc(capacity, sizeof(*cache->entries));
+    cache->buckets = calloc(buckets, sizeof(*cache->buckets));
+    cache->lru_first = NULL;
+    cache->lru_last = NULL;
+    cache->hits = 0;
+    cache->misses = 0;
+
+    if (!cache->entries || !cache->buckets) {
+	free(cache->entries);
+	free(cache->buckets);
+	free(cache);
+	errno = ENOMEM;
+	return NULL;
+    }
+
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_init(&cache->mutex, NULL);
+#endif
+
+    return cache;
+}
+
+void
+mifare_key_cache_free(MifareKeyCache cache)
+{
+    if (!cache)
+	return;
+
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_destroy(&cache->mutex);
+#endif
+
+    // Wipe key info from memory
+    memset(cache->entries, 0, cache->capacity * sizeof(*cache->entries));
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+}
+
+/*
+ * A cache can be shared by key derivers used from several threads.
+ */
+static void
+key_cache_lock(MifareKeyCache cache)
+{
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_lock(&cache->mutex);
+#else
+    (void) cache;
+#endif
+}
+
+static void
+key_cache_unlock(MifareKeyCache cache)
+{
+#if defined(HAVE_PTHREAD_H)
+    pthread_mutex_unlock(&cache->mutex);
+#else
+    (void) cache;
+#endif
+}
+
+void
+mifare_key_cache_get_stats(MifareKeyCache cache, unsigned long *hits, unsigned long *misses)
+{
+    key_cache_lock(cache);
+    if (hits)
+	*hits = cache->hits;
+    if (misses)
+	*misses = cache->misses;
+    key_cache_unlock(cache);
+}
+
+static uint32_t
+fnv1a(uint32_t hash, const void *data, size_t len)
+{
+    for (size_t n = 0; n < len; n++) {
+	hash ^= ((const uint8_t *)data)[n];
+	hash *= 16777619;
+    }
+
+    return hash;
+}
+
+/*
+ * Fill the identity fields of probe with the derivation in progress.
+ */
+static void
+key_cache_probe(MifareKeyDeriver deriver, struct mifare_key_cache_entry *probe)
+{
+    memset(probe, 0, sizeof(*probe));
+    probe->master_key_type = deriver->master_key->type;
+    memcpy(probe->master_key_data, deriver->master_key->data, sizeof(probe->master_key_data));
+    probe->master_key_version = mifare_desfire_key_get_version(deriver->master_key);
+    probe->output_key_type = deriver->output_key_type;
+    probe->flags = deriver->flags;
+    memcpy(probe->m + 1, deriver->m + 1, deriver->len - 1);
+    probe->len = deriver->len;
+
+    uint32_t hash = 2166136261;
+    hash = fnv1a(hash, &probe->master_key_type, sizeof(probe->master_key_type));
+    hash = fnv1a(hash, probe->master_key_data, sizeof(probe->master_key_data));
+    hash = fnv1a(hash, &probe->master_key_version, sizeof(probe->master_key_version));
+    hash = fnv1a(hash, &probe->output_key_type, sizeof(probe->output_key_type));
+    hash = fnv1a(hash, &probe->flags, sizeof(probe->flags));
+    hash = fnv1a(hash, probe->m + 1, probe->len - 1);
+    probe->hash = hash;
+}
+
+static bool
+key_cache_entry_matches(const struct mifare_key_cache_entry *entry, const struct mifare_key_cache_entry *probe)
+{
+    return (entry->hash == probe->hash) &&
+	   (entry->master_key_type == probe->master_key_type) &&
+	   (0 == memcmp(entry->master_key_data, probe->master_key_data, sizeof(probe->master_key_data))) &&
+	   (entry->master_key_version == probe->master_key_version) &&
+	   (entry->output_key_type == probe->output_key_type) &&
+	   (entry->flags == probe->flags) &&
+	   (entry->len == probe->len) &&
+	   (0 == memcmp(entry->m + 1, probe->m + 1, probe->len - 1));
+}
+
+static void
+key_cache_lru_unlink(MifareKeyCache cache, struct mifare_key_cache_entry *entry)
+{
+    if (entry->lru_prev)
+	entry->lru_prev->lru_next = entry->lru_next;
+    else
+	cache->lru_first = entry->lru_next;
+
+    if (entry->lru_next)
+	entry->lru_next->lru_prev = entry->lru_prev;
+    else
+	cache->lru_last = entry->lru_prev;
+}
+
+static void
+key_cache_lru_push(MifareKeyCache cache, struct mifare_key_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_first;
+    if (cache->lru_first)
+	cache->lru_first->lru_prev = entry;
+    else
+	cache->lru_last = entry;
+    cache->lru_first = entry;
+}
+
+static struct mifare_key_cache_entry *
+key_cache_lookup(MifareKeyCache cache, const struct mifare_key_cache_entry *probe)
+{
+    struct mifare_key_cache_entry *entry = cache->buckets[probe->hash & cache->buckets_mask];
+
+    while (entry && !key_cache_entry_matches(entry, probe))
+	entry = entry->bucket_next;
+
+    if (entry) {
+	key_cache_lru_unlink(cache, entry);
+	key_cache_lru_push(cache, entry);
+	cache->hits++;
+    } else {
+	cache->misses++;
+    }
+
+    return entry;
+}
+
+static void
+key_cache_insert(MifareKeyCache cache, const struct mifare_key_cache_entry *probe, MifareDESFireKey key)
+{
+    struct mifare_key_cache_entry *entry = cache->buckets[probe->hash & cache->buckets_mask];
+
+    // Another thread may have derived the same key since the lookup
+    while (entry && !key_cache_entry_matches(entry, probe))
+	entry = entry->bucket_next;
+    if (entry)
+	return;
+
+    if (cache->count < cache->capacity) {
+	entry = &cache->entries[cache->count++];
+    } else {
+	// Evict the least recently used entry
+	entry = cache->lru_last;
+	key_cache_lru_unlink(cache, entry);
+
+	struct mifare_key_cache_entry **p = &cache->buckets[entry->hash & cache->buckets_mask];
+	while (*p != entry)
+	    p = &(*p)->bucket_next;
+	*p = entry->bucket_next;
+
+	// Wipe key info from memory
+	memset(entry, 0, sizeof(*entry));
+    }
+
+    memcpy(entry, probe, sizeof(*entry));
+    memcpy(&entry->key, key, sizeof(entry->key));
+
+    entry->bucket_next = cache->buckets[entry->hash & cache->buckets_mask];
+    cache->buckets[entry->hash & cache->buckets_mask] = entry;
+    key_cache_lru_push(cache, entry);
+}
+
 int
 mifare_key_deriver_begin(MifareKeyDeriver deriver)
 {
@@ -202,6 +441,43 @@ get_key_data_len(MifareDESFireKey key)
     return get_key_type_data_len(key->type);
 }
 
+/*
+ * Fill div with the AN10922 diversification constants whose CMACs make up
+ * the derived key, and return how many there are.
+ */
+static int
+deriver_div_constants(MifareKeyDeriver deriver, uint8_t div[3])
+{
+    const int master_key_block_size = key_block_size(deriver->master_key);
+
+    if ((master_key_block_size == 16) && (deriver->output_key_type == MIFARE_KEY_AES128)) {
+	div[0] = AN10922_DIV_AES128;
+	return 1;
+
+    } else if ((master_key_block_size == 16) && (deriver->output_key_type == MIFARE_KEY_2K3DES)) {
+	// This technically isn't defined in AN10922, but it is
+	// straightforward adaptation that is useful for diversifying
+	// MIFARE Ultralight C keys.
+	div[0] = AN10922_DIV_2K3DES_1;
+	return 1;
+
+    } else if ((master_key_block_size == 8) && (deriver->output_key_type == MIFARE_KEY_2K3DES)) {
+	div[0] = AN10922_DIV_2K3DES_1;
+	div[1] = AN10922_DIV_2K3DES_2;
+	return 2;
+
+    } else if ((master_key_block_size == 8) && (deriver->output_key_type == MIFARE_KEY_3K3DES)) {
+	div[0] = AN10922_DIV_3K3DES_1;
+	div[1] = AN10922_DIV_3K3DES_2;
+	div[2] = AN10922_DIV_3K3DES_3;
+	return 3;
+    }
+
+    // AN10922 doesn't describe how to perform this derivation.
+    errno = EINVAL;
+    return -1;
+}
+
 int
 mifare_key_deriver_end_raw(MifareKeyDeriver deriver, uint8_t* diversified_bytes, size_t max_len)
 {
@@ -228,41 +504,252 @@ mifare_key_deriver_end_raw(MifareKeyDeriver deriver, uint8_t* diversified_bytes,
 
     memset(data, 0, sizeof(data));
 
-    if ((master_key_block_size == 16) && (deriver->output_key_type == MIFARE_KEY_AES128)) {
-	deriver->m[0] = AN10922_DIV_AES128;
-	deriver_cmac(deriver, data);
+    uint8_t div[3];
+    int ndiv = deriver_div_constants(deriver, div);
+    if (ndiv < 0)
+	return -1;
 
-    } else if ((master_key_block_size == 16) && (deriver->output_key_type == MIFARE_KEY_2K3DES)) {
-	// This technically isn't defined in AN10922, but it is
-	// straightforward adaptation that is useful for diversifying
-	// MIFARE Ultralight C keys.
-	deriver->m[0] = AN10922_DIV_2K3DES_1;
-	deriver_cmac(deriver, data);
+    for (int n = 0; n < ndiv; n++) {
+	deriver->m[0] = div[n];
+	deriver_cmac(deriver, data + n * master_key_block_size);
+    }
 
-    } else if ((master_key_block_size == 8) && (deriver->output_key_type == MIFARE_KEY_2K3DES)) {
-	deriver->m[0] = AN10922_DIV_2K3DES_1;
-	deriver_cmac(deriver, data + 0);
-	deriver->m[0] = AN10922_DIV_2K3DES_2;
-	deriver_cmac(deriver, data + 8);
+    memcpy(diversified_bytes, data, max_len);
 
-    } else if ((master_key_block_size == 8) && (deriver->output_key_type == MIFARE_KEY_3K3DES)) {
-	deriver->m[0] = AN10922_DIV_3K3DES_1;
-	deriver_cmac(deriver, data + 0);
-	deriver->m[0] = AN10922_DIV_3K3DES_2;
-	deriver_cmac(deriver, data + 8);
-	deriver->m[0] = AN10922_DIV_3K3DES_3;
-	deriver_cmac(deriver, data + 16);
+    // Wipe key info from stack
+    memset(data, 0, sizeof(data));
 
-    } else {
-	// AN10922 doesn't describe how to perform this derivation.
-	errno = EINVAL;
-	return -1;
+    return len;
+}
+
+/*
+ * Number of diversification inputs MACed together by a batch worker.
+ */
+#define AN10922_BATCH_SIZE 64
+
+struct deriver_batch_job {
+    MifareKeyDeriver deriver;
+    const uint8_t *const *data;
+    const size_t *data_len;
+    size_t first;
+    size_t last;
+    uint8_t *diversified_bytes;
+    const uint8_t *div;
+    int ndiv;
+    int len;
+    int error;
+};
+
+static const EVP_CIPHER *
+key_ecb_cipher(MifareDESFireKey key)
+{
+    switch (key->type) {
+    case MIFARE_KEY_DES:
+	return EVP_des_ecb();
+    case MIFARE_KEY_2K3DES:
+	return EVP_des_ede_ecb();
+    case MIFARE_KEY_3K3DES:
+	return EVP_des_ede3_ecb();
+    case MIFARE_KEY_AES128:
+	return EVP_aes_128_ecb();
     }
 
-    memcpy(diversified_bytes, data, max_len);
+    return NULL;
+}
+
+/*
+ * MAC the inputs of job one at a time, as mifare_key_deriver_end_raw() does.
+ * Used when OpenSSL does not provide the ECB cipher of the master key, which
+ * is the case of single DES with OpenSSL 3 unless the legacy provider is
+ * loaded.
+ */
+static void
+deriver_batch_run_cmac(struct deriver_batch_job *job)
+{
+    MifareDESFireKey key = job->deriver->master_key;
+    const size_t kbs = key_block_size(key);
+    uint8_t m[2 * MAX_CRYPTO_BLOCK_SIZE];
+    uint8_t ivect[MAX_CRYPTO_BLOCK_SIZE];
+
+    for (size_t i = job->first; i < job->last; i++) {
+	memcpy(m + 1, job->data[i], job->data_len[i]);
+
+	for (int d = 0; d < job->ndiv; d++) {
+	    m[0] = job->div[d];
+	    memset(ivect, 0, sizeof(ivect));
+	    cmac_an10922(key, ivect, m, 1 + job->data_len[i], job->diversified_bytes + i * job->len + d * kbs);
+	}
+    }
 
     // Wipe key info from stack
-    memset(data, 0, sizeof(data));
+    memset(m, 0, sizeof(m));
+}
+
+/*
+ * AN10922 always MACs exactly two blocks with a null IV, so the CMAC of a
+ * message M1 || M2 is E(E(M1) ^ M2 ^ subkey).  Rather than chaining each
+ * message on its own, the first blocks of a whole batch of messages are
+ * enciphered in a single ECB pass, and so are the second ones, which lets
+ * the cipher implementation process several independent blocks at once.
+ */
+static void *
+deriver_batch_run(void *arg)
+{
+    struct deriver_batch_job *job = arg;
+    MifareDESFireKey key = job->deriver->master_key;
+    const size_t kbs = key_block_size(key);
+    uint8_t first[AN10922_BATCH_SIZE * 3 * MAX_CRYPTO_BLOCK_SIZE];
+    uint8_t second[AN10922_BATCH_SIZE * 3 * MAX_CRYPTO_BLOCK_SIZE];
+    uint8_t m[2 * MAX_CRYPTO_BLOCK_SIZE];
+    int outl;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) {
+	job->error = ENOMEM;
+	return NULL;
+    }
+    if (!EVP_EncryptInit_ex(ctx, key_ecb_cipher(key), NULL, key->data, NULL)) {
+	EVP_CIPHER_CTX_free(ctx);
+	deriver_batch_run_cmac(job);
+	return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    for (size_t i = job->first; i < job->last; i += AN10922_BATCH_SIZE) {
+	size_t count = MIN(AN10922_BATCH_SIZE, job->last - i);
+	size_t blocks = 0;
+
+	for (size_t n = 0; n < count; n++) {
+	    size_t len = 1 + job->data_len[i + n];
+
+	    memcpy(m + 1, job->data[i + n], len - 1);
+	    if (len < 2 * kbs) {
+		m[len] = 0x80;
+		memset(m + len + 1, 0x00, 2 * kbs - len - 1);
+	    }
+
+	    for (int d = 0; d < job->ndiv; d++) {
+		m[0] = job->div[d];
+		memcpy(first + blocks * kbs, m, kbs);
+		memcpy(second + blocks * kbs, m + kbs, kbs);
+		for (size_t b = 0; b < kbs; b++)
+		    second[blocks * kbs + b] ^= (len < 2 * kbs) ? key->cmac_sk2[b] : key->cmac_sk1[b];
+		blocks++;
+	    }
+	}
+
+	if (!EVP_EncryptUpdate(ctx, first, &outl, first, blocks * kbs))
+	    abort();
+	for (size_t b = 0; b < blocks * kbs; b++)
+	    first[b] ^= second[b];
+	if (!EVP_EncryptUpdate(ctx, first, &outl, first, blocks * kbs))
+	    abort();
+
+	memcpy(job->diversified_bytes + i * job->len, first, blocks * kbs);
+    }
+
+    // Wipe key info from stack
+    memset(first, 0, sizeof(first));
+    memset(second, 0, sizeof(second));
+    memset(m, 0, sizeof(m));
+
+    EVP_CIPHER_CTX_free(ctx);
+
+    return NULL;
+}
+
+int
+mifare_key_deriver_end_raw_batch(MifareKeyDeriver deriver, const uint8_t *const data[], const size_t data_len[], size_t count, uint8_t *diversified_bytes, unsigned int threads)
+{
+    const int len = get_key_type_data_len(deriver->output_key_type);
+    const size_t master_key_block_size = key_block_size(deriver->master_key);
+    uint8_t div[3];
+
+    int ndiv = deriver_div_constants(deriver, div);
+    if (ndiv < 0)
+	return -1;
+
+    for (size_t i = 0; i < count; i++) {
+	if (data_len[i] > master_key_block_size * 2 - 1) {
+	    errno = EOVERFLOW;
+	    return -1;
+	}
+    }
+
+    if (deriver->flags & AN10922_FLAG_EMULATE_ISSUE_91) {
+	// The legacy derivation does not pad to two blocks and is not
+	// batched.
+	for (size_t i = 0; i < count; i++) {
+	    if ((mifare_key_deriver_begin(deriver) < 0) ||
+		(mifare_key_deriver_update_data(deriver, data[i], data_len[i]) < 0) ||
+		(mifare_key_deriver_end_raw(deriver, diversified_bytes + i * len, len) < 0))
+		return -1;
+	}
+	return len;
+    }
+
+    struct deriver_batch_job job = {
+	.deriver = deriver,
+	.data = data,
+	.data_len = data_len,
+	.first = 0,
+	.last = count,
+	.diversified_bytes = diversified_bytes,
+	.div = div,
+	.ndiv = ndiv,
+	.len = len,
+	.error = 0,
+    };
+
+#if defined(HAVE_PTHREAD_H)
+    if (!threads) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = (cpus > 0) ? cpus : 1;
+    }
+    // There is no point in having threads with less than a batch to MAC.
+    threads = MIN(threads, (count + AN10922_BATCH_SIZE - 1) / AN10922_BATCH_SIZE);
+
+    if (threads > 1) {
+	struct deriver_batch_job jobs[threads];
+	pthread_t thread_ids[threads];
+	bool started[threads];
+	size_t per_thread = (count + threads - 1) / threads;
+	int error = 0;
+
+	for (unsigned int t = 0; t < threads; t++) {
+	    jobs[t] = job;
+	    jobs[t].first = MIN(count, t * per_thread);
+	    jobs[t].last = MIN(count, (t + 1) * per_thread);
+	    // Run the first slice, and any slice no thread can be created
+	    // for, in the calling thread.
+	    started[t] = t && (0 == pthread_create(&thread_ids[t], NULL, deriver_batch_run, &jobs[t]));
+	}
+	for (unsigned int t = 0; t < threads; t++) {
+	    if (!started[t])
+		deriver_batch_run(&jobs[t]);
+	}
+	for (unsigned int t = 0; t < threads; t++) {
+	    if (started[t])
+		pthread_join(thread_ids[t], NULL);
+	    if (jobs[t].error)
+		error = jobs[t].error;
+	}
+
+	if (error) {
+	    errno = error;
+	    return -1;
+	}
+	return len;
+    }
+#else
+    (void) threads;
+#endif
+
+    deriver_batch_run(&job);
+    if (job.error) {
+	errno = job.error;
+	return -1;
+    }
 
     return len;
 }
@@ -271,12 +758,27 @@ MifareDESFireKey
 mifare_key_deriver_end(MifareKeyDeriver deriver)
 {
     MifareDESFireKey ret = NULL;
+    struct mifare_key_cache_entry probe;
     uint8_t data[24];
+    bool cached = deriver->cache && deriver->len;
+
+    memset(&probe, 0, sizeof(probe));
+
+    if (cached) {
+	key_cache_probe(deriver, &probe);
+	key_cache_lock(deriver->cache);
+	struct mifare_key_cache_entry *entry = key_cache_lookup(deriver->cache, &probe);
+	if (entry)
+	    ret = mifare_desfire_key_copy(&entry->key);
+	key_cache_unlock(deriver->cache);
+	if (entry)
+	    goto out;
+    }
+
     int len = mifare_key_deriver_end_raw(deriver, data, sizeof(data));
 
-    if (len <= 0) {
-	return NULL;
-    }
+    if (len <= 0)
+	goto out;
 
     switch (deriver->output_key_type) {
     case MIFARE_KEY_AES128:
@@ -299,10 +801,18 @@ mifare_key_deriver_end(MifareKeyDeriver deriver)
     // Update the key version
     if (ret != NULL) {
 	mifare_desfire_key_set_version(ret, mifare_desfire_key_get_version(deriver->master_key));
+
+	if (cached) {
+	    key_cache_lock(deriver->cache);
+	    key_cache_insert(deriver->cache, &probe, ret);
+	    key_cache_unlock(deriver->cache);
+	}
     }
 
+out:
     // Wipe key info from stack
     memset(data, 0, sizeof(data));
+    memset(&probe, 0, sizeof(probe));
 
     return ret;
 }
@@ -32,12 +32,12 @@
     do { \
 	if (is_mifare_ultralightc (tag)) { \
 	    if (mode_write) { \
-		if (page >= MIFARE_ULTRALIGHT_C_PAGE_COUNT) return errno = EINVAL, -1; \
+		if (page >= MIFARE_ULTRALIGHT_C_PAGE_COUNT) return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	    } else { \
-		if (page >= MIFARE_ULTRALIGHT_C_PAGE_COUNT_READ) return errno = EINVAL, -1; \
+		if (page >= MIFARE_ULTRALIGHT_C_PAGE_COUNT_READ) return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	    } \
 	} else { \
-	    if (page >= MIFARE_ULTRALIGHT_PAGE_COUNT) return errno = EINVAL, -1; \
+	    if (page >= MIFARE_ULTRALIGHT_PAGE_COUNT) return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL); \
 	} \
     } while (0)
 
@@ -46,8 +46,8 @@
 	errno = 0; \
 	DEBUG_XFER (msg, __##msg##_n, "===> "); \
 	int _res; \
-	if ((_res = nfc_initiator_transceive_bytes (tag->device, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
-	    return errno = EIO, -1; \
+	if ((_res = freefare_transceive_bytes (tag, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	__##res##_n = _res; \
 	DEBUG_XFER (res, __##res##_n, "<=== "); \
@@ -56,21 +56,19 @@
 #define ULTRALIGHT_TRANSCEIVE_RAW(tag, msg, res) \
     do { \
 	errno = 0; \
-	if (nfc_device_set_property_bool (tag->device, NP_EASY_FRAMING, false) < 0) { \
-	    errno = EIO; \
-	    return -1; \
+	if (freefare_set_property_bool (tag, NP_EASY_FRAMING, false) < 0) { \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	DEBUG_XFER (msg, __##msg##_n, "===> "); \
 	int _res; \
-	if ((_res = nfc_initiator_transceive_bytes (tag->device, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
-	    nfc_device_set_property_bool (tag->device, NP_EASY_FRAMING, true); \
-	    return errno = EIO, -1; \
+	if ((_res = freefare_transceive_bytes (tag, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
+	    freefare_set_property_bool (tag, NP_EASY_FRAMING, true); \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	__##res##_n = _res; \
 	DEBUG_XFER (res, __##res##_n, "<=== "); \
-	if (nfc_device_set_property_bool (tag->device, NP_EASY_FRAMING, true) < 0) { \
-	    errno = EIO; \
-	    return -1; \
+	if (freefare_set_property_bool (tag, NP_EASY_FRAMING, true) < 0) { \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
     } while (0)
 
@@ -109,6 +107,12 @@ _mifare_ultralightc_tag_new(nfc_device *device, nfc_target target, bool is_ultra
 	tag->type = (is_ultralightc) ? MIFARE_ULTRALIGHT_C : MIFARE_ULTRALIGHT;
 	tag->free_tag = mifare_ultralightc_tag_free;
 	tag->device = device;
+	tag->transport = &freefare_nfc_transport;
+	tag->transport_data = device;
+	tag->stats = NULL;
+	tag->timeout_model = NULL;
+	tag->trace = NULL;
+	freefare_reset_tag_error(tag);
 	tag->info = target;
 	tag->active = 0;
     }
@@ -161,18 +165,16 @@ mifare_ultralight_connect(FreefareTag tag)
 {
     ASSERT_INACTIVE(tag);
 
-    nfc_target pnti;
     nfc_modulation modulation = {
 	.nmt = NMT_ISO14443A,
 	.nbr = NBR_106
     };
-    if (nfc_initiator_select_passive_target(tag->device, modulation, tag->info.nti.nai.abtUid, tag->info.nti.nai.szUidLen, &pnti) >= 0) {
+    if (freefare_select_target(tag, modulation) >= 0) {
 	tag->active = 1;
 	for (int i = 0; i < MIFARE_ULTRALIGHT_MAX_PAGE_COUNT; i++)
 	    MIFARE_ULTRALIGHT(tag)->cached_pages[i] = 0;
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     }
     return 0;
 }
@@ -185,11 +187,10 @@ mifare_ultralight_disconnect(FreefareTag tag)
 {
     ASSERT_ACTIVE(tag);
 
-    if (nfc_initiator_deselect_target(tag->device) >= 0) {
+    if (freefare_deselect_target(tag) >= 0) {
 	tag->active = 0;
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     }
     return 0;
 }
@@ -290,7 +291,8 @@ mifare_ultralightc_authenticate(FreefareTag tag, const MifareDESFireKey key)
     mifare_cypher_single_block(key, PICC_RndB, ivect, MCD_RECEIVE, MCO_DECYPHER, 8);
 
     uint8_t PCD_RndA[8];
-    DES_random_key((DES_cblock *)&PCD_RndA);
+    if (1 != freefare_random_bytes(tag, PCD_RndA, sizeof(PCD_RndA)))
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EIO);
 
     uint8_t PCD_r_RndB[8];
     memcpy(PCD_r_RndB, PICC_RndB, 8);
@@ -324,10 +326,8 @@ mifare_ultralightc_authenticate(FreefareTag tag, const MifareDESFireKey key)
     memcpy(PCD_RndA_s, PCD_RndA, 8);
     rol(PCD_RndA_s, 8);
 
-    if (0 != memcmp(PCD_RndA_s, PICC_RndA_s, 8)) {
-	errno = EACCES;
-	return -1;
-    }
+    if (0 != memcmp(PCD_RndA_s, PICC_RndA_s, 8))
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EACCES);
     // XXX Should we store the state "authenticated" in the tag struct??
     return 0;
 }
@@ -340,10 +340,8 @@ mifare_ultralightc_set_key(FreefareTag tag, MifareDESFireKey key)
 {
     MifareUltralightPage data;
 
-    if (key->type != MIFARE_KEY_2K3DES) {
-	errno = EINVAL;
-	return -1;
-    }
+    if (key->type != MIFARE_KEY_2K3DES)
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
 
     data[0] = key->data[7];
     data[1] = key->data[6];
@@ -37,24 +37,24 @@
     do { \
 	if (mode_write) { \
 	    if (page<=0x02) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_213&&page>0x2C) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_215&&page>0x86) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_216&&page>0xE6) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_UNKNOWN) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	} else { \
 	    if(NTAG_21x(tag)->subtype == NTAG_213&&page>0x2C) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_215&&page>0x86) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_216&&page>0xE6) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	    else if(NTAG_21x(tag)->subtype == NTAG_UNKNOWN) \
-	    {return errno = EINVAL, -1;} \
+	    {return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);} \
 	} \
     } while (0)
 
@@ -63,8 +63,8 @@
 	errno = 0; \
 	DEBUG_XFER (msg, __##msg##_n, "===> "); \
 	int _res; \
-	if ((_res = nfc_initiator_transceive_bytes (tag->device, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
-	    return errno = EIO, -1; \
+	if ((_res = freefare_transceive_bytes (tag, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	__##res##_n = _res; \
 	DEBUG_XFER (res, __##res##_n, "<=== "); \
@@ -73,21 +73,19 @@
 #define NTAG_TRANSCEIVE_RAW(tag, msg, res) \
     do { \
 	errno = 0; \
-	if (nfc_device_set_property_bool (tag->device, NP_EASY_FRAMING, false) < 0) { \
-	    errno = EIO; \
-	    return -1; \
+	if (freefare_set_property_bool (tag, NP_EASY_FRAMING, false) < 0) { \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	DEBUG_XFER (msg, __##msg##_n, "===> "); \
 	int _res; \
-	if ((_res = nfc_initiator_transceive_bytes (tag->device, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
-	    nfc_device_set_property_bool (tag->device, NP_EASY_FRAMING, true); \
-	    return errno = EIO, -1; \
+	if ((_res = freefare_transceive_bytes (tag, msg, __##msg##_n, res, __##res##_size, 0)) < 0) { \
+	    freefare_set_property_bool (tag, NP_EASY_FRAMING, true); \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
 	__##res##_n = _res; \
 	DEBUG_XFER (res, __##res##_n, "<=== "); \
-	if (nfc_device_set_property_bool (tag->device, NP_EASY_FRAMING, true) < 0) { \
-	    errno = EIO; \
-	    return -1; \
+	if (freefare_set_property_bool (tag, NP_EASY_FRAMING, true) < 0) { \
+	    return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO); \
 	} \
     } while (0)
 
@@ -115,6 +113,12 @@ _ntag21x_tag_new(nfc_device *device, nfc_target target)
 	tag->type = NTAG_21x ;
 	tag->free_tag = ntag21x_tag_free;
 	tag->device = device;
+	tag->transport = &freefare_nfc_transport;
+	tag->transport_data = device;
+	tag->stats = NULL;
+	tag->timeout_model = NULL;
+	tag->trace = NULL;
+	freefare_reset_tag_error(tag);
 	tag->info = target;
 	tag->active = 0;
 	NTAG_21x(tag)->subtype = NTAG_UNKNOWN;
@@ -140,6 +144,13 @@ _ntag21x_tag_reuse(FreefareTag old_tag)
 	tag->type = NTAG_21x ;
 	tag->free_tag = ntag21x_tag_free;
 	tag->device = old_tag->device;
+	tag->transport = old_tag->transport;
+	tag->transport_data = old_tag->transport_data;
+	tag->stats = NULL;
+	tag->timeout_model = old_tag->timeout_model;
+	tag->trace = old_tag->trace;
+	tag->trace_session = old_tag->trace_session;
+	freefare_reset_tag_error(tag);
 	tag->info = old_tag->info;
 	tag->active = 0;
 	NTAG_21x(tag)->subtype = NTAG_21x(old_tag)->subtype;
@@ -219,17 +230,15 @@ ntag21x_connect(FreefareTag tag)
 {
     ASSERT_INACTIVE(tag);
 
-    nfc_target pnti;
     nfc_modulation modulation = {
 	.nmt = NMT_ISO14443A,
 	.nbr = NBR_106
     };
-    if (nfc_initiator_select_passive_target(tag->device, modulation, tag->info.nti.nai.abtUid, tag->info.nti.nai.szUidLen, &pnti) >= 0) {
+    if (freefare_select_target(tag, modulation) >= 0) {
 	tag->active = 1;
 
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     }
     return 0;
 }
@@ -242,11 +251,10 @@ ntag21x_disconnect(FreefareTag tag)
 {
     ASSERT_ACTIVE(tag);
 
-    if (nfc_initiator_deselect_target(tag->device) >= 0) {
+    if (freefare_deselect_target(tag) >= 0) {
 	tag->active = 0;
     } else {
-	errno = EIO;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_TRANSPORT, EIO);
     }
     return 0;
 }
@@ -259,6 +267,10 @@ ntag21x_get_info(FreefareTag tag)
 {
     ASSERT_ACTIVE(tag);
 
+    // The version may have been gathered when identifying the tag
+    if (NTAG_21x(tag)->subtype != NTAG_UNKNOWN)
+	return 0;
+
     // Init buffers
     BUFFER_INIT(cmd, 1);
     BUFFER_INIT(res, 8);
@@ -268,13 +280,28 @@ ntag21x_get_info(FreefareTag tag)
 
     NTAG_TRANSCEIVE_RAW(tag, cmd, res);  // Send & receive to & from tag
 
-    NTAG_21x(tag)->vendor_id = res[1];
-    NTAG_21x(tag)->product_type = res[2];
-    NTAG_21x(tag)->product_subtype = res[3];
-    NTAG_21x(tag)->major_product_version = res[4];
-    NTAG_21x(tag)->minor_product_version = res[5];
-    NTAG_21x(tag)->storage_size = res[6];
-    NTAG_21x(tag)->protocol_type = res[7];
+    ntag21x_set_version(tag, res);
+
+    if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
+	NTAG_21x(tag)->last_error = UNKNOWN_TAG_TYPE_ERROR;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EINVAL);
+    }
+    return 0;
+}
+
+/*
+ * Record the GET_VERSION response of the tag
+ */
+void
+ntag21x_set_version(FreefareTag tag, const uint8_t version[8])
+{
+    NTAG_21x(tag)->vendor_id = version[1];
+    NTAG_21x(tag)->product_type = version[2];
+    NTAG_21x(tag)->product_subtype = version[3];
+    NTAG_21x(tag)->major_product_version = version[4];
+    NTAG_21x(tag)->minor_product_version = version[5];
+    NTAG_21x(tag)->storage_size = version[6];
+    NTAG_21x(tag)->protocol_type = version[7];
 
     // Set ntag subtype based on storage size
     switch (NTAG_21x(tag)->storage_size) {
@@ -288,10 +315,9 @@ ntag21x_get_info(FreefareTag tag)
 	NTAG_21x(tag)->subtype = NTAG_216;
 	break;
     default:
-	NTAG_21x(tag)->last_error = UNKNOWN_TAG_TYPE_ERROR;
-	return -1;
+	NTAG_21x(tag)->subtype = NTAG_UNKNOWN;
+	break;
     }
-    return 0;
 }
 
 /*
@@ -358,7 +384,7 @@ ntag21x_set_pwd(FreefareTag tag, uint8_t data[4]) // Set password
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     uint8_t page = ntag21x_get_last_page(tag) - 1; // PWD page is located 1 before last page
     int res = ntag21x_write(tag, page, data);
@@ -370,7 +396,7 @@ ntag21x_set_pack(FreefareTag tag, uint8_t data[2]) // Set pack
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(buff, 4);
     BUFFER_APPEND_BYTES(buff, data, 2);
@@ -400,7 +426,7 @@ ntag21x_set_auth(FreefareTag tag, uint8_t byte) // Set AUTH0 byte (from which pa
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(cdata, 4);
     int page = ntag21x_get_last_page(tag) - 3; // AUTH0 byte is on 4th page from back
@@ -418,7 +444,7 @@ ntag21x_get_auth(FreefareTag tag, uint8_t *byte) // Get AUTH0 byte
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(cdata, 4);
     int page = ntag21x_get_last_page(tag) - 3; // AUTH0 byte is on 4th page from back
@@ -435,7 +461,7 @@ ntag21x_access_enable(FreefareTag tag, uint8_t byte) // Enable access feature in
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(cdata, 4);
     int page = ntag21x_get_last_page(tag) - 2; // ACCESS byte is on 3th page from back
@@ -453,7 +479,7 @@ ntag21x_access_disable(FreefareTag tag, uint8_t byte) // Disable access feature
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(cdata, 4);
     int page = ntag21x_get_last_page(tag) - 2; // ACCESS byte is on 3th page from back
@@ -471,7 +497,7 @@ ntag21x_get_access(FreefareTag tag, uint8_t *byte) // Get ACCESS byte
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(cdata, 4);
     uint8_t page = ntag21x_get_last_page(tag) - 2; // ACCESS byte is on 3th page from back
@@ -486,7 +512,7 @@ ntag21x_get_access(FreefareTag tag, uint8_t *byte) // Get ACCESS byte
 int
 ntag21x_check_access(FreefareTag tag, uint8_t byte, bool *result) // Check if access feature is enabled
 {
-    BUFFER_INIT(buff, 1);
+    uint8_t buff[1] = { 0x00 };
     int res;
     res = ntag21x_get_access(tag, buff);
     if (res < 0)
@@ -502,7 +528,7 @@ ntag21x_get_authentication_limit(FreefareTag tag, uint8_t *byte) // Get authenti
 {
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
     BUFFER_INIT(cdata, 4);
     uint8_t page = ntag21x_get_last_page(tag) - 2; // ACCESS byte is on 3th page from back
@@ -519,10 +545,10 @@ int
 ntag21x_set_authentication_limit(FreefareTag tag, uint8_t byte) // Set authentication limit (0x00 = disabled, [0x01,0x07] = valid range, > 0x07 invalid range)
 {
     if (byte > 7) // Check for invalid range of auth limit
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     if (NTAG_21x(tag)->subtype == NTAG_UNKNOWN) {
 	NTAG_21x(tag)->last_error = TAG_INFO_MISSING_ERROR;
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_LOCAL, EINVAL);
     }
 
     BUFFER_INIT(cdata, 4);
@@ -694,7 +720,7 @@ ntag21x_authenticate(FreefareTag tag, const NTAG21xKey key)
 	}
 
     if (!flag_auth)
-	return -1;
+	return freefare_tag_error(tag, FREEFARE_ERROR_RESPONSE, EACCES);
     // XXX Should we store the state "authenticated" in the tag struct??
     return 0;
 }
@@ -0,0 +1,2029 @@
+#include <cutter.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <freefare.h>
+#include "freefare_internal.h"
+
+static const uint8_t uid7[] = { 0x04, 0x2a, 0x5c, 0x72, 0x1e, 0x3f, 0x80 };
+
+static FreefareEmulator emulator;
+static FreefareTag tag;
+static FreefareAsync async;
+
+#define POOL_DEVICE_COUNT 4
+#define POOL_MAX_JOBS 2
+
+static FreefareReaderPool pool;
+static FreefareEmulator pool_emulators[POOL_DEVICE_COUNT];
+
+#define FIELD_SIZE 4
+
+static FreefarePoller poller;
+
+/* Emulated tags in the field of an emulated initiator */
+static struct {
+    FreefareEmulator emulators[FIELD_SIZE];
+    size_t count;
+    size_t next;
+    int inits;
+    int selects;
+    int fail_select;
+} field;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+/*
+ * Count heap allocations while allocation_count is not negative.
+ */
+#define HAVE_ALLOCATION_COUNT 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int allocation_count = -1;
+
+void *
+malloc(size_t size)
+{
+    if (__atomic_load_n(&allocation_count, __ATOMIC_RELAXED) >= 0)
+	__atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if (__atomic_load_n(&allocation_count, __ATOMIC_RELAXED) >= 0)
+	__atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (__atomic_load_n(&allocation_count, __ATOMIC_RELAXED) >= 0)
+	__atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+void
+cut_teardown(void)
+{
+    if (async) {
+	freefare_async_free(async);
+	async = NULL;
+    }
+    if (pool) {
+	freefare_reader_pool_free(pool);
+	pool = NULL;
+    }
+    if (poller) {
+	freefare_poller_free(poller);
+	poller = NULL;
+    }
+    for (size_t i = 0; i < field.count; i++)
+	freefare_emulator_free(field.emulators[i]);
+    memset(&field, 0, sizeof(field));
+    for (int i = 0; i < POOL_DEVICE_COUNT; i++) {
+	freefare_emulator_free(pool_emulators[i]);
+	pool_emulators[i] = NULL;
+    }
+    if (tag) {
+	freefare_free_tag(tag);
+	tag = NULL;
+    }
+    if (emulator) {
+	freefare_emulator_free(emulator);
+	emulator = NULL;
+    }
+}
+
+static void
+emulate(enum freefare_tag_type type, const uint8_t *uid, size_t uid_len)
+{
+    emulator = freefare_emulator_new(type, uid, uid_len);
+    cut_assert_not_null(emulator, cut_message("freefare_emulator_new() failed"));
+
+    tag = freefare_emulator_tag_new(emulator);
+    cut_assert_not_null(tag, cut_message("freefare_emulator_tag_new() failed"));
+    cut_assert_equal_int(type, freefare_get_tag_type(tag), cut_message("Wrong tag type"));
+}
+
+void
+test_freefare_emulator_invalid_uid(void)
+{
+    emulator = freefare_emulator_new(MIFARE_DESFIRE, uid7, 4);
+    cut_assert_null(emulator, cut_message("freefare_emulator_new() should fail"));
+}
+
+void
+test_freefare_emulator_uid(void)
+{
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    char *uid = freefare_get_tag_uid(tag);
+    cut_assert_equal_string("042a5c721e3f80", uid, cut_message("Wrong UID"));
+    free(uid);
+}
+
+void
+test_freefare_emulator_mifare_classic(void)
+{
+    int res;
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+
+    emulate(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+
+    MifareClassicKey bad_key = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    res = mifare_classic_authenticate(tag, 0x04, bad_key, MFC_KEY_A);
+    cut_assert_equal_int(-1, res, cut_message("mifare_classic_authenticate() should fail"));
+
+    /* A failed authentication halts the tag */
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+
+    MifareClassicKey default_key = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+
+    MifareClassicBlock data = "Emulated block!";
+    res = mifare_classic_write(tag, 0x05, data);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_write() failed"));
+
+    MifareClassicBlock read;
+    res = mifare_classic_read(tag, 0x05, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+    res = mifare_classic_init_value(tag, 0x06, 100, 0x06);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_init_value() failed"));
+    res = mifare_classic_decrement(tag, 0x06, 42);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_decrement() failed"));
+    res = mifare_classic_transfer(tag, 0x06);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_transfer() failed"));
+
+    int32_t value;
+    MifareClassicBlockNumber adr;
+    res = mifare_classic_read_value(tag, 0x06, &value, &adr);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read_value() failed"));
+    cut_assert_equal_int(58, value, cut_message("Wrong value"));
+
+    res = mifare_classic_read(tag, 0x08, &read);
+    cut_assert_equal_int(-1, res, cut_message("Reading another sector should fail"));
+
+    mifare_classic_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_ultralightc(void)
+{
+    int res;
+
+    emulate(MIFARE_ULTRALIGHT_C, uid7, sizeof(uid7));
+
+    res = mifare_ultralight_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralight_connect() failed"));
+
+    uint8_t key_data[16] = { 'I', 'E', 'M', 'K', 'A', 'E', 'R', 'B', '!', 'N', 'A', 'C', 'U', 'O', 'Y', 'F' };
+    MifareDESFireKey key = mifare_desfire_3des_key_new(key_data);
+    res = mifare_ultralightc_authenticate(tag, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralightc_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    MifareUltralightPage page = { 'f', 'r', 'e', 'e' };
+    res = mifare_ultralight_write(tag, 0x10, page);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralight_write() failed"));
+
+    MifareUltralightPage read;
+    res = mifare_ultralight_read(tag, 0x10, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralight_read() failed"));
+    cut_assert_equal_memory(page, sizeof(page), read, sizeof(read), cut_message("Wrong data"));
+
+    mifare_ultralight_disconnect(tag);
+}
+
+void
+test_freefare_emulator_ntag21x(void)
+{
+    int res;
+
+    emulate(NTAG_21x, uid7, sizeof(uid7));
+
+    res = ntag21x_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_connect() failed"));
+
+    res = ntag21x_get_info(tag);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_get_info() failed"));
+    cut_assert_equal_int(NTAG_213, ntag21x_get_subtype(tag), cut_message("Wrong subtype"));
+
+    uint8_t pwd[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t pack[2] = { 0xab, 0xcd };
+    res = ntag21x_set_pwd(tag, pwd);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_set_pwd() failed"));
+    res = ntag21x_set_pack(tag, pack);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_set_pack() failed"));
+
+    NTAG21xKey key = ntag21x_key_new(pwd, pack);
+    res = ntag21x_authenticate(tag, key);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_authenticate() failed"));
+    ntag21x_key_free(key);
+
+    uint8_t data[4] = { 0xca, 0xfe, 0xba, 0xbe };
+    res = ntag21x_write(tag, 0x04, data);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_write() failed"));
+
+    uint8_t read[4];
+    res = ntag21x_fast_read4(tag, 0x04, read);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_fast_read4() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+    ntag21x_disconnect(tag);
+}
+
+void
+test_freefare_emulator_felica(void)
+{
+    const uint8_t idm[8] = { 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+
+    emulate(FELICA, idm, sizeof(idm));
+
+    uint8_t data[16] = "FeliCa emulation";
+    ssize_t res = felica_write(tag, FELICA_SC_RW, 0x00, data, sizeof(data));
+    cut_assert_equal_int(0, res, cut_message("felica_write() failed"));
+
+    uint8_t read[16];
+    res = felica_read(tag, FELICA_SC_RO, 0x00, read, sizeof(read));
+    cut_assert_equal_int(16, res, cut_message("felica_read() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+}
+
+void
+test_freefare_emulator_mifare_desfire(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[8] = { 0 };
+    MifareDESFireKey key = mifare_desfire_des_key_new_with_version(null_key_data);
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 2);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    uint8_t aes_key_data[16] = { 0 };
+    key = mifare_desfire_aes_key_new(aes_key_data);
+    res = mifare_desfire_authenticate_aes(tag, 1, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+    mifare_desfire_key_free(key);
+
+    res = mifare_desfire_create_std_data_file(tag, 1, MDCM_ENCIPHERED, 0x1111, 128);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+    uint8_t data[100];
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = i;
+    res = mifare_desfire_write_data(tag, 1, 10, sizeof(data), data);
+    cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+
+    uint8_t read[sizeof(data)];
+    res = mifare_desfire_read_data(tag, 1, 10, sizeof(read), read);
+    cut_assert_equal_int(sizeof(read), res, cut_message("mifare_desfire_read_data() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_stats(void)
+{
+    int res;
+    struct freefare_tag_stats stats;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = freefare_get_tag_stats(tag, &stats);
+    cut_assert_equal_int(-1, res, cut_message("Statistics should be disabled"));
+
+    res = freefare_enable_tag_stats(tag, true);
+    cut_assert_equal_int(0, res, cut_message("freefare_enable_tag_stats() failed"));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    struct mifare_desfire_version_info version_info;
+    res = mifare_desfire_get_version(tag, &version_info);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_get_version() failed"));
+
+    res = freefare_get_tag_stats(tag, &stats);
+    cut_assert_equal_int(0, res, cut_message("freefare_get_tag_stats() failed"));
+
+    cut_assert_equal_int(1, stats.commands[0x60].frames, cut_message("Wrong GetVersion frame count"));
+    cut_assert_equal_int(5, stats.commands[0x60].bytes_sent, cut_message("Wrong GetVersion bytes sent"));
+    cut_assert_equal_int(9, stats.commands[0x60].bytes_received, cut_message("Wrong GetVersion bytes received"));
+    cut_assert_equal_int(2, stats.commands[0xAF].frames, cut_message("Wrong continuation frame count"));
+    cut_assert_equal_int(0, stats.commands[0xAF].errors, cut_message("Wrong continuation error count"));
+
+    uint64_t histogram = 0;
+    for (int i = 0; i < FREEFARE_STATS_RTT_BUCKETS; i++)
+	histogram += stats.commands[0xAF].rtt_histogram[i];
+    cut_assert_equal_int(2, histogram, cut_message("Wrong RTT histogram"));
+
+    cut_assert_equal_int(1, stats.preprocess.calls, cut_message("Wrong preprocess count"));
+    cut_assert_equal_int(1, stats.postprocess.calls, cut_message("Wrong postprocess count"));
+
+    freefare_reset_tag_stats(tag);
+    res = freefare_get_tag_stats(tag, &stats);
+    cut_assert_equal_int(0, res, cut_message("freefare_get_tag_stats() failed"));
+    cut_assert_equal_int(0, stats.commands[0x60].frames, cut_message("Statistics should be cleared"));
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_timeout_model(void)
+{
+    int res;
+
+    FreefareTimeoutModel model = freefare_timeout_model_new(4, 500, 100);
+    cut_assert_null(model, cut_message("A floor above the ceiling should be rejected"));
+    cut_assert_equal_int(EINVAL, errno, cut_message("Wrong errno"));
+
+    model = freefare_timeout_model_new(4, 10, 500);
+    cut_assert_not_null(model, cut_message("freefare_timeout_model_new() failed"));
+    cut_assert_equal_int(500, freefare_timeout_model_get_timeout(model, 0x60), cut_message("Unknown commands should use the ceiling"));
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+    freefare_set_tag_timeout_model(tag, model);
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    struct mifare_desfire_version_info version_info;
+    res = mifare_desfire_get_version(tag, &version_info);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_get_version() failed"));
+
+    /* Emulated exchanges are much faster than the floor */
+    cut_assert_equal_int(10, freefare_timeout_model_get_timeout(model, 0x60), cut_message("Wrong learnt timeout"));
+    cut_assert_equal_int(500, freefare_timeout_model_get_timeout(model, 0xBD), cut_message("Unknown commands should use the ceiling"));
+
+    mifare_desfire_disconnect(tag);
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_timeout_model_free(model);
+}
+
+static void
+desfire_create_file(FreefareTag t, uint32_t aid_value, uint32_t file_size)
+{
+    int res;
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(aid_value);
+    res = mifare_desfire_select_application(t, NULL);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    res = mifare_desfire_create_application(t, aid, 0xEF, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application() failed"));
+    res = mifare_desfire_select_application(t, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    res = mifare_desfire_create_std_data_file(t, 1, MDCM_PLAIN, 0xEEEE, file_size);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+}
+
+static uint32_t
+desfire_file_size(FreefareTag t, uint32_t aid_value)
+{
+    int res;
+    struct mifare_desfire_file_settings settings;
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(aid_value);
+    res = mifare_desfire_select_application(t, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    res = mifare_desfire_get_file_settings(t, 1, &settings);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_get_file_settings() failed"));
+
+    return settings.settings.standard_file.file_size;
+}
+
+void
+test_freefare_emulator_mifare_desfire_file_settings_cache(void)
+{
+    int res;
+    struct freefare_tag_stats stats;
+    const uint8_t other_uid[7] = { 0x04, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    FreefareEmulator other_emulator = freefare_emulator_new(MIFARE_DESFIRE, other_uid, sizeof(other_uid));
+    cut_assert_not_null(other_emulator, cut_message("freefare_emulator_new() failed"));
+    FreefareTag other_tag = freefare_emulator_tag_new(other_emulator);
+    cut_assert_not_null(other_tag, cut_message("freefare_emulator_tag_new() failed"));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+    res = mifare_desfire_connect(other_tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    desfire_create_file(tag, 0x000001, 32);
+    desfire_create_file(tag, 0x000002, 64);
+    desfire_create_file(other_tag, 0x000001, 128);
+
+    /* Settings are cached per tag and per application */
+    cut_assert_equal_int(32, desfire_file_size(tag, 0x000001), cut_message("Wrong file size"));
+    cut_assert_equal_int(128, desfire_file_size(other_tag, 0x000001), cut_message("Wrong file size"));
+    cut_assert_equal_int(64, desfire_file_size(tag, 0x000002), cut_message("Wrong file size"));
+
+    res = freefare_enable_tag_stats(tag, true);
+    cut_assert_equal_int(0, res, cut_message("freefare_enable_tag_stats() failed"));
+
+    cut_assert_equal_int(32, desfire_file_size(tag, 0x000001), cut_message("Wrong file size"));
+    cut_assert_equal_int(64, desfire_file_size(tag, 0x000002), cut_message("Wrong file size"));
+
+    res = freefare_get_tag_stats(tag, &stats);
+    cut_assert_equal_int(0, res, cut_message("freefare_get_tag_stats() failed"));
+    cut_assert_equal_int(0, stats.commands[0xF5].frames, cut_message("File settings should be cached"));
+
+    /* Deleting the file invalidates its settings */
+    res = mifare_desfire_delete_file(tag, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_delete_file() failed"));
+    res = mifare_desfire_create_std_data_file(tag, 1, MDCM_PLAIN, 0xEEEE, 16);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+    cut_assert_equal_int(16, desfire_file_size(tag, 0x000002), cut_message("Wrong file size"));
+
+    mifare_desfire_disconnect(other_tag);
+    freefare_free_tag(other_tag);
+    freefare_emulator_free(other_emulator);
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_desfire_read_write_settings(void)
+{
+    int res;
+    struct freefare_tag_stats stats;
+    uint8_t data[16] = "Steady state I/O";
+    uint8_t read[sizeof(data)];
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    desfire_create_file(tag, 0x000001, 32);
+    res = mifare_desfire_create_linear_record_file(tag, 2, MDCM_PLAIN, 0xEEEE, sizeof(data), 4);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_linear_record_file() failed"));
+
+    res = freefare_enable_tag_stats(tag, true);
+    cut_assert_equal_int(0, res, cut_message("freefare_enable_tag_stats() failed"));
+
+    for (int i = 0; i < 4; i++) {
+	res = mifare_desfire_write_data(tag, 1, 0, sizeof(data), data);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+	res = mifare_desfire_read_data(tag, 1, 0, sizeof(read), read);
+	cut_assert_equal_int(sizeof(read), res, cut_message("mifare_desfire_read_data() failed"));
+    }
+
+    res = freefare_get_tag_stats(tag, &stats);
+    cut_assert_equal_int(0, res, cut_message("freefare_get_tag_stats() failed"));
+    cut_assert_equal_int(1, stats.commands[0xF5].frames, cut_message("File settings should be retrieved once"));
+
+    /* The number of records changes when the transaction is committed */
+    res = mifare_desfire_write_record(tag, 2, 0, sizeof(data), data);
+    cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_record() failed"));
+    res = mifare_desfire_commit_transaction(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_commit_transaction() failed"));
+
+    res = mifare_desfire_read_records(tag, 2, 0, 0, read);
+    cut_assert_equal_int(sizeof(read), res, cut_message("mifare_desfire_read_records() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_desfire_read_in_place(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[8] = { 0 };
+    MifareDESFireKey key = mifare_desfire_des_key_new_with_version(null_key_data);
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 2);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    uint8_t aes_key_data[16] = { 0 };
+    key = mifare_desfire_aes_key_new(aes_key_data);
+    res = mifare_desfire_authenticate_aes(tag, 1, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+    mifare_desfire_key_free(key);
+
+    res = mifare_desfire_create_std_data_file(tag, 1, MDCM_ENCIPHERED, 0x1111, 300);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+    res = mifare_desfire_create_std_data_file(tag, 2, MDCM_MACED, 0x1111, 300);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+    uint8_t data[300];
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = i * 7;
+
+    size_t size = mifare_desfire_read_buffer_size(tag, sizeof(data));
+    cut_assert_true(size > sizeof(data), cut_message("No room for CRC and padding"));
+    uint8_t *buffer = malloc(size);
+
+    for (uint8_t file_no = 1; file_no <= 2; file_no++) {
+	res = mifare_desfire_write_data(tag, file_no, 0, sizeof(data), data);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+
+	memset(buffer, 0, size);
+	res = mifare_desfire_read_data_in_place(tag, file_no, 0, sizeof(data), buffer, size);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_read_data_in_place() failed"));
+	cut_assert_equal_memory(data, sizeof(data), buffer, sizeof(data), cut_message("Wrong data"));
+
+	/* A buffer without slack falls back to the crypto buffer */
+	memset(buffer, 0, size);
+	res = mifare_desfire_read_data_in_place(tag, file_no, 0, sizeof(data), buffer, sizeof(data));
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_read_data_in_place() failed"));
+	cut_assert_equal_memory(data, sizeof(data), buffer, sizeof(data), cut_message("Wrong data"));
+    }
+
+    free(buffer);
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_desfire_read_enciphered_lengths(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[16] = { 0 };
+    MifareDESFireKey key = mifare_desfire_des_key_new_with_version(null_key_data);
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+
+    MifareDESFireAID des_aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application(tag, des_aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application() failed"));
+    MifareDESFireAID aes_aid = mifare_desfire_aid_new(0x00654321);
+    res = mifare_desfire_create_application_aes(tag, aes_aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+
+    /* Zeros and 0x80 look like padding and must not fool the CRC search */
+    uint8_t data[48];
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = (i % 5) ? 0x00 : 0x80;
+
+    for (int n = 0; n < 2; n++) {
+	res = mifare_desfire_select_application(tag, n ? aes_aid : des_aid);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+	if (n) {
+	    MifareDESFireKey aes_key = mifare_desfire_aes_key_new(null_key_data);
+	    res = mifare_desfire_authenticate_aes(tag, 0, aes_key);
+	    mifare_desfire_key_free(aes_key);
+	} else {
+	    res = mifare_desfire_authenticate(tag, 0, key);
+	}
+	cut_assert_equal_int(0, res, cut_message("Authentication failed"));
+
+	res = mifare_desfire_create_std_data_file(tag, 1, MDCM_ENCIPHERED, 0x0000, sizeof(data));
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+	res = mifare_desfire_write_data(tag, 1, 0, sizeof(data), data);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+
+	for (size_t length = 1; length <= sizeof(data); length++) {
+	    uint8_t read[sizeof(data)];
+	    res = mifare_desfire_read_data(tag, 1, 0, length, read);
+	    cut_assert_equal_int(length, res, cut_message("mifare_desfire_read_data() failed for %zu bytes", length));
+	    cut_assert_equal_memory(data, length, read, length, cut_message("Wrong data for %zu bytes", length));
+	}
+    }
+
+    free(des_aid);
+    free(aes_aid);
+    mifare_desfire_key_free(key);
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_desfire_reauthenticate(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[16] = { 0 };
+    MifareDESFireKey des_key = mifare_desfire_des_key_new_with_version(null_key_data);
+    MifareDESFireKey aes_key = mifare_desfire_aes_key_new(null_key_data);
+
+    res = mifare_desfire_authenticate(tag, 0, des_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    cut_assert_true(&MIFARE_DESFIRE(tag)->session_key_storage == MIFARE_DESFIRE(tag)->session_key, cut_message("Session key not stored in the tag"));
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+
+    uint8_t data[64];
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = i * 5;
+
+    EVP_CIPHER_CTX *cbc_encypher = NULL;
+    for (int n = 0; n < 3; n++) {
+	res = mifare_desfire_authenticate_aes(tag, 0, aes_key);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+
+	// The CMAC subkeys are computed with the session key
+	struct mifare_desfire_key session_key = *MIFARE_DESFIRE(tag)->session_key;
+	memset(session_key.cmac_sk1, 0, sizeof(session_key.cmac_sk1));
+	memset(session_key.cmac_sk2, 0, sizeof(session_key.cmac_sk2));
+	cmac_generate_subkeys(&session_key);
+	cut_assert_equal_memory(session_key.cmac_sk1, 16, MIFARE_DESFIRE(tag)->session_key->cmac_sk1, 16, cut_message("Wrong CMAC subkey 1"));
+	cut_assert_equal_memory(session_key.cmac_sk2, 16, MIFARE_DESFIRE(tag)->session_key->cmac_sk2, 16, cut_message("Wrong CMAC subkey 2"));
+
+	if (!n) {
+	    res = mifare_desfire_create_std_data_file(tag, 1, MDCM_ENCIPHERED, 0x0000, sizeof(data));
+	    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+	}
+	data[0] = n;
+	res = mifare_desfire_write_data(tag, 1, 0, sizeof(data), data);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+
+	uint8_t read[sizeof(data)];
+	res = mifare_desfire_read_data(tag, 1, 0, sizeof(read), read);
+	cut_assert_equal_int(sizeof(read), res, cut_message("mifare_desfire_read_data() failed"));
+	cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+	// The cipher contexts of the previous session are reused
+	if (n)
+	    cut_assert_true(cbc_encypher == MIFARE_DESFIRE(tag)->cbc_encypher, cut_message("Cipher context not reused"));
+	cbc_encypher = MIFARE_DESFIRE(tag)->cbc_encypher;
+    }
+    free(aid);
+
+    // A session with another cipher still works
+    res = mifare_desfire_select_application(tag, NULL);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    res = mifare_desfire_authenticate(tag, 0, des_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    MifareDESFireAID *aids;
+    size_t count;
+    res = mifare_desfire_get_application_ids(tag, &aids, &count);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_get_application_ids() failed"));
+    cut_assert_equal_int(1, count, cut_message("Wrong application count"));
+    mifare_desfire_free_application_ids(aids);
+
+    mifare_desfire_key_free(des_key);
+    mifare_desfire_key_free(aes_key);
+
+    mifare_desfire_disconnect(tag);
+    cut_assert_null(MIFARE_DESFIRE(tag)->session_key, cut_message("Session key not cleared"));
+}
+
+void
+test_freefare_emulator_mifare_desfire_batch(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[16] = { 0 };
+    MifareDESFireKey des_key = mifare_desfire_des_key_new_with_version(null_key_data);
+    MifareDESFireKey aes_key = mifare_desfire_aes_key_new(null_key_data);
+
+    res = mifare_desfire_authenticate(tag, 0, des_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    res = mifare_desfire_authenticate(tag, 0, aes_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    res = mifare_desfire_create_value_file(tag, 1, MDCM_MACED, 0x0000, 0, 1000, 100, 0);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_value_file() failed"));
+    res = mifare_desfire_select_application(tag, NULL);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+
+    int32_t before, after;
+    MifareDESFireBatch batch = mifare_desfire_batch_new();
+    cut_assert_not_null(batch, cut_message("mifare_desfire_batch_new() failed"));
+    cut_assert_equal_int(0, mifare_desfire_batch_select_application(batch, aid), cut_message("Wrong step index"));
+    cut_assert_equal_int(1, mifare_desfire_batch_authenticate(batch, 0, aes_key), cut_message("Wrong step index"));
+    cut_assert_equal_int(2, mifare_desfire_batch_get_value(batch, 1, &before), cut_message("Wrong step index"));
+    cut_assert_equal_int(3, mifare_desfire_batch_debit(batch, 1, 30), cut_message("Wrong step index"));
+    cut_assert_equal_int(4, mifare_desfire_batch_commit_transaction(batch), cut_message("Wrong step index"));
+    cut_assert_equal_int(5, mifare_desfire_batch_get_value(batch, 1, &after), cut_message("Wrong step index"));
+    cut_assert_equal_int(6, mifare_desfire_batch_count(batch), cut_message("Wrong step count"));
+    free(aid);
+
+    // Steps are only run by mifare_desfire_batch_run()
+    res = mifare_desfire_batch_result(batch, 0);
+    cut_assert_equal_int(-1, res, cut_message("Step should not have run"));
+    cut_assert_equal_int(ECANCELED, errno, cut_message("Wrong errno"));
+
+    for (int32_t expected = 100; expected >= 40; expected -= 30) {
+	res = mifare_desfire_batch_run(tag, batch);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_batch_run() failed"));
+	for (size_t n = 0; n < mifare_desfire_batch_count(batch); n++) {
+	    cut_assert_equal_int(0, mifare_desfire_batch_result(batch, n), cut_message("Wrong result for step %d", (int) n));
+	    cut_assert_equal_int(OPERATION_OK, mifare_desfire_batch_picc_error(batch, n), cut_message("Wrong PICC error for step %d", (int) n));
+	}
+	cut_assert_equal_int(expected, before, cut_message("Wrong value before debit"));
+	cut_assert_equal_int(expected - 30, after, cut_message("Wrong value after debit"));
+    }
+
+    // The third debit goes below the lower limit
+    res = mifare_desfire_batch_run(tag, batch);
+    cut_assert_equal_int(-1, res, cut_message("mifare_desfire_batch_run() should fail"));
+    cut_assert_equal_int(BOUNDARY_ERROR, mifare_desfire_last_picc_error(tag), cut_message("Wrong PICC error"));
+    cut_assert_equal_int(0, mifare_desfire_batch_result(batch, 2), cut_message("Wrong result for step 2"));
+    cut_assert_equal_int(10, before, cut_message("Wrong value before debit"));
+    cut_assert_equal_int(-1, mifare_desfire_batch_result(batch, 3), cut_message("Debit should have failed"));
+    cut_assert_equal_int(BOUNDARY_ERROR, mifare_desfire_batch_picc_error(batch, 3), cut_message("Wrong PICC error for step 3"));
+    for (size_t n = 4; n < mifare_desfire_batch_count(batch); n++) {
+	cut_assert_equal_int(-1, mifare_desfire_batch_result(batch, n), cut_message("Step %d should not have run", (int) n));
+	cut_assert_equal_int(ECANCELED, errno, cut_message("Wrong errno for step %d", (int) n));
+    }
+    res = mifare_desfire_batch_result(batch, mifare_desfire_batch_count(batch));
+    cut_assert_equal_int(-1, res, cut_message("Out of range step"));
+    cut_assert_equal_int(EINVAL, errno, cut_message("Wrong errno"));
+
+    mifare_desfire_batch_free(batch);
+    mifare_desfire_key_free(des_key);
+    mifare_desfire_key_free(aes_key);
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_desfire_reauthenticate_allocations(void)
+{
+#ifdef HAVE_ALLOCATION_COUNT
+    int res;
+
+    // Allocations of libfreefare are only seen when it resolves malloc() here
+    allocation_count = 0;
+    free(mifare_desfire_aid_new(0x00123456));
+    res = allocation_count;
+    allocation_count = -1;
+    if (!res)
+	cut_omit("Allocations cannot be counted");
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[16] = { 0 };
+    MifareDESFireKey des_key = mifare_desfire_des_key_new_with_version(null_key_data);
+    MifareDESFireKey aes_key = mifare_desfire_aes_key_new(null_key_data);
+
+    res = mifare_desfire_authenticate(tag, 0, des_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    res = mifare_desfire_authenticate_aes(tag, 0, aes_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+
+    for (int n = 0; n < 16; n++) {
+	allocation_count = 0;
+	res = mifare_desfire_authenticate_aes(tag, 0, aes_key);
+	int count = allocation_count;
+	allocation_count = -1;
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+	cut_assert_equal_int(0, count, cut_message("Re-authentication allocated memory"));
+    }
+
+    mifare_desfire_key_free(des_key);
+    mifare_desfire_key_free(aes_key);
+
+    mifare_desfire_disconnect(tag);
+#else
+    cut_omit("Allocations cannot be counted");
+#endif
+}
+
+void
+test_freefare_emulator_mifare_desfire_plan(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[16] = { 0 };
+    MifareDESFireKey des_key = mifare_desfire_des_key_new_with_version(null_key_data);
+    MifareDESFireKey key_0 = mifare_desfire_aes_key_new(null_key_data);
+    MifareDESFireKey key_1 = mifare_desfire_aes_key_new(null_key_data);
+    MifareDESFireAID aid_a = mifare_desfire_aid_new(0x00111111);
+    MifareDESFireAID aid_b = mifare_desfire_aid_new(0x00222222);
+
+    res = mifare_desfire_authenticate(tag, 0, des_key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    res = mifare_desfire_create_application_aes(tag, aid_a, 0x0F, 2);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_create_application_aes(tag, aid_b, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+
+    res = mifare_desfire_select_application(tag, aid_a);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    res = mifare_desfire_authenticate(tag, 0, key_0);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    res = mifare_desfire_create_value_file(tag, 1, MDCM_MACED, 0x0000, 0, 1000, 100, 0);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_value_file() failed"));
+    res = mifare_desfire_create_std_data_file(tag, 2, MDCM_ENCIPHERED, 0x1111, 16);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+    res = mifare_desfire_select_application(tag, aid_b);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    res = mifare_desfire_authenticate(tag, 0, key_0);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    res = mifare_desfire_create_std_data_file(tag, 1, MDCM_MACED, 0x0000, 16);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+    int32_t value;
+    uint8_t data_a[16], data_b[16];
+    uint8_t written[16];
+    for (size_t i = 0; i < sizeof(written); i++)
+	written[i] = i + 1;
+
+    MifareDESFirePlan plan = mifare_desfire_plan_new();
+    cut_assert_not_null(plan, cut_message("mifare_desfire_plan_new() failed"));
+    cut_assert_equal_int(0, mifare_desfire_plan_get_value(plan, aid_a, 0, key_0, 1, &value), cut_message("Wrong operation index"));
+    cut_assert_equal_int(1, mifare_desfire_plan_read_data(plan, aid_b, 0, key_0, 1, 0, sizeof(data_b), data_b), cut_message("Wrong operation index"));
+    cut_assert_equal_int(2, mifare_desfire_plan_read_data(plan, aid_a, 1, key_1, 2, 0, sizeof(data_a), data_a), cut_message("Wrong operation index"));
+    cut_assert_equal_int(3, mifare_desfire_plan_debit(plan, aid_a, 0, key_0, 1, 10), cut_message("Wrong operation index"));
+    cut_assert_equal_int(4, mifare_desfire_plan_write_data(plan, aid_b, 0, key_0, 1, 0, sizeof(written), written), cut_message("Wrong operation index"));
+
+    /*
+     * select A, authenticate 0, get value, debit, commit, authenticate 1,
+     * read data, select B, authenticate 0, read data, write data, commit.
+     */
+    MifareDESFireBatch batch = mifare_desfire_plan_batch(plan);
+    cut_assert_not_null(batch, cut_message("mifare_desfire_plan_batch() failed"));
+    cut_assert_equal_int(12, mifare_desfire_batch_count(batch), cut_message("Wrong step count"));
+    const int expected_steps[] = { 2, 9, 6, 3, 10 };
+    for (int n = 0; n < 5; n++)
+	cut_assert_equal_int(expected_steps[n], mifare_desfire_plan_step(plan, n), cut_message("Wrong step for operation %d", n));
+
+    res = mifare_desfire_batch_run(tag, batch);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_batch_run() failed"));
+    cut_assert_equal_int(100, value, cut_message("Wrong value"));
+    cut_assert_equal_int(sizeof(data_a), mifare_desfire_batch_result(batch, mifare_desfire_plan_step(plan, 2)), cut_message("Wrong read length"));
+    mifare_desfire_batch_free(batch);
+
+    // The debit has been committed, and the data read before it is written
+    memset(data_b, 0xFF, sizeof(data_b));
+    batch = mifare_desfire_plan_batch(plan);
+    cut_assert_not_null(batch, cut_message("mifare_desfire_plan_batch() failed"));
+    res = mifare_desfire_batch_run(tag, batch);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_batch_run() failed"));
+    cut_assert_equal_int(90, value, cut_message("Wrong value"));
+    cut_assert_equal_memory(written, sizeof(written), data_b, sizeof(data_b), cut_message("Wrong data"));
+    mifare_desfire_batch_free(batch);
+
+    // Run the read of application A after the write in application B
+    res = mifare_desfire_plan_order(plan, 4, 2);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_plan_order() failed"));
+    batch = mifare_desfire_plan_batch(plan);
+    cut_assert_not_null(batch, cut_message("mifare_desfire_plan_batch() failed"));
+    cut_assert_equal_int(13, mifare_desfire_batch_count(batch), cut_message("Wrong step count"));
+    cut_assert_true(mifare_desfire_plan_step(plan, 4) < mifare_desfire_plan_step(plan, 2), cut_message("Ordering constraint not honoured"));
+    res = mifare_desfire_batch_run(tag, batch);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_batch_run() failed"));
+    mifare_desfire_batch_free(batch);
+
+    // Circular constraints
+    res = mifare_desfire_plan_order(plan, 2, 4);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_plan_order() failed"));
+    batch = mifare_desfire_plan_batch(plan);
+    cut_assert_null(batch, cut_message("mifare_desfire_plan_batch() should fail"));
+    cut_assert_equal_int(EINVAL, errno, cut_message("Wrong errno"));
+
+    res = mifare_desfire_plan_order(plan, 2, 5);
+    cut_assert_equal_int(-1, res, cut_message("mifare_desfire_plan_order() should fail"));
+
+    mifare_desfire_plan_free(plan);
+    free(aid_a);
+    free(aid_b);
+    mifare_desfire_key_free(des_key);
+    mifare_desfire_key_free(key_0);
+    mifare_desfire_key_free(key_1);
+
+    mifare_desfire_disconnect(tag);
+}
+
+struct stream_buffer {
+    uint8_t data[600];
+    size_t length;
+    int chunks;
+};
+
+static int
+stream_collect(FreefareTag t, const uint8_t *data, size_t length, void *user_data)
+{
+    struct stream_buffer *buffer = user_data;
+    (void) t;
+
+    cut_assert_true(buffer->length + length <= sizeof(buffer->data), cut_message("Too much data"));
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->chunks++;
+
+    return 0;
+}
+
+static void
+desfire_stream_files(FreefareTag t)
+{
+    int res;
+    uint8_t data[sizeof(((struct stream_buffer *)0)->data)];
+    struct stream_buffer buffer;
+
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = i * 3;
+
+    const uint8_t communication_settings[] = { MDCM_PLAIN, MDCM_MACED, MDCM_ENCIPHERED };
+    for (uint8_t file_no = 1; file_no <= sizeof(communication_settings); file_no++) {
+	res = mifare_desfire_create_std_data_file(t, file_no, communication_settings[file_no - 1], 0x0000, sizeof(data));
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+	res = mifare_desfire_write_data(t, file_no, 0, sizeof(data), data);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+
+	memset(&buffer, 0, sizeof(buffer));
+	res = mifare_desfire_read_data_stream(t, file_no, 0, 0, stream_collect, &buffer);
+	cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_read_data_stream() failed"));
+	cut_assert_equal_memory(data, sizeof(data), buffer.data, buffer.length, cut_message("Wrong data"));
+	cut_assert_true(buffer.chunks > 1, cut_message("Data should be streamed"));
+
+	/* The session is still in sync */
+	uint8_t read[16];
+	res = mifare_desfire_read_data(t, file_no, 32, sizeof(read), read);
+	cut_assert_equal_int(sizeof(read), res, cut_message("mifare_desfire_read_data() failed"));
+	cut_assert_equal_memory(data + 32, sizeof(read), read, sizeof(read), cut_message("Wrong data"));
+    }
+}
+
+void
+test_freefare_emulator_mifare_desfire_read_stream(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[8] = { 0 };
+    MifareDESFireKey key = mifare_desfire_des_key_new_with_version(null_key_data);
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application(tag, aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    desfire_stream_files(tag);
+
+    res = mifare_desfire_select_application(tag, NULL);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+
+    aid = mifare_desfire_aid_new(0x00654321);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    uint8_t aes_key_data[16] = { 0 };
+    key = mifare_desfire_aes_key_new(aes_key_data);
+    res = mifare_desfire_authenticate_aes(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+    mifare_desfire_key_free(key);
+
+    desfire_stream_files(tag);
+
+    /* Records are streamed as well */
+    res = mifare_desfire_create_linear_record_file(tag, 4, MDCM_ENCIPHERED, 0x0000, 24, 10);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_linear_record_file() failed"));
+    uint8_t record[24];
+    for (int i = 0; i < 10; i++) {
+	memset(record, i, sizeof(record));
+	res = mifare_desfire_write_record(tag, 4, 0, sizeof(record), record);
+	cut_assert_equal_int(sizeof(record), res, cut_message("mifare_desfire_write_record() failed"));
+	res = mifare_desfire_commit_transaction(tag);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_commit_transaction() failed"));
+    }
+
+    struct stream_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
+    res = mifare_desfire_read_records_stream(tag, 4, 0, 0, stream_collect, &buffer);
+    cut_assert_equal_int(10 * sizeof(record), res, cut_message("mifare_desfire_read_records_stream() failed"));
+    for (int i = 0; i < 10; i++) {
+	memset(record, i, sizeof(record));
+	cut_assert_equal_memory(record, sizeof(record), buffer.data + i * sizeof(record), sizeof(record), cut_message("Wrong record"));
+    }
+
+    mifare_desfire_disconnect(tag);
+}
+
+static int
+stream_compare(FreefareTag t, const uint8_t *data, size_t length, void *user_data)
+{
+    size_t *offset = user_data;
+    (void) t;
+
+    for (size_t i = 0; i < length; i++)
+	cut_assert_equal_int((uint8_t)(*offset + i), data[i], cut_message("Wrong data"));
+    *offset += length;
+
+    return 0;
+}
+
+void
+test_freefare_emulator_mifare_desfire_write_stream(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[8] = { 0 };
+    MifareDESFireKey key = mifare_desfire_des_key_new_with_version(null_key_data);
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 1);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    uint8_t aes_key_data[16] = { 0 };
+    key = mifare_desfire_aes_key_new(aes_key_data);
+    res = mifare_desfire_authenticate_aes(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+    mifare_desfire_key_free(key);
+
+    size_t length = 2048;
+    uint8_t *data = malloc(length);
+    for (size_t i = 0; i < length; i++)
+	data[i] = i;
+
+    const uint8_t communication_settings[] = { MDCM_PLAIN, MDCM_MACED, MDCM_ENCIPHERED };
+    for (uint8_t file_no = 1; file_no <= sizeof(communication_settings); file_no++) {
+	res = mifare_desfire_create_std_data_file(tag, file_no, communication_settings[file_no - 1], 0x0000, length);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+	res = mifare_desfire_write_data(tag, file_no, 0, length, data);
+	cut_assert_equal_int(length, res, cut_message("mifare_desfire_write_data() failed"));
+
+	size_t offset = 0;
+	res = mifare_desfire_read_data_stream(tag, file_no, 0, 0, stream_compare, &offset);
+	cut_assert_equal_int(length, res, cut_message("mifare_desfire_read_data_stream() failed"));
+    }
+
+    free(data);
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_mifare_desfire_write_frame_boundaries(void)
+{
+    int res;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t key_data[24] = { 0 };
+    MifareDESFireKey keys[] = {
+	mifare_desfire_aes_key_new(key_data),
+	mifare_desfire_3k3des_key_new(key_data),
+    };
+
+    /*
+     * The data of these writes exactly fills the last frame: 47 bytes follow
+     * the 8 bytes header in the first frame, and 54 in the next one.
+     */
+    const size_t lengths[] = { 47, 101 };
+    uint8_t data[101];
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = i;
+
+    for (size_t k = 0; k < sizeof(keys) / sizeof(*keys); k++) {
+	MifareDESFireKey master_key = mifare_desfire_des_key_new_with_version(key_data);
+	res = mifare_desfire_select_application(tag, NULL);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+	res = mifare_desfire_authenticate(tag, 0, master_key);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+	mifare_desfire_key_free(master_key);
+
+	MifareDESFireAID aid = mifare_desfire_aid_new(0x00123450 + k);
+	if (MIFARE_KEY_AES128 == keys[k]->type)
+	    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 1);
+	else
+	    res = mifare_desfire_create_application_3k3des(tag, aid, 0x0F, 1);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application() failed"));
+	res = mifare_desfire_select_application(tag, aid);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+	free(aid);
+
+	res = mifare_desfire_authenticate(tag, 0, keys[k]);
+	cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+
+	const uint8_t communication_settings[] = { MDCM_PLAIN, MDCM_MACED, MDCM_ENCIPHERED };
+	for (uint8_t file_no = 1; file_no <= sizeof(communication_settings); file_no++) {
+	    res = mifare_desfire_create_std_data_file(tag, file_no, communication_settings[file_no - 1], 0x0000, sizeof(data));
+	    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+	    for (size_t l = 0; l < sizeof(lengths) / sizeof(*lengths); l++) {
+		res = mifare_desfire_write_data(tag, file_no, 0, lengths[l], data);
+		cut_assert_equal_int(lengths[l], res, cut_message("mifare_desfire_write_data() failed (%zu bytes)", lengths[l]));
+
+		uint8_t read[sizeof(data)];
+		res = mifare_desfire_read_data(tag, file_no, 0, lengths[l], read);
+		cut_assert_equal_int(lengths[l], res, cut_message("mifare_desfire_read_data() failed (%zu bytes)", lengths[l]));
+		cut_assert_equal_memory(data, lengths[l], read, lengths[l], cut_message("Wrong data"));
+	    }
+	}
+	mifare_desfire_key_free(keys[k]);
+    }
+
+    mifare_desfire_disconnect(tag);
+}
+
+void
+test_freefare_emulator_tag_error(void)
+{
+    int res;
+    struct freefare_error_info error;
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+
+    freefare_get_tag_error(tag, &error);
+    cut_assert_equal_int(FREEFARE_ERROR_NONE, error.source, cut_message("Unexpected error record"));
+
+    struct mifare_desfire_version_info version_info;
+    res = mifare_desfire_get_version(tag, &version_info);
+    cut_assert_equal_int(-1, res, cut_message("mifare_desfire_get_version() should fail"));
+    freefare_get_tag_error(tag, &error);
+    cut_assert_equal_int(FREEFARE_ERROR_LOCAL, error.source, cut_message("Wrong error source"));
+    cut_assert_equal_int(ENXIO, error.error, cut_message("Wrong error"));
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00654321);
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(-1, res, cut_message("mifare_desfire_select_application() should fail"));
+    free(aid);
+
+    freefare_get_tag_error(tag, &error);
+    cut_assert_equal_int(FREEFARE_ERROR_PICC, error.source, cut_message("Wrong error source"));
+    cut_assert_equal_int(EIO, error.error, cut_message("Wrong error"));
+    cut_assert_equal_int(errno, error.error, cut_message("Record does not match errno"));
+    cut_assert_equal_int(0x5A, error.command, cut_message("Wrong command"));
+    cut_assert_equal_int(0, error.frame, cut_message("Wrong frame"));
+    cut_assert_equal_int(APPLICATION_NOT_FOUND, error.picc_status, cut_message("Wrong PICC status"));
+
+    freefare_reset_tag_error(tag);
+    freefare_get_tag_error(tag, &error);
+    cut_assert_equal_int(FREEFARE_ERROR_NONE, error.source, cut_message("Error record not cleared"));
+
+    mifare_desfire_disconnect(tag);
+}
+
+struct async_completion {
+    ssize_t result;
+    int error;
+};
+
+static struct async_completion async_completions[4];
+static size_t async_completion_count;
+
+static void
+async_completed(FreefareTag t, ssize_t result, int error, void *user_data)
+{
+    cut_assert_true(t == tag, cut_message("Wrong tag"));
+    cut_assert_equal_int(async_completion_count, (size_t)user_data, cut_message("Wrong completion order"));
+
+    async_completions[async_completion_count].result = result;
+    async_completions[async_completion_count].error = error;
+    async_completion_count++;
+}
+
+void
+test_freefare_emulator_async(void)
+{
+    int res;
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+
+    emulate(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+
+    MifareClassicKey default_key = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+
+    async = freefare_async_new();
+    cut_assert_not_null(async, cut_message("freefare_async_new() failed"));
+    async_completion_count = 0;
+
+    MifareClassicBlock data = "Emulated block!";
+    res = mifare_classic_write_async(async, tag, 0x05, data, async_completed, (void *)0);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_write_async() failed"));
+    memset(data, 0, sizeof(data));
+
+    MifareClassicBlock read;
+    res = mifare_classic_read_async(async, tag, 0x05, &read, async_completed, (void *)1);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read_async() failed"));
+
+    MifareClassicBlock other;
+    res = mifare_classic_read_async(async, tag, 0x08, &other, async_completed, (void *)2);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read_async() failed"));
+
+    cut_assert_equal_int(3, freefare_async_pending(async), cut_message("Wrong pending count"));
+
+    struct pollfd pfd = { .fd = freefare_async_get_fd(async), .events = POLLIN };
+    while (freefare_async_pending(async)) {
+	res = poll(&pfd, 1, 1000);
+	cut_assert_equal_int(1, res, cut_message("Timeout waiting for completions"));
+	freefare_async_dispatch(async);
+    }
+
+    cut_assert_equal_int(3, async_completion_count, cut_message("Wrong completion count"));
+    cut_assert_equal_int(0, async_completions[0].result, cut_message("mifare_classic_write_async() failed"));
+    cut_assert_equal_int(0, async_completions[1].result, cut_message("mifare_classic_read_async() failed"));
+    cut_assert_equal_memory("Emulated block!", sizeof(read), read, sizeof(read), cut_message("Wrong data"));
+    cut_assert_equal_int(-1, async_completions[2].result, cut_message("Reading another sector should fail"));
+    cut_assert_true(async_completions[2].error != 0, cut_message("Missing error"));
+
+    res = freefare_async_dispatch(async);
+    cut_assert_equal_int(0, res, cut_message("Nothing left to dispatch"));
+
+    mifare_classic_disconnect(tag);
+}
+
+static ssize_t
+async_nop(FreefareTag t, void *arg)
+{
+    (void) t;
+    (void) arg;
+
+    return 0;
+}
+
+static void
+async_count(FreefareTag t, ssize_t result, int error, void *user_data)
+{
+    (void) t;
+    (void) result;
+    (void) error;
+
+    (*(size_t *)user_data)++;
+}
+
+void
+test_freefare_emulator_async_backlog(void)
+{
+    int res;
+    size_t count = 0;
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+
+    // More completions than the pipe can hold bytes wait for dispatch
+    enum { COUNT = 100000 };
+
+    emulate(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+
+    async = freefare_async_new();
+    cut_assert_not_null(async, cut_message("freefare_async_new() failed"));
+
+    for (int i = 0; i < COUNT; i++) {
+	res = freefare_async_submit(async, tag, async_nop, NULL, async_count, &count);
+	cut_assert_equal_int(0, res, cut_message("freefare_async_submit() failed"));
+    }
+
+    // Let the worker complete them all before dispatching
+    usleep(500000);
+
+    struct pollfd pfd = { .fd = freefare_async_get_fd(async), .events = POLLIN };
+    while (freefare_async_pending(async)) {
+	res = poll(&pfd, 1, 1000);
+	cut_assert_equal_int(1, res, cut_message("Timeout waiting for completions"));
+	freefare_async_dispatch(async);
+    }
+
+    cut_assert_equal_int(COUNT, count, cut_message("Wrong completion count"));
+}
+
+/*
+ * Polling
+ */
+
+static int
+field_init(void *data)
+{
+    (void) data;
+
+    field.inits++;
+    return 0;
+}
+
+/*
+ * Each poll selects the next tag of the field using modulation, as tags
+ * halted by the initiator wake up again.
+ */
+static int
+field_select_passive_target(void *data, nfc_modulation modulation, nfc_target *target, void **tag_data)
+{
+    (void) data;
+
+    if (field.selects++ == field.fail_select)
+	return NFC_EIO;
+
+    for (size_t i = 0; i < field.count; i++) {
+	FreefareEmulator emu = field.emulators[field.next++ % field.count];
+	const nfc_target *t = freefare_emulator_get_target(emu);
+
+	if (t->nm.nmt == modulation.nmt) {
+	    *target = *t;
+	    *tag_data = emu;
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+static const struct freefare_initiator field_initiator = {
+    .init = field_init,
+    .select_passive_target = field_select_passive_target,
+    .transport = &freefare_emulator_transport,
+};
+
+static void
+field_add(enum freefare_tag_type type, const uint8_t *uid, size_t uid_len)
+{
+    FreefareEmulator emu = freefare_emulator_new(type, uid, uid_len);
+    cut_assert_not_null(emu, cut_message("freefare_emulator_new() failed"));
+    field.emulators[field.count++] = emu;
+}
+
+static void
+field_poller_new(void)
+{
+    field.fail_select = -1;
+
+    poller = freefare_poller_new(NULL);
+    cut_assert_not_null(poller, cut_message("freefare_poller_new() failed"));
+    freefare_poller_set_initiator(poller, &field_initiator, NULL);
+}
+
+void
+test_freefare_emulator_poller_enumerate(void)
+{
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+    const uint8_t idm[] = { 0x01, 0x2e, 0x4c, 0x1a, 0x0b, 0x3d, 0x5e, 0x7f };
+
+    field_add(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+    field_add(FELICA, idm, sizeof(idm));
+    field_add(MIFARE_DESFIRE, uid7, sizeof(uid7));
+    field_poller_new();
+
+    FreefareTag *tags = freefare_poller_get_tags(poller);
+    cut_assert_not_null(tags, cut_message("freefare_poller_get_tags() failed"));
+
+    /* ISO14443A targets are polled before FeliCa ones */
+    cut_assert_not_null(tags[0], cut_message("Missing tag"));
+    cut_assert_equal_int(MIFARE_CLASSIC_1K, freefare_get_tag_type(tags[0]), cut_message("Wrong tag type"));
+    cut_assert_not_null(tags[1], cut_message("Missing tag"));
+    cut_assert_equal_int(MIFARE_DESFIRE, freefare_get_tag_type(tags[1]), cut_message("Wrong tag type"));
+    cut_assert_not_null(tags[2], cut_message("Missing tag"));
+    cut_assert_equal_int(FELICA, freefare_get_tag_type(tags[2]), cut_message("Wrong tag type"));
+    cut_assert_null(tags[3], cut_message("Too many tags"));
+
+    /* Tags are bound to the transport of the initiator */
+    int res = mifare_classic_connect(tags[0]);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+    MifareClassicKey default_key = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    res = mifare_classic_authenticate(tags[0], 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+    mifare_classic_disconnect(tags[0]);
+
+    freefare_free_tags(tags);
+}
+
+static int
+poller_stop(FreefareTag t, void *data)
+{
+    *(FreefareTag *) data = t;
+    return 1;
+}
+
+void
+test_freefare_emulator_poller_early_stop(void)
+{
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+    const uint8_t idm[] = { 0x01, 0x2e, 0x4c, 0x1a, 0x0b, 0x3d, 0x5e, 0x7f };
+
+    field_add(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+    field_add(MIFARE_DESFIRE, uid7, sizeof(uid7));
+    field_add(FELICA, idm, sizeof(idm));
+    field_poller_new();
+
+    /* The enumeration stops as soon as the callback asks for it */
+    FreefareTag t = NULL;
+    int res = freefare_poller_enumerate_tags(poller, poller_stop, &t);
+    cut_assert_equal_int(1, res, cut_message("Wrong tag count"));
+    cut_assert_not_null(t, cut_message("No tag"));
+    cut_assert_equal_int(MIFARE_CLASSIC_1K, freefare_get_tag_type(t), cut_message("Wrong tag type"));
+    cut_assert_equal_int(1, field.selects, cut_message("Polling went on after the callback stopped it"));
+    freefare_free_tag(t);
+}
+
+void
+test_freefare_emulator_poller_warm(void)
+{
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+    const uint8_t idm[] = { 0x01, 0x2e, 0x4c, 0x1a, 0x0b, 0x3d, 0x5e, 0x7f };
+    FreefareTag *tags;
+
+    field_add(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+    field_add(FELICA, idm, sizeof(idm));
+    field_poller_new();
+
+    /* The initiator is only configured on first use */
+    for (int n = 0; n < 3; n++) {
+	tags = freefare_poller_get_tags(poller);
+	cut_assert_not_null(tags, cut_message("freefare_poller_get_tags() failed"));
+	cut_assert_not_null(tags[1], cut_message("Missing tag"));
+	freefare_free_tags(tags);
+	cut_assert_equal_int(1, field.inits, cut_message("Initiator configured again"));
+    }
+
+    /* A poll failing before any tag is found is retried after configuring
+     * the initiator again */
+    field.fail_select = field.selects;
+    tags = freefare_poller_get_tags(poller);
+    cut_assert_not_null(tags, cut_message("freefare_poller_get_tags() failed"));
+    cut_assert_not_null(tags[1], cut_message("Missing tag"));
+    freefare_free_tags(tags);
+    cut_assert_equal_int(2, field.inits, cut_message("Initiator not configured again"));
+
+    /* Tags already handed over cannot be polled again */
+    field.fail_select = field.selects + 1;
+    tags = freefare_poller_get_tags(poller);
+    cut_assert_null(tags, cut_message("freefare_poller_get_tags() should fail"));
+    cut_assert_equal_int(2, field.inits, cut_message("Initiator configured again"));
+
+    /* The next poll starts over */
+    tags = freefare_poller_get_tags(poller);
+    cut_assert_not_null(tags, cut_message("freefare_poller_get_tags() failed"));
+    cut_assert_not_null(tags[1], cut_message("Missing tag"));
+    freefare_free_tags(tags);
+    cut_assert_equal_int(3, field.inits, cut_message("Initiator not configured again"));
+}
+
+void
+test_freefare_emulator_poller_ultralight_family(void)
+{
+    const uint8_t uid_ultralight[] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x01 };
+    const uint8_t uid_ultralight_ev1[] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x02 };
+    const uint8_t uid_ultralightc[] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x03 };
+    const uint8_t uid_ntag[] = { 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x04 };
+    const uint8_t ultralight_ev1_version[8] = { 0x00, 0x04, 0x03, 0x01, 0x01, 0x00, 0x0B, 0x03 };
+
+    /* All these tags have a SAK of 0x00 and are told apart by probing them */
+    field_add(MIFARE_ULTRALIGHT, uid_ultralight, sizeof(uid_ultralight));
+    field_add(MIFARE_ULTRALIGHT, uid_ultralight_ev1, sizeof(uid_ultralight_ev1));
+    freefare_emulator_set_version(field.emulators[1], ultralight_ev1_version);
+    field_add(MIFARE_ULTRALIGHT_C, uid_ultralightc, sizeof(uid_ultralightc));
+    field_add(NTAG_21x, uid_ntag, sizeof(uid_ntag));
+    field_poller_new();
+
+    FreefareTag *tags = freefare_poller_get_tags(poller);
+    cut_assert_not_null(tags, cut_message("freefare_poller_get_tags() failed"));
+
+    const enum freefare_tag_type types[] = { MIFARE_ULTRALIGHT, MIFARE_ULTRALIGHT, MIFARE_ULTRALIGHT_C, NTAG_21x };
+    for (size_t i = 0; i < sizeof(types) / sizeof(*types); i++) {
+	cut_assert_not_null(tags[i], cut_message("Missing tag %zu", i));
+	cut_assert_equal_int(types[i], freefare_get_tag_type(tags[i]), cut_message("Wrong type for tag %zu", i));
+    }
+    cut_assert_null(tags[4], cut_message("Too many tags"));
+
+    /* The version read when identifying the NTAG21x is kept */
+    FreefareTag ntag = tags[3];
+    cut_assert_equal_int(0, freefare_enable_tag_stats(ntag, true), cut_message("freefare_enable_tag_stats() failed"));
+    int res = ntag21x_connect(ntag);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_connect() failed"));
+    res = ntag21x_get_info(ntag);
+    cut_assert_equal_int(0, res, cut_message("ntag21x_get_info() failed"));
+    cut_assert_equal_int(NTAG_213, ntag21x_get_subtype(ntag), cut_message("Wrong subtype"));
+    struct freefare_tag_stats stats;
+    res = freefare_get_tag_stats(ntag, &stats);
+    cut_assert_equal_int(0, res, cut_message("freefare_get_tag_stats() failed"));
+    cut_assert_equal_int(0, stats.commands[0x60].frames, cut_message("GET_VERSION sent again"));
+    ntag21x_disconnect(ntag);
+
+    freefare_free_tags(tags);
+}
+
+/*
+ * The reader pool is given emulators in place of NFC devices, each of them
+ * having a tag in its field at every poll.
+ */
+static int pool_jobs;
+static int pool_running_jobs;
+static int pool_max_running_jobs;
+static int pool_failed_jobs;
+static int pool_stop_after;
+
+static int
+pool_enumerate(nfc_device *device, int (*callback)(FreefareTag tag, void *data), void *data)
+{
+    FreefareTag t = freefare_emulator_tag_new((FreefareEmulator) device);
+
+    if (!t)
+	return -1;
+    callback(t, data);
+
+    return 1;
+}
+
+static int
+pool_job(FreefareTag t, void *data)
+{
+    MifareUltralightPage page;
+    (void) data;
+
+    int running = __atomic_add_fetch(&pool_running_jobs, 1, __ATOMIC_SEQ_CST);
+    int max = __atomic_load_n(&pool_max_running_jobs, __ATOMIC_SEQ_CST);
+    while ((running > max) && !__atomic_compare_exchange_n(&pool_max_running_jobs, &max, running, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	;
+
+    // Tags are connected
+    if (mifare_ultralight_read(t, 0x04, &page) < 0)
+	__atomic_add_fetch(&pool_failed_jobs, 1, __ATOMIC_SEQ_CST);
+    usleep(5000);
+
+    __atomic_sub_fetch(&pool_running_jobs, 1, __ATOMIC_SEQ_CST);
+    int jobs = __atomic_add_fetch(&pool_jobs, 1, __ATOMIC_SEQ_CST);
+
+    return pool_stop_after && (jobs >= pool_stop_after);
+}
+
+void
+test_freefare_emulator_reader_pool(void)
+{
+    nfc_device *devices[POOL_DEVICE_COUNT];
+    int res;
+
+    for (int i = 0; i < POOL_DEVICE_COUNT; i++) {
+	pool_emulators[i] = freefare_emulator_new(MIFARE_ULTRALIGHT, uid7, sizeof(uid7));
+	cut_assert_not_null(pool_emulators[i], cut_message("freefare_emulator_new() failed"));
+	devices[i] = (nfc_device *) pool_emulators[i];
+    }
+
+    pool = freefare_reader_pool_new(devices, POOL_DEVICE_COUNT, POOL_MAX_JOBS, pool_job, NULL);
+    cut_assert_not_null(pool, cut_message("freefare_reader_pool_new() failed"));
+    freefare_reader_pool_set_enumerator(pool, pool_enumerate);
+
+    res = freefare_reader_pool_start(pool);
+    cut_assert_equal_int(0, res, cut_message("freefare_reader_pool_start() failed"));
+    res = freefare_reader_pool_start(pool);
+    cut_assert_equal_int(-1, res, cut_message("Pool started twice"));
+    cut_assert_equal_int(EBUSY, errno, cut_message("Wrong errno"));
+
+    // Let each device poll a few times
+    for (int n = 0; (n < 500) && (__atomic_load_n(&pool_jobs, __ATOMIC_SEQ_CST) < 3 * POOL_DEVICE_COUNT); n++)
+	usleep(10000);
+    cut_assert_true(freefare_reader_pool_is_running(pool), cut_message("Pool not running"));
+
+    res = freefare_reader_pool_stop(pool);
+    cut_assert_equal_int(0, res, cut_message("freefare_reader_pool_stop() failed"));
+    cut_assert_false(freefare_reader_pool_is_running(pool), cut_message("Pool still running"));
+
+    int jobs = pool_jobs;
+    cut_assert_true(jobs >= 3 * POOL_DEVICE_COUNT, cut_message("Too few jobs run (%d)", jobs));
+    cut_assert_equal_int(0, pool_failed_jobs, cut_message("Jobs could not read their tag"));
+    cut_assert_true(pool_max_running_jobs <= POOL_MAX_JOBS, cut_message("Job limit exceeded (%d)", pool_max_running_jobs));
+    cut_assert_equal_int(0, pool_running_jobs, cut_message("Jobs still running"));
+
+    usleep(250000);
+    cut_assert_equal_int(jobs, pool_jobs, cut_message("Jobs run after stop"));
+
+    // A job returning non-zero ends polling, and the pool can be restarted
+    pool_jobs = 0;
+    pool_stop_after = 5;
+    res = freefare_reader_pool_start(pool);
+    cut_assert_equal_int(0, res, cut_message("freefare_reader_pool_start() failed"));
+
+    for (int n = 0; (n < 500) && freefare_reader_pool_is_running(pool); n++)
+	usleep(10000);
+    cut_assert_false(freefare_reader_pool_is_running(pool), cut_message("Pool not ended by job"));
+
+    res = freefare_reader_pool_stop(pool);
+    cut_assert_equal_int(0, res, cut_message("freefare_reader_pool_stop() failed"));
+
+    // Only the jobs already running when the pool ended could complete
+    cut_assert_true(pool_jobs >= pool_stop_after, cut_message("Too few jobs run (%d)", pool_jobs));
+    cut_assert_true(pool_jobs < pool_stop_after + POOL_MAX_JOBS, cut_message("Jobs run after the pool ended (%d)", pool_jobs));
+    cut_assert_equal_int(0, pool_failed_jobs, cut_message("Jobs could not read their tag"));
+}
+
+#define TRACE_PATH "test_freefare_emulator.trace"
+
+void
+test_freefare_emulator_trace(void)
+{
+    int res;
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+
+    remove(TRACE_PATH);
+
+    FreefareTrace trace = freefare_trace_create(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_create() failed"));
+
+    emulate(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+    res = freefare_set_tag_trace(tag, trace);
+    cut_assert_equal_int(0, res, cut_message("freefare_set_tag_trace() failed"));
+
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+    MifareClassicKey default_key = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+    MifareClassicBlock data = "Recorded block!";
+    res = mifare_classic_write(tag, 0x05, data);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_write() failed"));
+    MifareClassicBlock read;
+    res = mifare_classic_read(tag, 0x05, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read() failed"));
+    mifare_classic_disconnect(tag);
+
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_emulator_free(emulator);
+    emulator = NULL;
+    freefare_trace_free(trace);
+
+    trace = freefare_trace_open(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_open() failed"));
+    cut_assert_equal_int(1, freefare_trace_get_session_count(trace), cut_message("Wrong session count"));
+
+    int frames = 0;
+    const struct freefare_trace_record *record = freefare_trace_next_record(trace, NULL);
+    cut_assert_equal_int(FREEFARE_TRACE_SESSION, record->type, cut_message("Wrong first record"));
+    cut_assert_equal_int(MIFARE_CLASSIC_1K, record->result, cut_message("Wrong tag type"));
+    while ((record = freefare_trace_next_record(trace, record))) {
+	cut_assert_equal_int(FREEFARE_TRACE_FRAME, record->type, cut_message("Wrong record type"));
+	frames++;
+    }
+    cut_assert_equal_int(3, frames, cut_message("Wrong frame count"));
+
+    /* Replay the session without the emulator */
+    tag = freefare_trace_tag_new(trace, 0);
+    cut_assert_not_null(tag, cut_message("freefare_trace_tag_new() failed"));
+    cut_assert_equal_int(MIFARE_CLASSIC_1K, freefare_get_tag_type(tag), cut_message("Wrong tag type"));
+
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+    res = mifare_classic_write(tag, 0x05, data);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_write() failed"));
+    memset(read, 0, sizeof(read));
+    res = mifare_classic_read(tag, 0x05, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+    /* The session is over */
+    res = mifare_classic_read(tag, 0x05, &read);
+    cut_assert_equal_int(-1, res, cut_message("Reading past the end of the trace should fail"));
+
+    freefare_free_tag(tag);
+    tag = NULL;
+
+    /* A frame which was not recorded diverges from the trace */
+    tag = freefare_trace_tag_new(trace, 0);
+    cut_assert_not_null(tag, cut_message("freefare_trace_tag_new() failed"));
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_B);
+    cut_assert_equal_int(-1, res, cut_message("Diverging from the trace should fail"));
+
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_trace_free(trace);
+    remove(TRACE_PATH);
+}
+
+static void
+trace_mifare_desfire_session(void)
+{
+    int res;
+
+    res = mifare_desfire_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_connect() failed"));
+
+    uint8_t null_key_data[8] = { 0 };
+    MifareDESFireKey key = mifare_desfire_des_key_new_with_version(null_key_data);
+    res = mifare_desfire_authenticate(tag, 0, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    MifareDESFireAID aid = mifare_desfire_aid_new(0x00123456);
+    res = mifare_desfire_create_application_aes(tag, aid, 0x0F, 2);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_application_aes() failed"));
+    res = mifare_desfire_select_application(tag, aid);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_select_application() failed"));
+    free(aid);
+
+    uint8_t aes_key_data[16] = { 0 };
+    key = mifare_desfire_aes_key_new(aes_key_data);
+    res = mifare_desfire_authenticate_aes(tag, 1, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_authenticate_aes() failed"));
+    mifare_desfire_key_free(key);
+
+    res = mifare_desfire_create_std_data_file(tag, 1, MDCM_ENCIPHERED, 0x1111, 32);
+    cut_assert_equal_int(0, res, cut_message("mifare_desfire_create_std_data_file() failed"));
+
+    uint8_t data[20] = "Enciphered & traced";
+    res = mifare_desfire_write_data(tag, 1, 0, sizeof(data), data);
+    cut_assert_equal_int(sizeof(data), res, cut_message("mifare_desfire_write_data() failed"));
+
+    uint8_t read[sizeof(data)];
+    res = mifare_desfire_read_data(tag, 1, 0, sizeof(read), read);
+    cut_assert_equal_int(sizeof(read), res, cut_message("mifare_desfire_read_data() failed"));
+    cut_assert_equal_memory(data, sizeof(data), read, sizeof(read), cut_message("Wrong data"));
+
+    mifare_desfire_disconnect(tag);
+}
+
+static void
+trace_mifare_ultralightc_session(void)
+{
+    int res;
+
+    res = mifare_ultralight_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralight_connect() failed"));
+
+    uint8_t key_data[16] = { 'I', 'E', 'M', 'K', 'A', 'E', 'R', 'B', '!', 'N', 'A', 'C', 'U', 'O', 'Y', 'F' };
+    MifareDESFireKey key = mifare_desfire_3des_key_new(key_data);
+    res = mifare_ultralightc_authenticate(tag, key);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralightc_authenticate() failed"));
+    mifare_desfire_key_free(key);
+
+    MifareUltralightPage read;
+    res = mifare_ultralight_read(tag, 0x10, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralight_read() failed"));
+
+    mifare_ultralight_disconnect(tag);
+}
+
+void
+test_freefare_emulator_trace_authentication(void)
+{
+    int res;
+
+    remove(TRACE_PATH);
+
+    FreefareTrace trace = freefare_trace_create(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_create() failed"));
+
+    emulate(MIFARE_DESFIRE, uid7, sizeof(uid7));
+    res = freefare_set_tag_trace(tag, trace);
+    cut_assert_equal_int(0, res, cut_message("freefare_set_tag_trace() failed"));
+    trace_mifare_desfire_session();
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_emulator_free(emulator);
+    emulator = NULL;
+
+    emulate(MIFARE_ULTRALIGHT_C, uid7, sizeof(uid7));
+    res = freefare_set_tag_trace(tag, trace);
+    cut_assert_equal_int(0, res, cut_message("freefare_set_tag_trace() failed"));
+    trace_mifare_ultralightc_session();
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_emulator_free(emulator);
+    emulator = NULL;
+    freefare_trace_free(trace);
+
+    trace = freefare_trace_open(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_open() failed"));
+    cut_assert_equal_int(2, freefare_trace_get_session_count(trace), cut_message("Wrong session count"));
+
+    /* Each authentication recorded its challenge */
+    int randoms[2] = { 0, 0 };
+    const struct freefare_trace_record *record = NULL;
+    while ((record = freefare_trace_next_record(trace, record))) {
+	if (FREEFARE_TRACE_RANDOM == record->type) {
+	    cut_assert_equal_int(record->result, record->rx_len, cut_message("Wrong random bytes count"));
+	    randoms[record->session]++;
+	}
+    }
+    cut_assert_equal_int(2, randoms[0], cut_message("Wrong MIFARE DESFire random records count"));
+    cut_assert_equal_int(1, randoms[1], cut_message("Wrong MIFARE Ultralight C random records count"));
+
+    /* Authenticated sessions replay without the emulators */
+    tag = freefare_trace_tag_new(trace, 0);
+    cut_assert_not_null(tag, cut_message("freefare_trace_tag_new() failed"));
+    trace_mifare_desfire_session();
+    freefare_free_tag(tag);
+
+    tag = freefare_trace_tag_new(trace, 1);
+    cut_assert_not_null(tag, cut_message("freefare_trace_tag_new() failed"));
+    trace_mifare_ultralightc_session();
+    freefare_free_tag(tag);
+
+    /* Skipping the authentication diverges from the trace */
+    tag = freefare_trace_tag_new(trace, 1);
+    cut_assert_not_null(tag, cut_message("freefare_trace_tag_new() failed"));
+    res = mifare_ultralight_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_ultralight_connect() failed"));
+    MifareUltralightPage read;
+    res = mifare_ultralight_read(tag, 0x10, &read);
+    cut_assert_equal_int(-1, res, cut_message("Diverging from the trace should fail"));
+
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_trace_free(trace);
+    remove(TRACE_PATH);
+}
+
+static off_t
+trace_file_size(void)
+{
+    struct stat st;
+
+    cut_assert_equal_int(0, stat(TRACE_PATH, &st), cut_message("stat() failed"));
+    return st.st_size;
+}
+
+static void
+trace_mifare_classic_session(FreefareTrace trace)
+{
+    int res;
+    const uint8_t uid4[] = { 0xde, 0xad, 0xbe, 0xef };
+
+    emulate(MIFARE_CLASSIC_1K, uid4, sizeof(uid4));
+    res = freefare_set_tag_trace(tag, trace);
+    cut_assert_equal_int(0, res, cut_message("freefare_set_tag_trace() failed"));
+
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+    MifareClassicKey default_key = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+    MifareClassicBlock read;
+    res = mifare_classic_read(tag, 0x05, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read() failed"));
+    mifare_classic_disconnect(tag);
+}
+
+void
+test_freefare_emulator_trace_append(void)
+{
+    int res;
+
+    remove(TRACE_PATH);
+
+    FreefareTrace trace = freefare_trace_create(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_create() failed"));
+    off_t header_size = trace_file_size();
+
+    /* Records are buffered until flushed */
+    trace_mifare_classic_session(trace);
+    cut_assert_equal_int(header_size, trace_file_size(), cut_message("Records should be buffered"));
+    res = freefare_trace_flush(trace);
+    cut_assert_equal_int(0, res, cut_message("freefare_trace_flush() failed"));
+    off_t size = trace_file_size();
+    cut_assert_true(size > header_size, cut_message("Records not flushed"));
+
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_emulator_free(emulator);
+    emulator = NULL;
+    freefare_trace_free(trace);
+
+    /* Interrupt the recording in the middle of the last record */
+    res = truncate(TRACE_PATH, size - 4);
+    cut_assert_equal_int(0, res, cut_message("truncate() failed"));
+
+    trace = freefare_trace_create(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_create() failed"));
+    trace_mifare_classic_session(trace);
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_emulator_free(emulator);
+    emulator = NULL;
+    freefare_trace_free(trace);
+
+    /* The new session follows the complete records */
+    trace = freefare_trace_open(TRACE_PATH);
+    cut_assert_not_null(trace, cut_message("freefare_trace_open() failed"));
+    cut_assert_equal_int(2, freefare_trace_get_session_count(trace), cut_message("Wrong session count"));
+
+    int frames[2] = { 0, 0 };
+    off_t records_size = header_size;
+    const struct freefare_trace_record *record = NULL;
+    while ((record = freefare_trace_next_record(trace, record))) {
+	cut_assert_true(record->session < 2, cut_message("Wrong session"));
+	if (FREEFARE_TRACE_FRAME == record->type)
+	    frames[record->session]++;
+	records_size += record->size;
+    }
+    cut_assert_equal_int(1, frames[0], cut_message("Wrong frame count in the truncated session"));
+    cut_assert_equal_int(2, frames[1], cut_message("Wrong frame count in the appended session"));
+    cut_assert_equal_int(trace_file_size(), records_size, cut_message("Records do not span the whole trace"));
+
+    tag = freefare_trace_tag_new(trace, 1);
+    cut_assert_not_null(tag, cut_message("freefare_trace_tag_new() failed"));
+    res = mifare_classic_connect(tag);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_connect() failed"));
+    MifareClassicKey default_key = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    res = mifare_classic_authenticate(tag, 0x04, default_key, MFC_KEY_A);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_authenticate() failed"));
+    MifareClassicBlock read;
+    res = mifare_classic_read(tag, 0x05, &read);
+    cut_assert_equal_int(0, res, cut_message("mifare_classic_read() failed"));
+
+    freefare_free_tag(tag);
+    tag = NULL;
+    freefare_trace_free(trace);
+    remove(TRACE_PATH);
+}
@@ -67,6 +67,35 @@ test_mad_crc8_basic(void)
     cut_assert_equal_int(0x00, crc, cut_message("CRC should verify crc(message + crc(message)) = 0"));
 }
 
+/*
+ * Bit-at-a-time reference implementation of the MAD CRC.
+ */
+static void
+nxp_crc_reference(uint8_t *crc, const uint8_t value)
+{
+    *crc ^= value;
+    for (int current_bit = 7; current_bit >= 0; current_bit--) {
+	int bit_out = (*crc) & 0x80;
+	*crc <<= 1;
+	if (bit_out)
+	    *crc ^= 0x1d;
+    }
+}
+
+void
+test_mad_crc8_table(void)
+{
+    for (int c = 0; c < 256; c++) {
+	for (int v = 0; v < 256; v++) {
+	    uint8_t crc = c, expected_crc = c;
+	    nxp_crc(&crc, v);
+	    nxp_crc_reference(&expected_crc, v);
+	    if (crc != expected_crc)
+		cut_fail("Wrong CRC for crc = 0x%02x, value = 0x%02x", c, v);
+	}
+    }
+}
+
 /*
  * The following MAD values where extracted from documentation.
  */
@@ -4,6 +4,10 @@
  * NIST Special Publication 800-38B
  * Recommendation for Block Cipher Modes of Operation: The CMAC Mode for Authentication
  * May 2005
+ *
+ * NIST Special Publication 800-38A
+ * Recommendation for Block Cipher Modes of Operation: Methods and Techniques
+ * December 2001
  */
 
 #include <cutter.h>
@@ -180,3 +184,101 @@ test_mifare_desfire_aes_cmac_512(void)
 
     mifare_desfire_key_free(key);
 }
+
+void
+test_mifare_desfire_aes_cmac_incremental(void)
+{
+    MifareDESFireKey key = mifare_desfire_aes_key_new(key_data);
+    cmac_generate_subkeys(key);
+
+    uint8_t message[] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11
+    };
+
+    uint8_t expected_cmac[] = {
+	0xdf, 0xa6, 0x67, 0x47,
+	0xde, 0x9a, 0xe6, 0x30,
+	0x30, 0xca, 0x32, 0x61,
+	0x14, 0x97, 0xc8, 0x27
+    };
+
+    /* Split the message at every position, with an empty update too */
+    for (size_t split = 0; split <= sizeof(message); split++) {
+	uint8_t ivect[16];
+	memset(ivect, 0, sizeof(ivect));
+
+	struct mifare_cmac_ctx ctx;
+	uint8_t my_cmac[16];
+	cmac_init(&ctx, key, ivect);
+	cmac_update(&ctx, message, split);
+	cmac_update(&ctx, message + split, 0);
+	cmac_update(&ctx, message + split, sizeof(message) - split);
+	cmac_final(&ctx, my_cmac);
+
+	cut_assert_equal_memory(expected_cmac, 16, my_cmac, 16, cut_message("Wrong CMAC when split at %zu", split));
+    }
+
+    mifare_desfire_key_free(key);
+}
+
+void
+test_mifare_desfire_aes_cbc(void)
+{
+    MifareDESFireKey key = mifare_desfire_aes_key_new(key_data);
+
+    uint8_t message[] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+    };
+
+    uint8_t expected_ciphertext[] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+	0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+	0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+	0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+	0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+    };
+
+    uint8_t iv[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+    };
+
+    uint8_t data[sizeof(message)];
+    uint8_t ivect[16];
+
+    /* Whole buffer */
+    memcpy(data, message, sizeof(data));
+    memcpy(ivect, iv, sizeof(ivect));
+    mifare_cypher_blocks_chained(NULL, key, ivect, data, sizeof(data), MCD_SEND, MCO_ENCYPHER);
+    cut_assert_equal_memory(expected_ciphertext, sizeof(expected_ciphertext), data, sizeof(data), cut_message("Wrong ciphertext"));
+    cut_assert_equal_memory(expected_ciphertext + 48, 16, ivect, 16, cut_message("Wrong IV"));
+
+    memcpy(ivect, iv, sizeof(ivect));
+    mifare_cypher_blocks_chained(NULL, key, ivect, data, sizeof(data), MCD_RECEIVE, MCO_DECYPHER);
+    cut_assert_equal_memory(message, sizeof(message), data, sizeof(data), cut_message("Wrong plaintext"));
+    cut_assert_equal_memory(expected_ciphertext + 48, 16, ivect, 16, cut_message("Wrong IV"));
+
+    /* Block by block */
+    memcpy(ivect, iv, sizeof(ivect));
+    for (size_t n = 0; n < sizeof(data); n += 16) {
+	memcpy(data + n, message + n, 16);
+	mifare_cypher_single_block(key, data + n, ivect, MCD_SEND, MCO_ENCYPHER, 16);
+    }
+    cut_assert_equal_memory(expected_ciphertext, sizeof(expected_ciphertext), data, sizeof(data), cut_message("Wrong ciphertext"));
+
+    mifare_desfire_key_free(key);
+}
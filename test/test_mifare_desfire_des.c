@@ -1,4 +1,5 @@
 #include <cutter.h>
+#include <string.h>
 #include <freefare.h>
 #include "freefare_internal.h"
 
@@ -73,3 +74,62 @@ test_mifare_desfire_padded_data_length(void)
     res = padded_data_length(33, 16);
     cut_assert_equal_int(res, 48, cut_message("Invalid size"));
 }
+
+/*
+ * Bit-at-a-time reference implementation of the DESFire CRC32.
+ */
+static uint32_t
+desfire_crc32_reference(const uint8_t *data, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < len; i++) {
+	crc ^= data[i];
+	for (int current_bit = 7; current_bit >= 0; current_bit--) {
+	    int bit_out = crc & 0x00000001;
+	    crc >>= 1;
+	    if (bit_out)
+		crc ^= 0xEDB88320;
+	}
+    }
+
+    return crc;
+}
+
+void
+test_mifare_desfire_crc32(void)
+{
+    uint8_t crc[4];
+
+    /* CRC-32 check value 0xCBF43926 without the final xor */
+    desfire_crc32((const uint8_t *)"123456789", 9, crc);
+    uint8_t expected_check[4] = { 0xd9, 0xc6, 0x0b, 0x34 };
+    cut_assert_equal_memory(expected_check, 4, crc, 4, cut_message("Wrong check value"));
+
+    uint8_t data[67];
+    for (size_t i = 0; i < sizeof(data); i++)
+	data[i] = i * 37 + 11;
+
+    /* Cover every length and alignment around the 8 bytes kernel */
+    for (size_t offset = 0; offset < 8; offset++) {
+	for (size_t len = 0; len <= sizeof(data) - offset; len++) {
+	    uint32_t expected = desfire_crc32_reference(data + offset, len);
+	    uint8_t expected_crc[4] = { expected, expected >> 8, expected >> 16, expected >> 24 };
+
+	    desfire_crc32(data + offset, len, crc);
+	    cut_assert_equal_memory(expected_crc, 4, crc, 4, cut_message("Wrong CRC for %zu bytes at offset %zu", len, offset));
+
+	    /* Split updates must match a single pass */
+	    uint32_t split = desfire_crc32_update(0xFFFFFFFF, data + offset, len / 3);
+	    split = desfire_crc32_update(split, data + offset + len / 3, len - len / 3);
+	    cut_assert_equal_int(expected, split, cut_message("Wrong split CRC for %zu bytes", len));
+	}
+    }
+
+    /* Appending the CRC of a message gives a residue of 0 */
+    uint8_t msg[13] = "Hello DESFire";
+    uint8_t msg_crc[17];
+    memcpy(msg_crc, msg, 13);
+    desfire_crc32_append(msg_crc, 13);
+    cut_assert_equal_int(0, desfire_crc32_update(0xFFFFFFFF, msg_crc, 17), cut_message("Non-zero residue"));
+}
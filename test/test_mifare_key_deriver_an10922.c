@@ -1,4 +1,6 @@
 #include <cutter.h>
+#include <errno.h>
+#include <string.h>
 
 #include <freefare.h>
 #include "freefare_internal.h"
@@ -228,3 +230,150 @@ test_mifare_key_deriver_an10922_3k3des(void)
     mifare_desfire_key_free(derived_key);
     mifare_desfire_key_free(key);
 }
+
+static void
+check_batch(MifareDESFireKey key, MifareKeyType output_key_type, int flags, const uint8_t *expected, int expected_len)
+{
+    MifareKeyDeriver deriver = mifare_key_deriver_new_an10922(key, output_key_type, flags);
+    int max_len = key_block_size(key) * 2 - 1;
+
+    // The AN10922 example input first, then all lengths with various data
+    enum { COUNT = 300 };
+    uint8_t inputs[COUNT][32];
+    const uint8_t *data[COUNT];
+    size_t data_len[COUNT];
+
+    memcpy(inputs[0], "\x04\x78\x2E\x21\x80\x1D\x80\x30\x42\xF5NXP Abu", 17);
+    data_len[0] = MIN(17, max_len);
+    data[0] = inputs[0];
+    for (int i = 1; i < COUNT; i++) {
+	for (int n = 0; n < 32; n++)
+	    inputs[i][n] = i * 13 + n * 7;
+	data[i] = inputs[i];
+	data_len[i] = i % (max_len + 1);
+    }
+
+    uint8_t expected_bytes[COUNT][24];
+    for (int i = 0; i < COUNT; i++) {
+	cut_assert_equal_int(0, mifare_key_deriver_begin(deriver), cut_message("mifare_key_deriver_begin failed"));
+	cut_assert_equal_int(0, mifare_key_deriver_update_data(deriver, data[i], data_len[i]), cut_message("mifare_key_deriver_update_data failed"));
+	cut_assert_equal_int(expected_len, mifare_key_deriver_end_raw(deriver, expected_bytes[i], 24), cut_message("mifare_key_deriver_end_raw failed"));
+    }
+    if (expected)
+	cut_assert_equal_memory(expected, expected_len, expected_bytes[0], expected_len, cut_message("Wrong derived key"));
+
+    const unsigned int threads[] = { 1, 3, 0 };
+    for (size_t t = 0; t < sizeof(threads) / sizeof(*threads); t++) {
+	uint8_t diversified_bytes[COUNT * 24];
+	int ret = mifare_key_deriver_end_raw_batch(deriver, data, data_len, COUNT, diversified_bytes, threads[t]);
+	cut_assert_equal_int(expected_len, ret, cut_message("mifare_key_deriver_end_raw_batch failed"));
+	for (int i = 0; i < COUNT; i++)
+	    cut_assert_equal_memory(expected_bytes[i], expected_len, diversified_bytes + i * expected_len, expected_len, cut_message("Wrong derived key %d with %u threads", i, threads[t]));
+    }
+
+    // Inputs that do not fit are rejected before anything is derived
+    data_len[COUNT / 2] = max_len + 1;
+    int ret = mifare_key_deriver_end_raw_batch(deriver, data, data_len, COUNT, expected_bytes[0], 1);
+    cut_assert_equal_int(-1, ret, cut_message("Overflow not detected"));
+    cut_assert_equal_int(EOVERFLOW, errno, cut_message("Wrong errno"));
+
+    mifare_key_deriver_free(deriver);
+}
+
+void
+test_mifare_key_deriver_an10922_batch(void)
+{
+    uint8_t aes128_data[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0XEE, 0xFF };
+    uint8_t aes128_derived_data[16] = { 0xA8, 0xDD, 0x63, 0xA3, 0xB8, 0x9D, 0x54, 0xB3, 0x7C, 0xA8, 0x02, 0x47, 0x3F, 0xDA, 0x91, 0x75 };
+    uint8_t des3k3_data[24] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0XEE, 0xFF, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08 };
+
+    MifareDESFireKey key = mifare_desfire_aes_key_new_with_version(aes128_data, 16);
+    check_batch(key, MIFARE_KEY_AES128, AN10922_FLAG_DEFAULT, aes128_derived_data, 16);
+    check_batch(key, MIFARE_KEY_2K3DES, AN10922_FLAG_DEFAULT, NULL, 16);
+    check_batch(key, MIFARE_KEY_AES128, AN10922_FLAG_EMULATE_ISSUE_91, NULL, 16);
+    mifare_desfire_key_free(key);
+
+    key = mifare_desfire_3des_key_new_with_version(aes128_data);
+    check_batch(key, MIFARE_KEY_2K3DES, AN10922_FLAG_DEFAULT, NULL, 16);
+    mifare_desfire_key_free(key);
+
+    // OpenSSL 3 only provides single DES through its legacy provider
+    key = mifare_desfire_des_key_new_with_version(aes128_data);
+    check_batch(key, MIFARE_KEY_2K3DES, AN10922_FLAG_DEFAULT, NULL, 16);
+    check_batch(key, MIFARE_KEY_3K3DES, AN10922_FLAG_DEFAULT, NULL, 24);
+    mifare_desfire_key_free(key);
+
+    key = mifare_desfire_3k3des_key_new_with_version(des3k3_data);
+    check_batch(key, MIFARE_KEY_3K3DES, AN10922_FLAG_DEFAULT, NULL, 24);
+    mifare_desfire_key_free(key);
+}
+
+static MifareDESFireKey
+derive_cstr(MifareKeyDeriver deriver, const char *input)
+{
+    cut_assert_equal_int(0, mifare_key_deriver_begin(deriver), cut_message("mifare_key_deriver_begin failed"));
+    cut_assert_equal_int(0, mifare_key_deriver_update_cstr(deriver, input), cut_message("mifare_key_deriver_update failed"));
+    MifareDESFireKey key = mifare_key_deriver_end(deriver);
+    cut_assert_not_null(key, cut_message("mifare_key_deriver_end failed"));
+    return key;
+}
+
+void
+test_mifare_key_deriver_an10922_cache(void)
+{
+    uint8_t key_data[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0XEE, 0xFF };
+    const char *inputs[] = { "\x04\x78\x2E\x21\x80\x1D\x80\x30\x42\xF5NXP Abu", "\x04\x01\x02\x03\x04\x05\x06", "\x04\x11\x12\x13\x14\x15\x16" };
+
+    MifareDESFireKey master_key = mifare_desfire_aes_key_new_with_version(key_data, 16);
+    MifareKeyDeriver deriver = mifare_key_deriver_new_an10922(master_key, MIFARE_KEY_AES128, AN10922_FLAG_DEFAULT);
+    MifareKeyDeriver cached_deriver = mifare_key_deriver_new_an10922(master_key, MIFARE_KEY_AES128, AN10922_FLAG_DEFAULT);
+    MifareKeyCache cache = mifare_key_cache_new(2);
+    cut_assert_not_null(cache, cut_message("mifare_key_cache_new failed"));
+    mifare_key_deriver_set_cache(cached_deriver, cache);
+
+    // 2 evicts 1 since 0 was used more recently, then 1 evicts 2 and 2 evicts 0
+    const int sequence[] = { 0, 0, 1, 0, 2, 0, 1, 2 };
+    const int hits[]     = { 0, 1, 0, 1, 0, 1, 0, 0 };
+    unsigned long expected_hits = 0;
+    unsigned long cache_hits, cache_misses;
+
+    for (size_t i = 0; i < sizeof(sequence) / sizeof(*sequence); i++) {
+	MifareDESFireKey expected_key = derive_cstr(deriver, inputs[sequence[i]]);
+	MifareDESFireKey key = derive_cstr(cached_deriver, inputs[sequence[i]]);
+
+	expected_hits += hits[i];
+	mifare_key_cache_get_stats(cache, &cache_hits, &cache_misses);
+	cut_assert_equal_int(expected_hits, cache_hits, cut_message("Wrong cache hits after derivation %zu", i));
+	cut_assert_equal_int(i + 1 - expected_hits, cache_misses, cut_message("Wrong cache misses after derivation %zu", i));
+
+	cut_assert_equal_int(expected_key->type, key->type, cut_message("Wrong derived key type"));
+	cut_assert_equal_int(mifare_desfire_key_get_version(expected_key), mifare_desfire_key_get_version(key), cut_message("Wrong derived key version"));
+	cut_assert_equal_memory(expected_key->data, 16, key->data, 16, cut_message("Wrong derived key"));
+
+	// Key schedules are usable
+	uint8_t expected_block[16] = { 0 }, block[16] = { 0 }, ivect[16] = { 0 };
+	mifare_cypher_blocks_chained(NULL, expected_key, ivect, expected_block, 16, MCD_SEND, MCO_ENCYPHER);
+	memset(ivect, 0, sizeof(ivect));
+	mifare_cypher_blocks_chained(NULL, key, ivect, block, 16, MCD_SEND, MCO_ENCYPHER);
+	cut_assert_equal_memory(expected_block, 16, block, 16, cut_message("Wrong key schedule"));
+
+	mifare_desfire_key_free(expected_key);
+	mifare_desfire_key_free(key);
+    }
+
+    // A different master key does not hit entries of the first one
+    key_data[0] ^= 0xFF;
+    MifareDESFireKey other_master_key = mifare_desfire_aes_key_new_with_version(key_data, 16);
+    MifareKeyDeriver other_deriver = mifare_key_deriver_new_an10922(other_master_key, MIFARE_KEY_AES128, AN10922_FLAG_DEFAULT);
+    mifare_key_deriver_set_cache(other_deriver, cache);
+    mifare_desfire_key_free(derive_cstr(other_deriver, inputs[2]));
+    mifare_key_cache_get_stats(cache, &cache_hits, NULL);
+    cut_assert_equal_int(expected_hits, cache_hits, cut_message("Hit for another master key"));
+
+    mifare_key_deriver_free(other_deriver);
+    mifare_desfire_key_free(other_master_key);
+    mifare_key_deriver_free(cached_deriver);
+    mifare_key_deriver_free(deriver);
+    mifare_key_cache_free(cache);
+    mifare_desfire_key_free(master_key);
+}